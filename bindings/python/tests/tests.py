@@ -89,6 +89,17 @@ class TestiPodFunctions(unittest.TestCase):
         self.assertEqual(type(gpod.version_info),
                          types.TupleType)
 
+    def testParseFlags(self):
+        db = gpod.itdb_parse_with_flags(self.mp,
+                                        gpod.ITDB_PARSE_FLAGS_LAZY_TRACKS,
+                                        None)
+        self.failUnless(db)
+        gpod.itdb_free(db)
+        for flags in (gpod.ITDB_PARSE_FLAGS_INTERN_STRINGS,
+                      gpod.ITDB_PARSE_FLAGS_ARENA):
+            self.assertRaises(ValueError, gpod.itdb_parse_with_flags,
+                              self.mp, flags, None)
+
 class TestPhotoDatabase(unittest.TestCase):
     def setUp(self):
         self.mp = tempfile.mkdtemp()
@@ -80,6 +80,7 @@ ipod_gstring_flush (struct iPodSharedDataBuffer *shared, GError **error)
 	if (!success) {
                 return FALSE;
 	}
+	itdb_fsync_written_file (shared->filename);
 	g_string_free (shared->data, TRUE);
 	g_free (shared->filename);
 	g_free (shared);
@@ -643,6 +643,192 @@ sha1_transform (guint32  buf[5],
 #undef expand
 #undef subRound
 
+/* SHA-1 using the SHA extensions of x86 processors, which compute four
+   rounds per instruction. The code is only compiled where the compiler
+   can target these instructions in a single function, and only used
+   when the processor has them. */
+
+#if (defined (__x86_64__) || defined (__i386__)) && \
+    ((defined (__GNUC__) && __GNUC__ >= 5) || defined (__clang__))
+#define SHA1_SHA_NI 1
+#endif
+
+#ifdef SHA1_SHA_NI
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define SHA_NI_TARGET __attribute__ ((__target__ ("sha,ssse3,sse4.1")))
+
+/* Four rounds of group @g from the message words in @cur, computing
+   the message schedule of later groups alongside */
+#define sha_ni_rounds(g, e_in, e_out, cur, next, nnext, prev)   \
+  (e_in = _mm_sha1nexte_epu32 (e_in, cur),                      \
+   e_out = abcd,                                                \
+   next = _mm_sha1msg2_epu32 (next, cur),                       \
+   abcd = _mm_sha1rnds4_epu32 (abcd, e_in, (g) / 5),            \
+   prev = _mm_sha1msg1_epu32 (prev, cur),                       \
+   nnext = _mm_xor_si128 (nnext, cur))
+
+SHA_NI_TARGET static void
+sha1_transform_sha_ni (guint32       buf[5],
+                       const guchar *data,
+                       gsize         blocks)
+{
+  const __m128i mask = _mm_set_epi64x (0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  abcd = _mm_loadu_si128 ((const __m128i *) buf);
+  abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+  e0 = _mm_set_epi32 ((gint) buf[4], 0, 0, 0);
+
+  while (blocks--)
+    {
+      abcd_save = abcd;
+      e0_save = e0;
+
+      /* Rounds 0-15 load the block */
+      msg0 = _mm_loadu_si128 ((const __m128i *) (data + 0));
+      msg0 = _mm_shuffle_epi8 (msg0, mask);
+      e0 = _mm_add_epi32 (e0, msg0);
+      e1 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+
+      msg1 = _mm_loadu_si128 ((const __m128i *) (data + 16));
+      msg1 = _mm_shuffle_epi8 (msg1, mask);
+      e1 = _mm_sha1nexte_epu32 (e1, msg1);
+      e0 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 0);
+      msg0 = _mm_sha1msg1_epu32 (msg0, msg1);
+
+      msg2 = _mm_loadu_si128 ((const __m128i *) (data + 32));
+      msg2 = _mm_shuffle_epi8 (msg2, mask);
+      e0 = _mm_sha1nexte_epu32 (e0, msg2);
+      e1 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e0, 0);
+      msg1 = _mm_sha1msg1_epu32 (msg1, msg2);
+      msg0 = _mm_xor_si128 (msg0, msg2);
+
+      msg3 = _mm_loadu_si128 ((const __m128i *) (data + 48));
+      msg3 = _mm_shuffle_epi8 (msg3, mask);
+      sha_ni_rounds (3, e1, e0, msg3, msg0, msg1, msg2);
+
+      /* Rounds 16-79 */
+      sha_ni_rounds (4,  e0, e1, msg0, msg1, msg2, msg3);
+      sha_ni_rounds (5,  e1, e0, msg1, msg2, msg3, msg0);
+      sha_ni_rounds (6,  e0, e1, msg2, msg3, msg0, msg1);
+      sha_ni_rounds (7,  e1, e0, msg3, msg0, msg1, msg2);
+      sha_ni_rounds (8,  e0, e1, msg0, msg1, msg2, msg3);
+      sha_ni_rounds (9,  e1, e0, msg1, msg2, msg3, msg0);
+      sha_ni_rounds (10, e0, e1, msg2, msg3, msg0, msg1);
+      sha_ni_rounds (11, e1, e0, msg3, msg0, msg1, msg2);
+      sha_ni_rounds (12, e0, e1, msg0, msg1, msg2, msg3);
+      sha_ni_rounds (13, e1, e0, msg1, msg2, msg3, msg0);
+      sha_ni_rounds (14, e0, e1, msg2, msg3, msg0, msg1);
+      sha_ni_rounds (15, e1, e0, msg3, msg0, msg1, msg2);
+      sha_ni_rounds (16, e0, e1, msg0, msg1, msg2, msg3);
+      sha_ni_rounds (17, e1, e0, msg1, msg2, msg3, msg0);
+      sha_ni_rounds (18, e0, e1, msg2, msg3, msg0, msg1);
+      /* the last group needs no more message schedule */
+      e1 = _mm_sha1nexte_epu32 (e1, msg3);
+      e0 = abcd;
+      abcd = _mm_sha1rnds4_epu32 (abcd, e1, 3);
+
+      /* Build message digest */
+      e0 = _mm_sha1nexte_epu32 (e0, e0_save);
+      abcd = _mm_add_epi32 (abcd, abcd_save);
+
+      data += SHA1_DATASIZE;
+    }
+
+  abcd = _mm_shuffle_epi32 (abcd, 0x1B);
+  _mm_storeu_si128 ((__m128i *) buf, abcd);
+  buf[4] = (guint32) _mm_extract_epi32 (e0, 3);
+}
+
+#undef sha_ni_rounds
+#undef SHA_NI_TARGET
+
+static gpointer
+sha1_detect_sha_ni (gpointer data)
+{
+  guint eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return GINT_TO_POINTER (FALSE);
+
+  /* SSSE3 and SSE4.1 */
+  __cpuid (1, eax, ebx, ecx, edx);
+  if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+    return GINT_TO_POINTER (FALSE);
+
+  /* SHA */
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return GINT_TO_POINTER ((ebx & (1 << 29)) != 0);
+}
+
+static gboolean sha1_force_generic = FALSE;
+
+static gboolean
+sha1_have_sha_ni (void)
+{
+  static GOnce sha_ni_once = G_ONCE_INIT;
+
+  if (sha1_force_generic)
+    return FALSE;
+  return GPOINTER_TO_INT (g_once (&sha_ni_once, sha1_detect_sha_ni, NULL));
+}
+
+#endif /* SHA1_SHA_NI */
+
+gboolean
+itdb_gchecksum_sha1_accelerated (void)
+{
+#ifdef SHA1_SHA_NI
+  return sha1_have_sha_ni ();
+#else
+  return FALSE;
+#endif
+}
+
+/* Only meant for the tests: not thread safe */
+void
+itdb_gchecksum_sha1_force_generic (gboolean force)
+{
+#ifdef SHA1_SHA_NI
+  sha1_force_generic = force;
+#endif
+}
+
+/* Hash @blocks blocks of SHA1_DATASIZE bytes from @buffer, which may
+   be sha1->data itself */
+static void
+sha1_sum_blocks (Sha1sum      *sha1,
+                 const guchar *buffer,
+                 gsize         blocks)
+{
+#ifdef SHA1_SHA_NI
+  if (sha1_have_sha_ni ())
+    {
+      sha1_transform_sha_ni (sha1->buf, buffer, blocks);
+      return;
+    }
+#endif
+
+  while (blocks--)
+    {
+      if (buffer != (const guchar *) sha1->data)
+        memcpy (sha1->data, buffer, SHA1_DATASIZE);
+
+      sha_byte_reverse (sha1->data, SHA1_DATASIZE);
+      sha1_transform (sha1->buf, sha1->data);
+
+      buffer += SHA1_DATASIZE;
+    }
+}
+
 static void
 sha1_sum_update (Sha1sum      *sha1,
                  const guchar *buffer,
@@ -674,23 +860,21 @@ sha1_sum_update (Sha1sum      *sha1,
       
       memcpy (p, buffer, dataCount);
 
-      sha_byte_reverse (sha1->data, SHA1_DATASIZE);
-      sha1_transform (sha1->buf, sha1->data);
+      sha1_sum_blocks (sha1, (guchar *) sha1->data, 1);
 
       buffer += dataCount;
       count -= dataCount;
     }
 
   /* Process data in SHA1_DATASIZE chunks */
-  while (count >= SHA1_DATASIZE)
+  if (count >= SHA1_DATASIZE)
     {
-      memcpy (sha1->data, buffer, SHA1_DATASIZE);
-      
-      sha_byte_reverse (sha1->data, SHA1_DATASIZE);
-      sha1_transform (sha1->buf, sha1->data);
+      gsize blocks = count / SHA1_DATASIZE;
 
-      buffer += SHA1_DATASIZE;
-      count -= SHA1_DATASIZE;
+      sha1_sum_blocks (sha1, buffer, blocks);
+
+      buffer += blocks * SHA1_DATASIZE;
+      count -= blocks * SHA1_DATASIZE;
     }
 
   /* Handle any remaining bytes of data. */
@@ -1243,7 +1427,7 @@ g_checksum_update (GChecksum    *checksum,
  * 
  * Since: 2.16
  */
-G_CONST_RETURN gchar *
+const gchar *
 g_checksum_get_string (GChecksum *checksum)
 {
   gchar *str = NULL;
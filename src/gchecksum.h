@@ -18,11 +18,13 @@
  * Boston, MA 02111-1307, USA.
  */
 
+/* GLib 2.16 and later have their own gchecksum.h with the same include
+ * guard, whose declarations are used instead then */
+#include <glib.h>
+
 #ifndef __G_CHECKSUM_H__
 #define __G_CHECKSUM_H__
 
-#include <glib/gtypes.h>
-
 G_BEGIN_DECLS
 
 /**
@@ -70,3 +72,17 @@ gchar *g_compute_checksum_for_string (GChecksumType  checksum_type,
 G_END_DECLS
 
 #endif /* __G_CHECKSUM_H__ */
+
+#ifndef __ITDB_GCHECKSUM_H__
+#define __ITDB_GCHECKSUM_H__
+
+G_BEGIN_DECLS
+
+/* for tests/test-checksum: whether SHA-1 uses the SHA extensions of
+ * the processor, and a way to use the portable code instead */
+G_GNUC_INTERNAL gboolean itdb_gchecksum_sha1_accelerated (void);
+G_GNUC_INTERNAL void     itdb_gchecksum_sha1_force_generic (gboolean force);
+
+G_END_DECLS
+
+#endif /* __ITDB_GCHECKSUM_H__ */
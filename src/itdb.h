@@ -1774,6 +1774,79 @@ typedef enum
     ITDB_ERROR_SQLITE
 } ItdbError;
 
+/**
+ * ItdbParseFlags:
+ * @ITDB_PARSE_FLAGS_NONE:           parse the whole database
+ * @ITDB_PARSE_FLAGS_LAZY_TRACKS:    only decode the numeric fields and
+ *                                   the ipod_path of each track; all
+ *                                   other strings and the chapterdata
+ *                                   are decoded by
+ *                                   itdb_track_materialize(). Until
+ *                                   then a field that is still NULL is
+ *                                   taken from the iTunesDB when the
+ *                                   database is written: to clear it,
+ *                                   set it to an empty string.
+ * @ITDB_PARSE_FLAGS_INTERN_STRINGS: tracks of the database share a
+ *                                   single copy of identical album,
+ *                                   artist, albumartist, genre,
+ *                                   composer, filetype and sort_*
+ *                                   strings. The application must not
+ *                                   g_free() these fields, but simply
+ *                                   assign a newly allocated string to
+ *                                   change them. This also rules out
+ *                                   language bindings whose setters
+ *                                   free the previous string (the
+ *                                   Python bindings refuse this flag).
+ * @ITDB_PARSE_FLAGS_ARENA:          allocate the tracks and their
+ *                                   strings from large blocks of memory
+ *                                   owned by the database, which makes
+ *                                   parsing and itdb_free() a lot
+ *                                   cheaper. The same rule as for
+ *                                   %ITDB_PARSE_FLAGS_INTERN_STRINGS
+ *                                   applies to all string fields of
+ *                                   these tracks, including the ones
+ *                                   decoded by itdb_track_materialize().
+ *                                   Use itdb_track_free() as usual to
+ *                                   free such a track.
+ *
+ * Flags to pass to itdb_parse_with_flags() and
+ * itdb_parse_file_with_flags()
+ *
+ * Since: 0.8.2
+ */
+typedef enum
+{
+    ITDB_PARSE_FLAGS_NONE           = 0,
+    ITDB_PARSE_FLAGS_LAZY_TRACKS    = 1 << 0,
+    ITDB_PARSE_FLAGS_INTERN_STRINGS = 1 << 1,
+    ITDB_PARSE_FLAGS_ARENA          = 1 << 2
+} ItdbParseFlags;
+
+/**
+ * ItdbParseCallbacks:
+ * @track:           called for each track in the order of the
+ *                   iTunesDB. @track is owned by libgpod and only
+ *                   valid during the call.
+ * @playlist:        called for each playlist before its members are
+ *                   reported. @playlist doesn't contain any tracks and
+ *                   is only valid until the next call to @playlist.
+ * @playlist_member: called for each member of @playlist with the ID
+ *                   of the member track (see #Itdb_Track.id) in the
+ *                   order of the playlist
+ *
+ * Callbacks used by itdb_parse_file_with_callbacks(). Each of them may
+ * be NULL. Returning FALSE from a callback stops the parsing.
+ *
+ * Since: 0.8.2
+ */
+typedef struct
+{
+    gboolean (* track) (Itdb_Track *track, gpointer user_data);
+    gboolean (* playlist) (Itdb_Playlist *playlist, gpointer user_data);
+    gboolean (* playlist_member) (Itdb_Playlist *playlist,
+				  guint32 track_id, gpointer user_data);
+} ItdbParseCallbacks;
+
 
 /* Error domain */
 #define ITDB_ERROR itdb_file_error_quark ()
@@ -1790,7 +1863,18 @@ GQuark     itdb_file_error_quark      (void);
 /* functions for reading/writing database, general itdb functions */
 Itdb_iTunesDB *itdb_parse (const gchar *mp, GError **error);
 Itdb_iTunesDB *itdb_parse_file (const gchar *filename, GError **error);
+Itdb_iTunesDB *itdb_parse_with_flags (const gchar *mp, ItdbParseFlags flags,
+				      GError **error);
+Itdb_iTunesDB *itdb_parse_file_with_flags (const gchar *filename,
+					   ItdbParseFlags flags,
+					   GError **error);
+gboolean itdb_parse_file_with_callbacks (const gchar *filename,
+					 const ItdbParseCallbacks *callbacks,
+					 gpointer user_data,
+					 GError **error);
 gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error);
+gsize itdb_predict_size (Itdb_iTunesDB *itdb, GError **error);
+void itdb_set_compression_level (Itdb_iTunesDB *itdb, gint level);
 gboolean itdb_write_file (Itdb_iTunesDB *itdb, const gchar *filename,
 			  GError **error);
 gboolean itdb_shuffle_write (Itdb_iTunesDB *itdb, GError **error);
@@ -1868,7 +1952,12 @@ void itdb_track_add (Itdb_iTunesDB *itdb, Itdb_Track *track, gint32 pos);
 void itdb_track_remove (Itdb_Track *track);
 void itdb_track_unlink (Itdb_Track *track);
 Itdb_Track *itdb_track_duplicate (Itdb_Track *tr);
+gboolean itdb_track_materialize (Itdb_Track *track, GError **error);
 Itdb_Track *itdb_track_by_id (Itdb_iTunesDB *itdb, guint32 id);
+Itdb_Track *itdb_track_by_dbid (Itdb_iTunesDB *itdb, guint64 dbid);
+Itdb_Track *itdb_track_nth (Itdb_iTunesDB *itdb, guint32 n);
+void itdb_track_changed (Itdb_Track *track);
+void itdb_set_change_tracking (Itdb_iTunesDB *itdb, gboolean enable);
 GTree *itdb_track_id_tree_create (Itdb_iTunesDB *itdb);
 void itdb_track_id_tree_destroy (GTree *idtree);
 Itdb_Track *itdb_track_id_tree_by_id (GTree *idtree, guint32 id);
@@ -45,6 +45,10 @@
 #endif
 #include <glib/gi18n-lib.h>
 
+#ifdef WITH_INTERNAL_GCHECKSUM
+#include "gchecksum.h"
+#endif
+
 static const Itdb_IpodInfo ipod_info_table [] = {
     /* Handle idiots who hose their iPod file system, or lucky people
        with iPods we don't yet know about*/
@@ -1118,6 +1122,7 @@ gboolean itdb_device_write_sysinfo (Itdb_Device *device, GError **error)
 				      sysinfo);
 	    }
 	    fclose (sysinfo);
+	    itdb_fsync_written_file (sysfile);
 	    success = TRUE;
 	}
 	else
@@ -2003,6 +2008,186 @@ G_GNUC_INTERNAL gboolean itdb_device_write_checksum (Itdb_Device *device,
     g_assert_not_reached ();
 }
 
+/* Incremental counterpart of itdb_device_write_checksum(): the
+ * iTunesDB is passed to itdb_device_checksum_update() piece by piece
+ * while it is written, in its final form but without checksum. The
+ * mhbd header is collected first and hashed with the fields the
+ * checksum excludes zeroed out, so the data itself is never touched
+ * and never needs a second pass. */
+struct _Itdb_ChecksumState {
+    Itdb_Device *device;
+    ItdbChecksumType type;
+    GChecksum *checksum;
+    unsigned char *key;           /* HMAC key for ITDB_CHECKSUM_HASH58 */
+    gsize offset;                 /* number of bytes fed so far */
+    guchar header[sizeof (MhbdHeader)];
+};
+
+/* Returns a new checksum state for @device, or NULL if the device
+ * doesn't use checksums or on error (in which case @error is set).
+ * Compressed iTunesCDBs must be checksummed after compression with
+ * itdb_device_write_checksum(). */
+Itdb_ChecksumState *itdb_device_checksum_new (Itdb_Device *device,
+					      GError **error)
+{
+    Itdb_ChecksumState *state;
+    ItdbChecksumType type;
+    int i;
+
+    type = itdb_device_get_checksum_type (device);
+    switch (type) {
+	case ITDB_CHECKSUM_NONE:
+	    return NULL;
+	case ITDB_CHECKSUM_HASH58:
+	case ITDB_CHECKSUM_HASH72:
+	case ITDB_CHECKSUM_HASHAB:
+	    break;
+	case ITDB_CHECKSUM_UNKNOWN:
+	    g_set_error (error, 0, -1, "Unsupported checksum type");
+	    return NULL;
+    }
+
+    state = g_new0 (Itdb_ChecksumState, 1);
+    state->device = device;
+    state->type = type;
+    state->checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    if (type == ITDB_CHECKSUM_HASH58) {
+	state->key = itdb_hash58_get_key (device, error);
+	if (state->key == NULL) {
+	    itdb_device_checksum_free (state);
+	    return NULL;
+	}
+	/* inner hash of the HMAC */
+	for (i=0; i < 64; i++)
+	    state->key[i] ^= 0x36;
+	g_checksum_update (state->checksum, state->key, 64);
+    }
+    return state;
+}
+
+/* Hash the mhbd header collected in @state the way
+ * itdb_hash58_write_hash() and friends do */
+static void checksum_update_header (Itdb_ChecksumState *state)
+{
+    guchar copy[sizeof (MhbdHeader)];
+    MhbdHeader *header = (MhbdHeader *)copy;
+
+    memcpy (copy, state->header, sizeof (copy));
+    g_assert (strncmp (header->header_id, "mhbd", strlen ("mhbd")) == 0);
+
+    /* Those fields must be zero'ed out for the sha1 calculation */
+    memset (&header->db_id, 0, sizeof (header->db_id));
+    memset (&header->hash58, 0, sizeof (header->hash58));
+    switch (state->type) {
+	case ITDB_CHECKSUM_HASH58:
+	    memset (&header->unk_0x32, 0, sizeof (header->unk_0x32));
+	    break;
+	case ITDB_CHECKSUM_HASHAB:
+	    memset (&header->hashAB, 0, sizeof (header->hashAB));
+	    /* fall through */
+	case ITDB_CHECKSUM_HASH72:
+	    memset (&header->hash72, 0, sizeof (header->hash72));
+	    break;
+	default:
+	    g_assert_not_reached ();
+    }
+    header->hashing_scheme = GUINT16_TO_LE (state->type);
+
+    g_checksum_update (state->checksum, copy, sizeof (copy));
+}
+
+/* Feed the next @len bytes of the iTunesDB at @data to @state */
+void itdb_device_checksum_update (Itdb_ChecksumState *state,
+				  const guchar *data, gsize len)
+{
+    g_return_if_fail (state);
+
+    if (state->offset < sizeof (state->header)) {
+	gsize n = MIN (len, sizeof (state->header) - state->offset);
+
+	memcpy (state->header + state->offset, data, n);
+	state->offset += n;
+	data += n;
+	len -= n;
+	if (state->offset < sizeof (state->header))
+	    return;
+	checksum_update_header (state);
+    }
+    if (len > 0) {
+	g_checksum_update (state->checksum, data, len);
+	state->offset += len;
+    }
+}
+
+/* Finish the checksum of the iTunesDB fed to @state. On success
+ * @header and @header_len are set to the mhbd header with the
+ * checksum filled in. It has to be written over the start of the
+ * iTunesDB and stays valid until @state is freed. */
+gboolean itdb_device_checksum_finish (Itdb_ChecksumState *state,
+				      const guchar **header,
+				      gsize *header_len,
+				      GError **error)
+{
+    MhbdHeader *mhbd;
+    guchar sha1[20];
+    gsize sha1_len = sizeof (sha1);
+    gboolean result = TRUE;
+    int i;
+
+    g_return_val_if_fail (state, FALSE);
+    g_return_val_if_fail (header, FALSE);
+    g_return_val_if_fail (header_len, FALSE);
+
+    if (state->offset < sizeof (state->header)) {
+	g_set_error (error, 0, -1, "iTunesDB file too small to write checksum");
+	return FALSE;
+    }
+    g_checksum_get_digest (state->checksum, sha1, &sha1_len);
+
+    mhbd = (MhbdHeader *)state->header;
+    mhbd->hashing_scheme = GUINT16_TO_LE (state->type);
+    switch (state->type) {
+	case ITDB_CHECKSUM_HASH58:
+	    /* outer hash of the HMAC */
+	    for (i=0; i < 64; i++)
+		state->key[i] ^= 0x36 ^ 0x5c;
+	    g_checksum_reset (state->checksum);
+	    g_checksum_update (state->checksum, state->key, 64);
+	    g_checksum_update (state->checksum, sha1, sha1_len);
+	    sha1_len = sizeof (sha1);
+	    g_checksum_get_digest (state->checksum, sha1, &sha1_len);
+	    g_assert (sha1_len <= sizeof (mhbd->hash58));
+	    memcpy (&mhbd->hash58, sha1, sha1_len);
+	    break;
+	case ITDB_CHECKSUM_HASH72:
+	    memset (&mhbd->hash58, 0, sizeof (mhbd->hash58));
+	    result = itdb_hash72_compute_hash_for_sha1 (state->device, sha1,
+							mhbd->hash72, error);
+	    break;
+	case ITDB_CHECKSUM_HASHAB:
+	    memset (&mhbd->hash58, 0, sizeof (mhbd->hash58));
+	    memset (&mhbd->hash72, 0, sizeof (mhbd->hash72));
+	    result = itdb_hashAB_compute_hash_for_sha1 (state->device, sha1,
+							mhbd->hashAB, error);
+	    break;
+	default:
+	    g_assert_not_reached ();
+    }
+
+    *header = state->header;
+    *header_len = sizeof (state->header);
+    return result;
+}
+
+void itdb_device_checksum_free (Itdb_ChecksumState *state)
+{
+    if (state) {
+	g_checksum_free (state->checksum);
+	g_free (state->key);
+	g_free (state);
+    }
+}
+
 #ifdef WIN32
 #include <windows.h>
 #else
@@ -181,6 +181,17 @@ G_GNUC_INTERNAL gboolean itdb_device_write_checksum (Itdb_Device *device,
 						     unsigned char *itdb_data,
 						     gsize itdb_len,
 						     GError **error);
+typedef struct _Itdb_ChecksumState Itdb_ChecksumState;
+G_GNUC_INTERNAL Itdb_ChecksumState *itdb_device_checksum_new (Itdb_Device *device,
+							      GError **error);
+G_GNUC_INTERNAL void itdb_device_checksum_update (Itdb_ChecksumState *state,
+						  const guchar *data,
+						  gsize len);
+G_GNUC_INTERNAL gboolean itdb_device_checksum_finish (Itdb_ChecksumState *state,
+						      const guchar **header,
+						      gsize *header_len,
+						      GError **error);
+G_GNUC_INTERNAL void itdb_device_checksum_free (Itdb_ChecksumState *state);
 G_GNUC_INTERNAL void itdb_device_set_timezone_info (Itdb_Device *device);
 G_GNUC_INTERNAL gboolean itdb_device_is_iphone_family (const Itdb_Device *device);
 G_GNUC_INTERNAL gboolean itdb_device_is_shuffle (const Itdb_Device *device);
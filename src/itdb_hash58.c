@@ -224,6 +224,24 @@ static unsigned char *itdb_compute_hash (const unsigned char *firewire_id,
     return hash;
 }
 
+/* Returns the 64 bytes HMAC-SHA1 key used by itdb_hash58_write_hash()
+ * for @device, to be freed with g_free(), or NULL on error */
+unsigned char *itdb_hash58_get_key (Itdb_Device *device, GError **error)
+{
+    unsigned char firewire_id[20];
+    unsigned char *key;
+
+    if (!itdb_device_get_hex_uuid(device, firewire_id)) {
+	g_set_error (error, 0, -1, "Couldn't find the iPod firewire ID");
+	return NULL;
+    }
+    key = generate_key (firewire_id);
+    if (key == NULL) {
+	g_set_error (error, 0, -1, "Failed to compute checksum");
+    }
+    return key;
+}
+
 gboolean itdb_hash58_write_hash (Itdb_Device *device, 
 				 unsigned char *itdb_data, 
 				 gsize itdb_len,
@@ -139,6 +139,8 @@ static gboolean write_hash_info (const Itdb_Device *device,
     filename = get_hash_info_path (device);
     success = g_file_set_contents (filename, (void *)&hash_info,
 				   sizeof (hash_info), NULL);
+    if (success)
+	itdb_fsync_written_file (filename);
     g_free (filename);
     
     return success;
@@ -180,24 +182,27 @@ static struct Hash78Info *read_hash_info (const Itdb_Device *device)
     return info;
 }
 
-static void itdb_hash72_compute_itunesdb_sha1 (unsigned char *itdb_data, 
+/* Computes the sha1 of the iTunesDB at @itdb_data the way hash72
+ * expects it. The fields that must be zero'ed out are cleared in a copy
+ * of the mhbd header so that @itdb_data can be a read-only mapping of
+ * the file. */
+static void itdb_hash72_compute_itunesdb_sha1 (const unsigned char *itdb_data, 
 					       gsize itdb_len,
 					       unsigned char sha1[20])
 {
-    guchar backup18[8];
-    guchar backup32[20];
-    guchar hash72[46];
+    guchar copy[sizeof (MhbdHeader)];
+    gsize header_len;
     gsize sha1_len;
     GChecksum *checksum;
     MhbdHeader *header;
 
     g_assert (itdb_len >= 0x6c);
 
-    header = (MhbdHeader *)itdb_data;
+    header_len = MIN (itdb_len, sizeof (copy));
+    memset (copy, 0, sizeof (copy));
+    memcpy (copy, itdb_data, header_len);
+    header = (MhbdHeader *)copy;
     g_assert (strncmp (header->header_id, "mhbd", strlen ("mhbd")) == 0);
-    memcpy (backup18, &header->db_id, sizeof (backup18));
-    memcpy (backup32, &header->unk_0x32, sizeof (backup32));
-    memcpy (hash72, &header->hash72, sizeof (hash72));
 
     /* Those fields must be zero'ed out for the sha1 calculation */
     memset(&header->db_id, 0, sizeof (header->db_id));
@@ -207,23 +212,22 @@ static void itdb_hash72_compute_itunesdb_sha1 (unsigned char *itdb_data,
 
     sha1_len = g_checksum_type_get_length (G_CHECKSUM_SHA1);
     checksum = g_checksum_new (G_CHECKSUM_SHA1);
-    g_checksum_update (checksum, itdb_data, itdb_len);
+    g_checksum_update (checksum, copy, header_len);
+    g_checksum_update (checksum, itdb_data + header_len,
+		       itdb_len - header_len);
     g_checksum_get_digest (checksum, sha1, &sha1_len);
     g_checksum_free (checksum);
-
-    memcpy (&header->db_id, backup18, sizeof (backup18));
-    memcpy (&header->unk_0x32, backup32, sizeof (backup32));
 }
 
 gboolean itdb_hash72_extract_hash_info (const Itdb_Device *device, 
-					unsigned char *itdb_data, 
+					const unsigned char *itdb_data, 
 					gsize itdb_len)
 {
     guchar hash72[46];
     guchar sha1[20];
     guchar iv[16];
     guchar random_bytes[12];
-    MhbdHeader *header;
+    const MhbdHeader *header;
     int iv_extracted;
     struct Hash78Info *hash_info;
 
@@ -245,7 +249,7 @@ gboolean itdb_hash72_extract_hash_info (const Itdb_Device *device,
 	return TRUE;
     }
 
-    header = (MhbdHeader *)itdb_data;
+    header = (const MhbdHeader *)itdb_data;
     g_assert (strncmp (header->header_id, "mhbd", strlen ("mhbd")) == 0);
     memcpy (hash72, &header->hash72, sizeof (hash72));
 
@@ -295,6 +299,7 @@ gboolean itdb_hash72_write_hash (const Itdb_Device *device,
 
     header = (MhbdHeader *)itdb_data;
     header->hashing_scheme = GUINT16_FROM_LE (ITDB_CHECKSUM_HASH72);
+    memset (&header->hash58, 0, sizeof (header->hash58));
     itdb_hash72_compute_itunesdb_sha1 (itdb_data, itdb_len, sha1);
     return itdb_hash72_compute_hash_for_sha1 (device, sha1, header->hash72, error);
 }
@@ -126,6 +126,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define ITUNESDB_DEBUG 0
 #define ITUNESDB_MHIT_DEBUG 0
@@ -247,13 +250,14 @@ enum MHOD52_SORTTYPE {
     MHOD52_SORTTYPE_TVEPISODE= 0x1f*/
 };
 
+/* the collate keys point into track->priv->collate_keys */
 struct mhod52track
 {
-    gchar *album;
-    gchar *title;
-    gchar *artist;
-    gchar *genre;
-    gchar *composer;
+    const gchar *album;
+    const gchar *title;
+    const gchar *artist;
+    const gchar *genre;
+    const gchar *composer;
     gint track_nr;
     gint cd_nr;
     gint index;
@@ -283,7 +287,7 @@ struct _MHODData
 	Itdb_Chapterdata *chapterdata;
 	Itdb_SPLPref *splpref;
 	Itdb_SPLRules *splrules;
-	GList *mhod52coltracks;
+	GPtrArray *mhod52coltracks;
     } data;
     enum MHOD52_SORTTYPE mhod52sorttype;
     GList *mhod53_list;
@@ -349,8 +353,13 @@ static void fcontents_set_reversed(FContents *cts, gboolean reversed)
 }
 
 /* Read the contents of @filename and return a FContents
-   struct. Returns NULL in case of error and @error is set
-   accordingly */
+   struct. The file is memory-mapped read-only if possible so that the
+   parser can read headers and strings directly from the page cache;
+   @cts->contents must not be modified in that case. Note that reading
+   a mapping raises SIGBUS if the file becomes unreadable (e.g. the
+   iPod is unplugged), which matters for the iTunesDB mapping kept
+   alive by ITDB_PARSE_FLAGS_LAZY_TRACKS. Returns NULL in case of error
+   and @error is set accordingly */
 static FContents *fcontents_read (const gchar *fname, GError **error)
 {
     FContents *cts;
@@ -360,6 +369,22 @@ static FContents *fcontents_read (const gchar *fname, GError **error)
     cts = g_new0 (FContents, 1);
     fcontents_set_reversed (cts, FALSE);
 
+    cts->mapped_file = g_mapped_file_new (fname, FALSE, NULL);
+    if (cts->mapped_file)
+    {
+	cts->contents = g_mapped_file_get_contents (cts->mapped_file);
+	cts->length = g_mapped_file_get_length (cts->mapped_file);
+	if (cts->contents)
+	{
+	    cts->filename = g_strdup (fname);
+	    return cts;
+	}
+	/* empty files can't be mapped -- read them the usual way */
+	g_mapped_file_free (cts->mapped_file);
+	cts->mapped_file = NULL;
+	cts->length = 0;
+    }
+
     if (g_file_get_contents (fname, &cts->contents, &cts->length, error))
     {
 	cts->filename = g_strdup (fname);
@@ -380,18 +405,147 @@ static void fcontents_free (FContents *cts)
     if (cts)
     {
 	g_free (cts->filename);
-	g_free (cts->contents);
+	if (cts->mapped_file)
+	    g_mapped_file_free (cts->mapped_file);
+	else
+	    g_free (cts->contents);
 	/* must not g_error_free (cts->error) because the error was
 	   propagated -> might free the error twice */
 	g_free (cts);
     }
 }
 
-static void itdb_fsync (void)
+/* Flush the data of the file open as @fd to disk. Returns 0 on
+   success like fsync(). */
+static int itdb_fdatasync (int fd)
+{
+#ifdef WIN32
+    return 0;
+#elif defined(HAVE_FDATASYNC)
+    return fdatasync (fd);
+#else
+    return fsync (fd);
+#endif
+}
+
+/* Flush @filename and the directory containing it to disk. The file
+   may have been removed, in which case only the directory is
+   flushed. Errors are ignored: this only protects against the iPod
+   being disconnected early. */
+void itdb_fsync_file (const gchar *filename)
 {
 #ifndef WIN32
-    sync();
+    gchar *dirname;
+    int fd;
+
+    g_return_if_fail (filename);
+
+    fd = g_open (filename, O_RDONLY, 0);
+    if (fd != -1)
+    {
+	itdb_fdatasync (fd);
+	close (fd);
+    }
+    /* the directory entry, e.g. after renaming the file into place */
+    dirname = g_path_get_dirname (filename);
+    fd = g_open (dirname, O_RDONLY, 0);
+    if (fd != -1)
+    {
+	fsync (fd);
+	close (fd);
+    }
+    g_free (dirname);
+#endif
+}
+
+/* Must be called by the writers for every file they finished writing
+   to the iPod. With syncfs() itdb_fsync() flushes the iPod's file
+   system as a whole and nothing needs to be done here. Otherwise the
+   file and its directory are flushed right away -- flushing every
+   file system on the machine with sync() stalls other iPods and
+   disks. */
+void itdb_fsync_written_file (const gchar *filename)
+{
+#ifndef HAVE_SYNCFS
+    itdb_fsync_file (filename);
+#endif
+}
+
+/* Make sure everything written to the iPod of @itdb is on disk as some
+   people tend to disconnect as soon as gtkpod returns. With syncfs()
+   only the file system the iPod is mounted on is flushed, including
+   the tracks copied with itdb_cp(). @filename (may be NULL) is
+   flushed on its own if @itdb has no mountpoint or if it was written
+   to another file system, e.g. a backup on the local disk. Without
+   syncfs() the files were flushed by itdb_fsync_written_file()
+   already. */
+static void itdb_fsync (Itdb_iTunesDB *itdb, const gchar *filename)
+{
+#ifdef HAVE_SYNCFS
+    const gchar *mountpoint = itdb_get_mountpoint (itdb);
+    gboolean on_ipod = FALSE;
+
+    if (mountpoint)
+    {
+	struct stat mount_stat, file_stat;
+	int fd, res = -1;
+
+	fd = g_open (mountpoint, O_RDONLY, 0);
+	if (fd != -1)
+	{
+	    res = syncfs (fd);
+	    if (filename && (fstat (fd, &mount_stat) == 0) &&
+		(g_stat (filename, &file_stat) == 0))
+	    {
+		on_ipod = (mount_stat.st_dev == file_stat.st_dev);
+	    }
+	    close (fd);
+	}
+	if (res != 0)
+	{   /* better stall than lose the database */
+	    sync ();
+	    on_ipod = TRUE;
+	}
+    }
+    if (filename && !on_ipod)
+    {
+	itdb_fsync_file (filename);
+    }
+#endif
+}
+
+/* number of threads set with itdb_set_thread_count(), 0 if it
+   depends on the number of CPUs */
+static guint thread_count_override = 0;
+
+/* Use @n threads for the work spread over several CPUs regardless of
+   their number, or go back to one per CPU if @n is 0. Only meant for
+   the tests, which have to cover the threaded code paths on any
+   machine. */
+G_GNUC_INTERNAL void itdb_set_thread_count (guint n)
+{
+    thread_count_override = n;
+}
+
+/* Returns the number of threads to use for work that can be spread
+   over several CPUs, 1 if the application didn't initialize the GLib
+   thread system (only needed with GLib < 2.32). */
+G_GNUC_INTERNAL guint itdb_thread_count (void)
+{
+    glong n = 1;
+
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported ())
+	return 1;
 #endif
+    if (thread_count_override > 0)
+	return thread_count_override;
+#if GLIB_CHECK_VERSION(2,36,0)
+    n = g_get_num_processors ();
+#elif defined(_SC_NPROCESSORS_ONLN)
+    n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+    return (n > 1) ? n : 1;
 }
 
 /* There seems to be a problem with some distributions (kernel
@@ -538,6 +692,19 @@ static gboolean seek_get_n_bytes (FContents *cts, gchar *data,
   return FALSE;
 }
 
+/* Returns a pointer to the @len bytes at position @seek in
+   @cts->contents without copying them. The pointer stays valid as
+   long as @cts is not freed. Returns NULL on error and sets
+   cts->error accordingly. */
+static const gchar *seek_get_pointer (FContents *cts, glong seek, glong len)
+{
+    if (check_seek (cts, seek, len))
+    {
+	return &cts->contents[seek];
+    }
+    return NULL;
+}
+
 /* Compare @n bytes of @cts->contents starting at @seek and
  * @data. Returns TRUE if equal, FALSE if not. Also returns FALSE on
  * error, so you must check cts->error */
@@ -825,14 +992,16 @@ static inline guint64 get64bint (FContents *cts, glong seek)
 }
 
 /* Try to convert from UTF-16 to UTF-8 and handle partial characters
- * at the end of the string */
-static char *utf16_to_utf8_with_partial (gunichar2 *entry_utf16)
+ * at the end of the string. @len is the maximum number of UTF-16
+ * units to convert, -1 if @entry_utf16 is 0-terminated. */
+static char *utf16_to_utf8_with_partial (const gunichar2 *entry_utf16,
+					 glong len)
 {
     GError *error = NULL;
     char *entry_utf8;
     glong items_read;
 
-    entry_utf8 = g_utf16_to_utf8 (entry_utf16, -1, &items_read, NULL, &error);
+    entry_utf8 = g_utf16_to_utf8 (entry_utf16, len, &items_read, NULL, &error);
     if (entry_utf8 == NULL) {
         if (g_error_matches (error, G_CONVERT_ERROR, G_CONVERT_ERROR_PARTIAL_INPUT)) {
             entry_utf8 = g_utf16_to_utf8 (entry_utf16, items_read, NULL, NULL, NULL);
@@ -843,6 +1012,46 @@ static char *utf16_to_utf8_with_partial (gunichar2 *entry_utf16)
     return entry_utf8;
 }
 
+/* Converts the @n UTF-16LE units at @data to a newly allocated UTF-8
+ * string if they are all ASCII, which is the case for most strings in
+ * an iTunesDB. Returns NULL if a non-ASCII character is encountered,
+ * the caller has to use the general conversion then. */
+static gchar *utf16le_ascii_to_utf8 (const guchar *data, gsize n)
+{
+    gchar *result;
+    gsize i = 0;
+
+    result = g_malloc (n+1);
+#ifdef __SSE2__
+    {
+	const __m128i mask = _mm_set1_epi16 ((gint16)0xff80);
+	const __m128i zero = _mm_setzero_si128 ();
+	for (; i+8 <= n; i+=8)
+	{
+	    __m128i v = _mm_loadu_si128 ((const __m128i *)(data+2*i));
+	    if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (v, mask),
+						    zero)) != 0xffff)
+	    {
+		g_free (result);
+		return NULL;
+	    }
+	    _mm_storel_epi64 ((__m128i *)(result+i), _mm_packus_epi16 (v, v));
+	}
+    }
+#endif
+    for (; i<n; ++i)
+    {
+	if ((data[2*i] & 0x80) || data[2*i+1])
+	{
+	    g_free (result);
+	    return NULL;
+	}
+	result[i] = data[2*i];
+    }
+    result[n] = 0;
+    return result;
+}
+
 /* Fix little endian UTF16 String to correct byteorder if necessary
  * (all strings in the Itdb_iTunesDB are little endian except for the ones
  * in smart playlists). */
@@ -881,6 +1090,22 @@ static gunichar2 *fixup_big_utf16 (gunichar2 *utf16_string)
 
 #define CHECK_ERROR(imp, val) if (cts->error) { g_propagate_error (&imp->error, cts->error); return (val); }
 
+/* minimum number of tracks for parse_tracks() to decode the mhits
+   with several threads */
+#define PARSE_TRACKS_THREADED_MIN 1000
+
+/* minimum number of tracks for write_mhsd_tracks() to serialize the
+   mhits with several threads, and the number of tracks serialized by
+   one thread in one go */
+#define WRITE_TRACKS_THREADED_MIN 1000
+#define WRITE_TRACKS_RANGE 256
+
+/* minimum number of tracks for mhod52_make_collate_keys() to update
+   the cached collate keys with several threads, and the number of
+   tracks updated by one thread in one go */
+#define COLLATE_KEYS_THREADED_MIN 1000
+#define COLLATE_KEYS_RANGE 256
+
 
 /* get next playcount, that is the first entry of GList
  * playcounts. This entry is removed from the list. You must free the
@@ -1214,7 +1439,8 @@ static void playcounts_reset (const char *mountpoint)
       const gchar *components[] = { *it, NULL };
       playcounts_path = itdb_resolve_path (mountpoint, components);
       if (playcounts_path != NULL) {
-          g_unlink (playcounts_path);
+          if (g_unlink (playcounts_path) == 0)
+              itdb_fsync_written_file (playcounts_path);
           g_free (playcounts_path);
       }
   }
@@ -1359,12 +1585,21 @@ void itdb_free (Itdb_iTunesDB *itdb)
 
 	    if (itdb->priv->genius_cuid)
 	        g_free(itdb->priv->genius_cuid);
+
+	    fcontents_free (itdb->priv->lazy_contents);
 	}
 
 	g_list_free (itdb->playlists);
+	/* no need to keep the indexes up to date */
+	itdb_track_index_invalidate (itdb);
 	g_list_foreach (itdb->tracks,
 			(GFunc)(itdb_track_free), NULL);
 	g_list_free (itdb->tracks);
+	/* after the tracks, they hold references to the pool */
+	if (itdb->priv->string_pool)
+	    g_hash_table_destroy (itdb->priv->string_pool);
+	if (itdb->priv->arena)
+	    itdb_arena_unref (itdb->priv->arena);
 	g_free (itdb->filename);
 	itdb_device_free (itdb->device);
 	if (itdb->userdata && itdb->userdata_destroy)
@@ -1472,6 +1707,7 @@ Itdb_iTunesDB *itdb_new (void)
 	((guint64)g_random_int ());
     itdb->priv->lang = 0x656e;
     itdb->priv->platform = 1; /* Mac */
+    itdb->priv->compression_level = 1;
     return itdb;
 }
 
@@ -1503,6 +1739,7 @@ static gint32 get_mhod_type (FContents *cts, glong seek, guint32 *ml)
 static char *extract_mhod_string (FContents *cts, glong seek)
 {
     gunichar2 *entry_utf16;
+    const gchar *data;
     char *entry_utf8;
     gint string_type;
     gsize len;
@@ -1511,24 +1748,34 @@ static char *extract_mhod_string (FContents *cts, glong seek)
     string_type = get32lint (cts, seek);
     len = get32lint (cts, seek+4);   /* length of string */
     g_return_val_if_fail (len < G_MAXUINT - 2, NULL);
+    data = seek_get_pointer (cts, seek+16, len);
+    if (data == NULL) {
+	return NULL;
+    }
     if (string_type != 0x02) {
 	/* UTF-16 string */
-	entry_utf16 = g_new0 (gunichar2, (len+2)/2);
-	if (seek_get_n_bytes (cts, (gchar *)entry_utf16, seek+16, len)) {
+	entry_utf8 = utf16le_ascii_to_utf8 ((const guchar *)data, len/2);
+	if (entry_utf8 != NULL) {
+	    /* plain ASCII is always valid UTF-8 */
+	    return entry_utf8;
+	}
+	if ((G_BYTE_ORDER == G_LITTLE_ENDIAN)
+	    && (len % sizeof (gunichar2) == 0)
+	    && ((gsize)data % sizeof (gunichar2) == 0)) {
+	    /* already in host byte order and suitably aligned: convert
+	     * straight from the file contents */
+	    entry_utf8 = utf16_to_utf8_with_partial ((const gunichar2 *)data,
+						     len/2);
+	} else {
+	    entry_utf16 = g_new0 (gunichar2, (len+2)/2);
+	    memcpy (entry_utf16, data, len);
 	    fixup_little_utf16 (entry_utf16);
-	    entry_utf8 = utf16_to_utf8_with_partial (entry_utf16);
-	    g_free (entry_utf16);
-	} else { 
+	    entry_utf8 = utf16_to_utf8_with_partial (entry_utf16, -1);
 	    g_free (entry_utf16);
-	    return NULL;
 	}
     } else {
 	/* UTF-8 string */
-	entry_utf8 = g_new0 (gchar, len+1);
-	if (!seek_get_n_bytes (cts, entry_utf8, seek+16, len)) {
-	    g_free (entry_utf8);
-	    return NULL;
-	}
+	entry_utf8 = g_strndup (data, len);
     }
 
     if ((entry_utf8 != NULL) && g_utf8_validate (entry_utf8, -1, NULL)) {
@@ -2202,7 +2449,6 @@ static glong get_playlist (FImport *fimp, guint mhsd_type, glong mhyp_seek)
   fprintf(stderr, "mhyp seek: %x\n", (int)mhyp_seek);
 #endif
   g_return_val_if_fail (fimp, -1);
-  g_return_val_if_fail (fimp->idtree, -1);
   g_return_val_if_fail (fimp->pos_glist == NULL, -1);
 
   cts = fimp->fcontents;
@@ -2372,7 +2618,14 @@ static glong get_playlist (FImport *fimp, guint mhsd_type, glong mhyp_seek)
 #endif
 
   /* add new playlist */
-  if (mhsd_type == 5) {
+  if (fimp->callbacks) {
+      if (fimp->callbacks->playlist &&
+	  !fimp->callbacks->playlist (plitem, fimp->user_data)) {
+	  fimp->stopped = TRUE;
+	  itdb_playlist_free (plitem);
+	  return nextseek;
+      }
+  } else if (mhsd_type == 5) {
       itdb_playlist_add_mhsd5_playlist (fimp->itdb, plitem, -1);
   } else {
       itdb_playlist_add (fimp->itdb, plitem, -1);
@@ -2391,16 +2644,36 @@ static glong get_playlist (FImport *fimp, guint mhsd_type, glong mhyp_seek)
 		       ITDB_FILE_ERROR_CORRUPT,
 		       _("iTunesDB corrupt: number of mhip sections inconsistent in mhyp starting at %ld in file '%s'."),
 		       mhyp_seek, cts->filename);
+	  if (fimp->callbacks)
+	      itdb_playlist_free (plitem);
 	  return -1;
       }
   }	  
 
   /* sort in reverse order */
   fimp->pos_glist = g_list_sort (fimp->pos_glist, pos_comp);
+  if (fimp->callbacks)
+  {   /* the list is sorted in reverse order */
+      for (gl = g_list_last (fimp->pos_glist); gl; gl = g_list_previous (gl))
+      {
+	  PosEntry* entry = (PosEntry*)gl->data;
+	  if (!fimp->stopped && fimp->callbacks->playlist_member &&
+	      !fimp->callbacks->playlist_member (plitem, entry->trackid,
+						 fimp->user_data))
+	  {
+	      fimp->stopped = TRUE;
+	  }
+	  g_free (entry);
+      }
+      itdb_playlist_free (plitem);
+      g_list_free (fimp->pos_glist);
+      fimp->pos_glist = NULL;
+      return nextseek;
+  }
   for (gl = fimp->pos_glist; gl; gl = g_list_next (gl))
   {
       PosEntry* entry = (PosEntry*)gl->data;
-      Itdb_Track *tr = itdb_track_id_tree_by_id (fimp->idtree, entry->trackid);
+      Itdb_Track *tr = itdb_track_by_id (fimp->itdb, entry->trackid);
       if (tr)
       {
 	  /* preprend because we sorted in reverse order */
@@ -2422,21 +2695,192 @@ static glong get_playlist (FImport *fimp, guint mhsd_type, glong mhyp_seek)
 }
 
 
-/* returns a pointer to the next header or -1 on error. fimp->error is
+/* Decodes the @mhod_nums mhods belonging to @track starting at
+   @seek. Fields of @track that are already set are left alone. If
+   @path_only is TRUE only the ipod_path is decoded and all other
+   mhods are skipped. Returns a pointer to the header following the
+   last mhod or -1 on error. fimp->error is set appropriately. */
+static glong get_mhit_mhods (FImport *fimp, Itdb_Track *track,
+			     glong seek, guint32 mhod_nums,
+			     gboolean path_only)
+{
+  gchar *entry_utf8;
+  gchar **field;
+  gint32 type;
+  guint32 zip;
+  guint32 i;
+  FContents *cts = fimp->fcontents;
+
+  for (i=0; i<mhod_nums; ++i)
+  {
+      if (path_only)
+      {
+	  type = get_mhod_type (cts, seek, &zip);
+	  CHECK_ERROR (fimp, -1);
+	  if (type != MHOD_ID_PATH)
+	  {
+	      seek += zip;
+	      continue;
+	  }
+      }
+      entry_utf8 = get_mhod_string (fimp, seek, &zip, &type);
+      CHECK_ERROR (fimp, -1);
+      if (entry_utf8 != NULL)
+      {
+	  field = NULL;
+	  switch ((enum MHOD_ID)type)
+	  {
+	  case MHOD_ID_TITLE:
+	      field = &track->title;
+	      break;
+	  case MHOD_ID_PATH:
+	      field = &track->ipod_path;
+	      break;
+	  case MHOD_ID_ALBUM:
+	      field = &track->album;
+	      break;
+	  case MHOD_ID_ARTIST:
+	      field = &track->artist;
+	      break;
+	  case MHOD_ID_GENRE:
+	      field = &track->genre;
+	      break;
+	  case MHOD_ID_FILETYPE:
+	      field = &track->filetype;
+	      break;
+	  case MHOD_ID_COMMENT:
+	      field = &track->comment;
+	      break;
+	  case MHOD_ID_CATEGORY:
+	      field = &track->category;
+	      break;
+	  case MHOD_ID_COMPOSER:
+	      field = &track->composer;
+	      break;
+	  case MHOD_ID_GROUPING:
+	      field = &track->grouping;
+	      break;
+	  case MHOD_ID_DESCRIPTION:
+	      field = &track->description;
+	      break;
+	  case MHOD_ID_PODCASTURL:
+	      field = &track->podcasturl;
+	      break;
+	  case MHOD_ID_PODCASTRSS:
+	      field = &track->podcastrss;
+	      break;
+	  case MHOD_ID_SUBTITLE:
+	      field = &track->subtitle;
+	      break;
+	  case MHOD_ID_TVSHOW:
+	      field = &track->tvshow;
+	      break;
+	  case MHOD_ID_TVEPISODE:
+	      field = &track->tvepisode;
+	      break;
+	  case MHOD_ID_TVNETWORK:
+	      field = &track->tvnetwork;
+	      break;
+	  case MHOD_ID_ALBUMARTIST:
+	      field = &track->albumartist;
+	      break;
+	  case MHOD_ID_KEYWORDS:
+	      field = &track->keywords;
+	      break;
+	  case MHOD_ID_SORT_ARTIST:
+	      field = &track->sort_artist;
+	      break;
+	  case MHOD_ID_SORT_TITLE:
+	      field = &track->sort_title;
+	      break;
+	  case MHOD_ID_SORT_ALBUM:
+	      field = &track->sort_album;
+	      break;
+	  case MHOD_ID_SORT_ALBUMARTIST:
+	      field = &track->sort_albumartist;
+	      break;
+	  case MHOD_ID_SORT_COMPOSER:
+	      field = &track->sort_composer;
+	      break;
+	  case MHOD_ID_SORT_TVSHOW:
+	      field = &track->sort_tvshow;
+	      break;
+	  case MHOD_ID_SPLPREF:
+	  case MHOD_ID_SPLRULES:
+	  case MHOD_ID_LIBPLAYLISTINDEX:
+	  case MHOD_ID_LIBPLAYLISTJUMPTABLE:
+	  case MHOD_ID_PLAYLIST:
+	  case MHOD_ID_CHAPTERDATA:
+	  case MHOD_ID_ALBUM_ALBUM:
+	  case MHOD_ID_ALBUM_ARTIST:
+	  case MHOD_ID_ALBUM_ARTIST_MHII:
+	  case MHOD_ID_ALBUM_SORT_ARTIST:
+	      break;
+	  }
+	  /* fields set by the application to a lazily parsed track are
+	     kept, an empty string is how it clears them */
+	  if (field && !*field && fimp->itdb->priv->arena)
+	  {
+	      *field = itdb_arena_strdup (fimp->itdb->priv->arena,
+					  entry_utf8);
+	      g_free (entry_utf8);
+	  }
+	  else if (field && !*field)
+	      *field = entry_utf8;
+	  else
+	      g_free (entry_utf8);
+      }
+      else
+      {
+	  MHODData mhod;
+	  switch (type)
+	  {
+	  case MHOD_ID_CHAPTERDATA:
+	      mhod = get_mhod (fimp, seek, &zip);
+	      if (mhod.valid && mhod.data.chapterdata)
+	      {
+		  /* don't overwrite chapters added by the application
+		     to a track that was parsed lazily */
+		  if (track->chapterdata && track->chapterdata->chapters)
+		  {
+		      itdb_chapterdata_free (mhod.data.chapterdata);
+		  }
+		  else
+		  {
+		      itdb_chapterdata_free (track->chapterdata);
+		      track->chapterdata = mhod.data.chapterdata;
+		  }
+		  mhod.valid = FALSE;
+	      }
+	      break;
+	  default:
+/*
+	  printf ("found mhod type %d at %lx inside mhit starting at %lx\n",
+	  type, seek, mhit_seek);*/
+	      break;
+	  }
+      }
+      seek += zip;
+  }
+  return seek;
+}
+
+
+/* Decodes the mhit at @mhit_seek into a newly allocated track which
+   is stored in *@result. Only @fimp->fcontents, @fimp->itdb->device
+   and @fimp->flags are accessed, so this may be called from several
+   threads with private copies of @fimp and its FContents.
+
+   Returns a pointer to the next header or -1 on error. fimp->error is
    set appropriately. If no "mhit" header is found at the location
    specified, -1 is returned but no error is set. */
-static glong get_mhit (FImport *fimp, glong mhit_seek)
+static glong decode_mhit (FImport *fimp, glong mhit_seek, Itdb_Track **result)
 {
   Itdb_Track *track;
-  gchar *entry_utf8;
-  gint32 type;
   guint32 header_len;
-  guint32 zip;
-  struct playcount *playcount;
-  guint32 i, mhod_nums;
+  guint32 mhod_nums;
   FContents *cts;
   glong seek = mhit_seek;
-  gboolean free_playcount;
 
 #if ITUNESDB_DEBUG
   fprintf(stderr, "get_mhit seek: %x\n", (int)seek);
@@ -2477,7 +2921,10 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
   CHECK_ERROR (fimp, -1);
 
 
-  track = itdb_track_new ();
+  if (fimp->itdb->priv->arena)
+      track = itdb_track_new_from_arena (fimp->itdb->priv->arena);
+  else
+      track = itdb_track_new ();
 
   if (header_len >= 0x9c)
   {
@@ -2587,138 +3034,43 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
   seek += get32lint (cts, seek+4);             /* 1st mhod starts here! */
   CHECK_ERROR (fimp, -1);
 
-  for (i=0; i<mhod_nums; ++i)
+  /* in lazy mode only the ipod_path is decoded now, everything else
+     is left to itdb_track_materialize() */
+  if (fimp->flags & ITDB_PARSE_FLAGS_LAZY_TRACKS)
+      track->priv->mhit_seek = mhit_seek;
+  seek = get_mhit_mhods (fimp, track, seek, mhod_nums,
+			 track->priv->mhit_seek != 0);
+  if (seek == -1)
   {
-      entry_utf8 = get_mhod_string (fimp, seek, &zip, &type);
-      CHECK_ERROR (fimp, -1);
-      if (entry_utf8 != NULL)
+      itdb_track_free (track);
+      return -1;
+  }
+
+  *result = track;
+  return seek;
+}
+
+
+/* Merges the recent playcount information (Play Counts, iTunesStats
+   or PlayCounts.plist) into @track. Must be called in the order the
+   tracks are stored in the iTunesDB. */
+static void apply_playcount (FImport *fimp, Itdb_Track *track)
+{
+  struct playcount *playcount;
+  gboolean free_playcount;
+
+  playcount = playcount_take_next (fimp);
+  free_playcount = TRUE;
+  if (!playcount && fimp->pcounts2)
+  {
+      playcount = g_hash_table_lookup (fimp->pcounts2, &track->dbid);
+      free_playcount = FALSE;
+  }
+  if (playcount)
+  {
+      if (playcount->rating != NO_PLAYCOUNT)
       {
-	  switch ((enum MHOD_ID)type)
-	  {
-	  case MHOD_ID_TITLE:
-	      track->title = entry_utf8;
-	      break;
-	  case MHOD_ID_PATH:
-	      track->ipod_path = entry_utf8;
-	      break;
-	  case MHOD_ID_ALBUM:
-	      track->album = entry_utf8;
-	      break;
-	  case MHOD_ID_ARTIST:
-	      track->artist = entry_utf8;
-	      break;
-	  case MHOD_ID_GENRE:
-	      track->genre = entry_utf8;
-	      break;
-	  case MHOD_ID_FILETYPE:
-	      track->filetype = entry_utf8;
-	      break;
-	  case MHOD_ID_COMMENT:
-	      track->comment = entry_utf8;
-	      break;
-	  case MHOD_ID_CATEGORY:
-	      track->category = entry_utf8;
-	      break;
-	  case MHOD_ID_COMPOSER:
-	      track->composer = entry_utf8;
-	      break;
-	  case MHOD_ID_GROUPING:
-	      track->grouping = entry_utf8;
-	      break;
-	  case MHOD_ID_DESCRIPTION:
-	      track->description = entry_utf8;
-	      break;
-	  case MHOD_ID_PODCASTURL:
-	      track->podcasturl = entry_utf8;
-	      break;
-	  case MHOD_ID_PODCASTRSS:
-	      track->podcastrss = entry_utf8;
-	      break;
-	  case MHOD_ID_SUBTITLE:
-	      track->subtitle = entry_utf8;
-	      break;
-	  case MHOD_ID_TVSHOW:
-	      track->tvshow = entry_utf8;
-	      break;
-	  case MHOD_ID_TVEPISODE:
-	      track->tvepisode = entry_utf8;
-	      break;
-	  case MHOD_ID_TVNETWORK:
-	      track->tvnetwork = entry_utf8;
-	      break;
-	  case MHOD_ID_ALBUMARTIST:
-	      track->albumartist = entry_utf8;
-	      break;
-	  case MHOD_ID_KEYWORDS:
-	      track->keywords = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_ARTIST:
-	      track->sort_artist = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_TITLE:
-	      track->sort_title = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_ALBUM:
-	      track->sort_album = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_ALBUMARTIST:
-	      track->sort_albumartist = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_COMPOSER:
-	      track->sort_composer = entry_utf8;
-	      break;
-	  case MHOD_ID_SORT_TVSHOW:
-	      track->sort_tvshow = entry_utf8;
-	      break;
-	  case MHOD_ID_SPLPREF:
-	  case MHOD_ID_SPLRULES:
-	  case MHOD_ID_LIBPLAYLISTINDEX:
-	  case MHOD_ID_LIBPLAYLISTJUMPTABLE:
-	  case MHOD_ID_PLAYLIST:
-	  case MHOD_ID_CHAPTERDATA:
-	  case MHOD_ID_ALBUM_ALBUM:
-	  case MHOD_ID_ALBUM_ARTIST:
-	  case MHOD_ID_ALBUM_ARTIST_MHII:
-	  case MHOD_ID_ALBUM_SORT_ARTIST:
-	      g_free (entry_utf8);
-	      break;
-	  }
-      }
-      else
-      {
-	  MHODData mhod;
-	  switch (type)
-	  {
-	  case MHOD_ID_CHAPTERDATA:
-	      mhod = get_mhod (fimp, seek, &zip);
-	      if (mhod.valid && mhod.data.chapterdata)
-	      {
-		  track->chapterdata = mhod.data.chapterdata;
-		  mhod.valid = FALSE;
-	      }
-	      break;
-	  default:
-/*
-	  printf ("found mhod type %d at %lx inside mhit starting at %lx\n",
-	  type, seek, mhit_seek);*/
-	      break;
-	  }
-      }
-      seek += zip;
-  }
-
-  playcount = playcount_take_next (fimp);
-  free_playcount = TRUE;
-  if (!playcount && fimp->pcounts2)
-  {
-      playcount = g_hash_table_lookup (fimp->pcounts2, &track->dbid);
-      free_playcount = FALSE;
-  }
-  if (playcount)
-  {
-      if (playcount->rating != NO_PLAYCOUNT)
-      {
-	  if (track->rating != playcount->rating)
+	  if (track->rating != playcount->rating)
 	  {
 	      /* backup original rating to app_rating */
 	      track->app_rating = track->rating;
@@ -2743,7 +3095,36 @@ static glong get_mhit (FImport *fimp, glong mhit_seek)
       if (free_playcount)
 	  g_free (playcount);
   }
-  fimp->tracks = g_list_prepend(fimp->tracks, track);
+}
+
+
+/* returns a pointer to the next header or -1 on error. fimp->error is
+   set appropriately. If no "mhit" header is found at the location
+   specified, -1 is returned but no error is set. */
+static glong get_mhit (FImport *fimp, glong mhit_seek)
+{
+  Itdb_Track *track = NULL;
+  glong seek;
+
+  seek = decode_mhit (fimp, mhit_seek, &track);
+  if (seek != -1)
+  {
+      apply_playcount (fimp, track);
+      if (fimp->callbacks)
+      {
+	  if (fimp->callbacks->track)
+	  {
+	      track->itdb = fimp->itdb;
+	      if (!fimp->callbacks->track (track, fimp->user_data))
+		  fimp->stopped = TRUE;
+	  }
+	  itdb_track_free (track);
+      }
+      else
+      {
+	  fimp->tracks = g_list_prepend(fimp->tracks, track);
+      }
+  }
   return seek;
 }
 
@@ -2830,7 +3211,7 @@ static gboolean process_OTG_file (FImport *fimp, FContents *cts,
 				     header_length + entry_length *i);
 	    CHECK_ERROR (fimp, FALSE);
 
-	    track = g_list_nth_data (fimp->itdb->tracks, num);
+	    track = itdb_track_nth (fimp->itdb, num);
 	    if (track)
 	    {
 		itdb_playlist_add_track (pl, track, -1);
@@ -2892,6 +3273,165 @@ static gboolean read_OTG_playlists (FImport *fimp)
 }
 
 
+/* Returns a pointer to the header following the mhit at @seek without
+   decoding the mhit, -1 if no mhit can be found at @seek or if one of
+   its mhods is invalid. */
+static glong skip_mhit (FContents *cts, glong seek)
+{
+    guint32 header_len, mhod_nums, zip, i;
+
+    if (!check_header_seek (cts, "mhit", seek))
+	return -1;
+    header_len = get32lint (cts, seek+4);
+    mhod_nums = get32lint (cts, seek+12);
+    if (cts->error) return -1;
+
+    seek += header_len;
+    for (i=0; i<mhod_nums; ++i)
+    {
+	if (get_mhod_type (cts, seek, &zip) == -1) return -1;
+	if (zip == -1) return -1;
+	seek += zip;
+    }
+    return seek;
+}
+
+/* a range of mhits decoded by one thread of parse_tracks_threaded() */
+typedef struct
+{
+    FImport *fimp;       /* shared import state (read only) */
+    glong *mhit_seeks;   /* offsets of the mhits to decode */
+    Itdb_Track **tracks; /* where to store the decoded tracks */
+    guint32 n;           /* number of mhits in this range */
+    GError *error;       /* error that occured in this range */
+} MhitRange;
+
+static void decode_mhit_range (gpointer data, gpointer user_data)
+{
+    MhitRange *range = data;
+    FContents cts;
+    FImport fimp;
+    guint32 i;
+
+    /* private copies so that cts->error and fimp->error are not
+       shared between threads */
+    cts = *range->fimp->fcontents;
+    cts.error = NULL;
+    fimp = *range->fimp;
+    fimp.fcontents = &cts;
+    fimp.error = NULL;
+
+    for (i=0; i<range->n; ++i)
+    {
+	if (decode_mhit (&fimp, range->mhit_seeks[i], &range->tracks[i]) == -1)
+	{
+	    if (!fimp.error)
+	    {
+		g_set_error (&fimp.error,
+			     ITDB_FILE_ERROR,
+			     ITDB_FILE_ERROR_CORRUPT,
+			     _("iTunesDB corrupt: no mhit at offset %ld in file '%s'."),
+			     range->mhit_seeks[i], cts.filename);
+	    }
+	    break;
+	}
+    }
+    range->error = fimp.error;
+}
+
+/* Decodes the @nr_tracks mhits starting at @seek with a pool of
+   @nr_threads threads and adds the resulting tracks to fimp->tracks.
+   The boundaries of the mhits are determined by a quick serial scan
+   first. Returns FALSE without touching fimp->tracks if that scan
+   fails, in which case the caller should fall back to the serial
+   parser, which handles inconsistent databases more gracefully. On
+   a decoding error fimp->error is set and TRUE is returned. */
+static gboolean parse_tracks_threaded (FImport *fimp, glong seek,
+				       guint32 nr_tracks, guint nr_threads)
+{
+    FContents *cts = fimp->fcontents;
+    glong *mhit_seeks;
+    Itdb_Track **tracks;
+    MhitRange *ranges;
+    GThreadPool *pool;
+    guint32 i, per_range;
+    guint nr_ranges;
+
+    mhit_seeks = g_new (glong, nr_tracks);
+    for (i=0; i<nr_tracks; ++i)
+    {
+	mhit_seeks[i] = seek;
+	if (seek != -1)
+	    seek = skip_mhit (cts, seek);
+	if (seek == -1)
+	{
+	    if (cts->error)
+	    {
+		g_error_free (cts->error);
+		cts->error = NULL;
+	    }
+	    g_free (mhit_seeks);
+	    return FALSE;
+	}
+    }
+
+    pool = g_thread_pool_new (decode_mhit_range, NULL,
+			      nr_threads, TRUE, NULL);
+    if (!pool)
+    {
+	g_free (mhit_seeks);
+	return FALSE;
+    }
+
+    /* use a few more ranges than threads to even out the load */
+    nr_ranges = nr_threads * 4;
+    per_range = (nr_tracks + nr_ranges - 1) / nr_ranges;
+    nr_ranges = (nr_tracks + per_range - 1) / per_range;
+
+    tracks = g_new0 (Itdb_Track *, nr_tracks);
+    ranges = g_new0 (MhitRange, nr_ranges);
+    for (i=0; i<nr_ranges; ++i)
+    {
+	ranges[i].fimp = fimp;
+	ranges[i].mhit_seeks = &mhit_seeks[i*per_range];
+	ranges[i].tracks = &tracks[i*per_range];
+	ranges[i].n = MIN (per_range, nr_tracks - i*per_range);
+	g_thread_pool_push (pool, &ranges[i], NULL);
+    }
+    /* wait for all ranges to be decoded */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    for (i=0; i<nr_ranges; ++i)
+    {
+	if (ranges[i].error)
+	{
+	    if (!fimp->error)
+		g_propagate_error (&fimp->error, ranges[i].error);
+	    else
+		g_error_free (ranges[i].error);
+	}
+    }
+
+    /* merge in iTunesDB order -- playcounts have to be applied in
+       that order as well */
+    for (i=0; i<nr_tracks; ++i)
+    {
+	if (!tracks[i]) continue;
+	if (fimp->error)
+	{
+	    itdb_track_free (tracks[i]);
+	    continue;
+	}
+	apply_playcount (fimp, tracks[i]);
+	fimp->tracks = g_list_prepend (fimp->tracks, tracks[i]);
+    }
+
+    g_free (ranges);
+    g_free (tracks);
+    g_free (mhit_seeks);
+    return TRUE;
+}
+
 /* Read the tracklist (mhlt). mhsd_seek must point to type 1 mhsd
    (this is treated as a programming error) */
 /* Return value:
@@ -2903,6 +3443,7 @@ static gboolean parse_tracks (FImport *fimp, glong mhsd_seek)
     GList* gl;
     glong mhlt_seek, seek;
     guint32 nr_tracks, i;
+    guint nr_threads;
 
     g_return_val_if_fail (fimp, FALSE);
     g_return_val_if_fail (fimp->itdb, FALSE);
@@ -2936,12 +3477,25 @@ static gboolean parse_tracks (FImport *fimp, glong mhsd_seek)
     seek = find_next_a_in_b (cts, "mhit", mhsd_seek, mhlt_seek);
     CHECK_ERROR (fimp, FALSE);
     /* seek should now point to the first mhit */
+    /* the callbacks and the arena are not thread safe */
+    if (fimp->callbacks || fimp->itdb->priv->arena)
+	nr_threads = 1;
+    else
+	nr_threads = itdb_thread_count ();
+    if ((seek != -1) &&
+	(nr_threads > 1) && (nr_tracks >= PARSE_TRACKS_THREADED_MIN) &&
+	parse_tracks_threaded (fimp, seek, nr_tracks, nr_threads))
+    {
+	if (fimp->error) return FALSE;
+	nr_tracks = 0; /* all tracks have been read */
+    }
     for (i=0; i<nr_tracks; ++i)
     {
 	/* seek could be -1 if first mhit could not be found */
 	if (seek != -1)
 	    seek = get_mhit (fimp, seek);
 	if (fimp->error) return FALSE;
+	if (fimp->stopped) return TRUE;
 	if (seek == -1)
 	{   /* this should not be -- issue warning */
 	    g_warning (_("iTunesDB corrupt: number of tracks (mhit hunks) inconsistent. Trying to continue.\n"));
@@ -2998,9 +3552,6 @@ static gboolean parse_playlists (FImport *fimp, glong mhsd_seek)
     nr_playlists = get32lint (cts, mhlp_seek+8);
     CHECK_ERROR (fimp, FALSE);
 
-    /* Create track-id tree for quicker track lookup */
-    fimp->idtree = itdb_track_id_tree_create (fimp->itdb);
-
     seek = find_next_a_in_b (cts, "mhyp", mhsd_seek, mhlp_seek);
     CHECK_ERROR (fimp, FALSE);
     /* seek should now point to the first mhit */
@@ -3010,6 +3561,7 @@ static gboolean parse_playlists (FImport *fimp, glong mhsd_seek)
 	if (seek != -1)
 	    seek = get_playlist (fimp, mhsd_type, seek);
 	if (fimp->error) return FALSE;
+	if (fimp->stopped) break;
 	if (seek == -1)
 	{   /* this should not be -- issue warning */
 	    g_warning (_("iTunesDB possibly corrupt: number of playlists (mhyp hunks) inconsistent. Trying to continue.\n"));
@@ -3017,9 +3569,6 @@ static gboolean parse_playlists (FImport *fimp, glong mhsd_seek)
 	}
     }
 
-    itdb_track_id_tree_destroy (fimp->idtree);
-    fimp->idtree = NULL;
-
     return TRUE;
 }
 
@@ -3091,6 +3640,20 @@ static gboolean looks_like_itunesdb (FImport *fimp)
     return TRUE;
 }
 
+/* Returns TRUE if the mhbd header of @fimp, which must have been
+   checked with looks_like_itunesdb(), has the compression flag of an
+   iTunesCDB set */
+static gboolean header_is_compressed (FImport *fimp)
+{
+    FContents *cts = fimp->fcontents;
+
+    /* the flag is at 0xa8, itdb_zlib_check_decompress_fimp() rejects
+       shorter headers */
+    if (cts->length <= 0xa8)
+	return FALSE;
+    return (get32lint (cts, 4) > 0xa8) && (get8int (cts, 0xa8) == 1);
+}
+
 static gboolean parse_fimp (FImport *fimp, gboolean compressed)
 {
     glong seek=0;
@@ -3102,7 +3665,9 @@ static gboolean parse_fimp (FImport *fimp, gboolean compressed)
     g_return_val_if_fail (fimp->fcontents, FALSE);
     g_return_val_if_fail (fimp->fcontents->filename, FALSE);
 
+    cts = fimp->fcontents;
     if (!looks_like_itunesdb (fimp)) {
+	CHECK_ERROR (fimp, FALSE);
 	return FALSE;
     }
 
@@ -3190,6 +3755,7 @@ static gboolean parse_fimp (FImport *fimp, gboolean compressed)
 
     parse_tracks (fimp, mhsd_1);
     if (fimp->error) return FALSE;
+    if (fimp->stopped) return TRUE;
 
     if (mhsd_3 != -1)
 	parse_playlists (fimp, mhsd_3);
@@ -3206,6 +3772,12 @@ static gboolean parse_fimp (FImport *fimp, gboolean compressed)
 	return FALSE;
     }
 
+    /* the type 5 playlists are internal to libgpod and therefore not
+       passed to the callbacks */
+    if (fimp->stopped || fimp->callbacks) {
+	return !fimp->error;
+    }
+
     if (mhsd_5 != -1) {
 	parse_playlists (fimp, mhsd_5);
     }
@@ -3274,7 +3846,8 @@ static void error_no_control_dir (const gchar *mp, GError **error)
 
 
 static gboolean
-itdb_parse_internal (Itdb_iTunesDB *itdb, gboolean compressed, GError **error)
+itdb_parse_internal (Itdb_iTunesDB *itdb, gboolean compressed,
+		     ItdbParseFlags flags, GError **error)
 {
     FImport *fimp;
     gboolean success = FALSE;
@@ -3283,6 +3856,18 @@ itdb_parse_internal (Itdb_iTunesDB *itdb, gboolean compressed, GError **error)
     
     fimp = g_new0 (FImport, 1);
     fimp->itdb = itdb;
+    fimp->flags = flags;
+
+    if ((flags & ITDB_PARSE_FLAGS_ARENA) && !itdb->priv->arena)
+    {
+	itdb->priv->arena = itdb_arena_new ();
+    }
+    if ((flags & ITDB_PARSE_FLAGS_INTERN_STRINGS) && !itdb->priv->string_pool)
+    {
+	itdb->priv->string_pool = g_hash_table_new_full (g_str_hash,
+							 g_str_equal,
+							 g_free, NULL);
+    }
 
     fimp->fcontents = fcontents_read (itdb->filename, error);
 
@@ -3304,6 +3889,12 @@ itdb_parse_internal (Itdb_iTunesDB *itdb, gboolean compressed, GError **error)
 	}
     }
 
+    if (success && (flags & ITDB_PARSE_FLAGS_LAZY_TRACKS))
+    {   /* keep the contents around for itdb_track_materialize() */
+	itdb->priv->lazy_contents = fimp->fcontents;
+	fimp->fcontents = NULL;
+    }
+
     if (fimp->error)
 	g_propagate_error (error, fimp->error);
 
@@ -3325,6 +3916,40 @@ itdb_parse_internal (Itdb_iTunesDB *itdb, gboolean compressed, GError **error)
  * it's no longer needed
  */
 Itdb_iTunesDB *itdb_parse (const gchar *mp, GError **error)
+{
+    return itdb_parse_with_flags (mp, ITDB_PARSE_FLAGS_NONE, error);
+}
+
+/**
+ * itdb_parse_with_flags:
+ * @mp:     mount point of the iPod (eg "/mnt/ipod") in local encoding
+ * @flags:  #ItdbParseFlags controlling how the database is parsed
+ * @error:  return location for a #GError or NULL
+ *
+ * Same as itdb_parse(), but allows to pass @flags. If
+ * %ITDB_PARSE_FLAGS_LAZY_TRACKS is set, only the numeric fields and
+ * the ipod_path of the tracks are available after parsing. The
+ * remaining strings and the chapterdata of a track stay NULL (resp.
+ * empty) until itdb_track_materialize() has been called on it. This
+ * is done automatically before the database is written, see
+ * itdb_track_materialize() on how to clear a field of a track that
+ * hasn't been materialized.
+ *
+ * With %ITDB_PARSE_FLAGS_LAZY_TRACKS the iTunesDB usually stays
+ * memory-mapped until the database is written or freed. If the iPod
+ * is unplugged in the meantime, materializing a track raises SIGBUS
+ * and kills the application, so don't use the flag if the iPod may go
+ * away while the database is in use.
+ *
+ * Returns: a newly allocated #Itdb_iTunesDB struct holding the tracks and
+ * the playlists present on the iPod at @mp, NULL if @mp isn't an iPod mount
+ * point. If non-NULL, the #Itdb_iTunesDB is to be freed with itdb_free() when
+ * it's no longer needed
+ *
+ * Since: 0.8.2
+ */
+Itdb_iTunesDB *itdb_parse_with_flags (const gchar *mp, ItdbParseFlags flags,
+				      GError **error)
 {
     gchar *filename;
     Itdb_iTunesDB *itdb = NULL;
@@ -3346,7 +3971,7 @@ Itdb_iTunesDB *itdb_parse (const gchar *mp, GError **error)
 
 	    itdb_set_mountpoint (itdb, mp);
 	    itdb->filename = g_strdup (filename);
-	    success = itdb_parse_internal (itdb, compressed, error);
+	    success = itdb_parse_internal (itdb, compressed, flags, error);
 	    if (success)
 	    {
 		/* We don't test the return value of ipod_parse_artwork_db
@@ -3404,6 +4029,30 @@ Itdb_iTunesDB *itdb_parse (const gchar *mp, GError **error)
  * itdb_free() when it's no longer needed
  */
 Itdb_iTunesDB *itdb_parse_file (const gchar *filename, GError **error)
+{
+    return itdb_parse_file_with_flags (filename, ITDB_PARSE_FLAGS_NONE,
+				       error);
+}
+
+/**
+ * itdb_parse_file_with_flags:
+ * @filename:   path to a file in iTunesDB format
+ * @flags:      #ItdbParseFlags controlling how the database is parsed
+ * @error:      return location for a #GError or NULL
+ *
+ * Same as itdb_parse_file(), but allows to pass @flags. See
+ * itdb_parse_with_flags() for details.
+ *
+ * Returns: a newly allocated #Itdb_iTunesDB struct holding the tracks and
+ * the playlists present in @filename, NULL if @filename isn't a parsable 
+ * iTunesDB file. If non-NULL, the #Itdb_iTunesDB is to be freed with 
+ * itdb_free() when it's no longer needed
+ *
+ * Since: 0.8.2
+ */
+Itdb_iTunesDB *itdb_parse_file_with_flags (const gchar *filename,
+					   ItdbParseFlags flags,
+					   GError **error)
 {
     Itdb_iTunesDB *itdb;
     gboolean success;
@@ -3413,7 +4062,7 @@ Itdb_iTunesDB *itdb_parse_file (const gchar *filename, GError **error)
     itdb = itdb_new ();
     itdb->filename = g_strdup (filename);
 
-    success = itdb_parse_internal (itdb, FALSE, error);
+    success = itdb_parse_internal (itdb, FALSE, flags, error);
     if (!success)
     {
 	itdb_free (itdb);
@@ -3424,40 +4073,366 @@ Itdb_iTunesDB *itdb_parse_file (const gchar *filename, GError **error)
 }
 
 
-/* up to here we had the functions for reading the iTunesDB               */
-/* ---------------------------------------------------------------------- */
-/* from here on we have the functions for writing the iTunesDB            */
-
-/* will expand @cts when necessary in order to accomodate @len bytes
-   starting at @seek */
-static void wcontents_maybe_expand (WContents *cts, gulong len,
-				    gulong seek)
+/**
+ * itdb_parse_file_with_callbacks:
+ * @filename:   path to a file in iTunesDB (or iTunesCDB) format
+ * @callbacks:  #ItdbParseCallbacks to call for the tracks and
+ *              playlists found in @filename
+ * @user_data:  data passed to the callbacks
+ * @error:      return location for a #GError or NULL
+ *
+ * Parses @filename without building an #Itdb_iTunesDB. Each track
+ * and each playlist is handed to @callbacks and released again right
+ * after, so the memory used does not grow with the size of the
+ * database. All tracks are reported before the first playlist.
+ * Recent playcounts and On-The-Go playlists are not read.
+ *
+ * Returns: TRUE if @filename was parsed successfully (or a callback
+ * stopped the parsing), FALSE otherwise
+ *
+ * Since: 0.8.2
+ */
+gboolean itdb_parse_file_with_callbacks (const gchar *filename,
+					 const ItdbParseCallbacks *callbacks,
+					 gpointer user_data,
+					 GError **error)
 {
-    g_return_if_fail (cts);
+    Itdb_iTunesDB *itdb;
+    FImport *fimp;
+    FContents *cts;
+    gboolean success = FALSE;
 
-    while (cts->pos+len > cts->total)
-    {
-	cts->total += WCONTENTS_STEPSIZE;
-	cts->contents = g_realloc (cts->contents, cts->total);
-    }
-}
+    g_return_val_if_fail (filename, FALSE);
+    g_return_val_if_fail (callbacks, FALSE);
 
+    /* only used to provide the device for the time conversions -- no
+       tracks or playlists are ever added to it */
+    itdb = itdb_new ();
+    itdb->filename = g_strdup (filename);
 
-/* Write @data, @n bytes long to position @seek. Will always be
- * successful because glib terminates when out of memory */
-static void put_data_seek (WContents *cts, gchar *data,
-			   gulong len, gulong seek)
-{
-    g_return_if_fail (cts);
+    fimp = g_new0 (FImport, 1);
+    fimp->itdb = itdb;
+    fimp->callbacks = callbacks;
+    fimp->user_data = user_data;
 
-    if (len != 0)
+    fimp->fcontents = cts = fcontents_read (filename, error);
+    if (cts)
     {
-	g_return_if_fail (data);
-	wcontents_maybe_expand (cts, len, seek);
-
-	memcpy (&cts->contents[seek], data, len);
-	/* adjust end position if necessary */
-	if (seek+len > cts->pos)
+	if (looks_like_itunesdb (fimp))
+	{   /* iTunesCDB files have the compression flag set in the
+	       header */
+	    success = parse_fimp (fimp, header_is_compressed (fimp));
+	}
+	else if (cts->error)
+	{
+	    g_propagate_error (&fimp->error, cts->error);
+	}
+    }
+
+    if (fimp->error)
+	g_propagate_error (error, fimp->error);
+
+    itdb_free_fimp (fimp);
+    itdb_free (itdb);
+
+    return success;
+}
+
+/**
+ * itdb_track_materialize:
+ * @track: an #Itdb_Track
+ * @error: return location for a #GError or NULL
+ *
+ * Decodes the strings and the chapterdata of @track if its database
+ * was parsed with %ITDB_PARSE_FLAGS_LAZY_TRACKS. Fields the
+ * application has set in the meantime are not overwritten. Does
+ * nothing if @track has already been materialized.
+ *
+ * Only the fields that are NULL are filled in, as libgpod can't tell
+ * a field that hasn't been decoded yet from one the application has
+ * cleared. A string field cleared before materializing the track
+ * has to be set to an empty string instead, which is kept and not
+ * written to the iTunesDB either. Chapters can only be removed from
+ * a materialized track.
+ *
+ * Returns: TRUE on success, FALSE on error. @error is set
+ * appropriately.
+ *
+ * Since: 0.8.2
+ */
+gboolean itdb_track_materialize (Itdb_Track *track, GError **error)
+{
+    FImport fimp;
+    FContents *cts;
+    glong seek;
+    guint32 header_len, mhod_nums;
+
+    g_return_val_if_fail (track, FALSE);
+
+    if (!track->priv->mhit_seek)
+	return TRUE;
+
+    g_return_val_if_fail (track->itdb, FALSE);
+    g_return_val_if_fail (track->itdb->priv->lazy_contents, FALSE);
+
+    memset (&fimp, 0, sizeof (fimp));
+    fimp.itdb = track->itdb;
+    fimp.fcontents = cts = track->itdb->priv->lazy_contents;
+
+    /* the mhit header was checked when parsing */
+    seek = track->priv->mhit_seek;
+    header_len = get32lint (cts, seek+4);
+    mhod_nums = get32lint (cts, seek+12);
+
+    if (get_mhit_mhods (&fimp, track, seek+header_len,
+			mhod_nums, FALSE) == -1)
+    {
+	g_propagate_error (error, fimp.error);
+	cts->error = NULL;
+	return FALSE;
+    }
+
+    track->priv->mhit_seek = 0;
+    itdb_track_intern_strings (track);
+    return TRUE;
+}
+
+/* Materializes all tracks of @itdb parsed with
+   ITDB_PARSE_FLAGS_LAZY_TRACKS and releases the contents of the
+   iTunesDB kept for that purpose. */
+static gboolean itdb_materialize_tracks (Itdb_iTunesDB *itdb, GError **error)
+{
+    GList *gl;
+
+    if (!itdb->priv->lazy_contents)
+	return TRUE;
+
+    for (gl = itdb->tracks; gl; gl = gl->next)
+    {
+	if (!itdb_track_materialize (gl->data, error))
+	    return FALSE;
+    }
+
+    fcontents_free (itdb->priv->lazy_contents);
+    itdb->priv->lazy_contents = NULL;
+    return TRUE;
+}
+
+
+/* up to here we had the functions for reading the iTunesDB               */
+/* ---------------------------------------------------------------------- */
+/* from here on we have the functions for writing the iTunesDB            */
+
+/* Write @len bytes of @data to the temporary file of @cts at
+   @offset. Return FALSE and set cts->error on error. Once an error
+   occurred nothing more is written. */
+static gboolean wcontents_pwrite (WContents *cts, const gchar *data,
+				  gulong len, gulong offset)
+{
+    g_return_val_if_fail (cts, FALSE);
+    g_return_val_if_fail (cts->streaming, FALSE);
+
+    if (cts->error)
+	return FALSE;
+
+    while (len > 0)
+    {
+	gssize written;
+#ifdef WIN32
+	if (lseek (cts->fd, offset, SEEK_SET) == -1)
+	    written = -1;
+	else
+	    written = write (cts->fd, data, len);
+#else
+	written = pwrite (cts->fd, data, len, offset);
+#endif
+	if (written < 0)
+	{
+	    if (errno == EINTR)
+		continue;
+	    g_set_error (&cts->error,
+			 G_FILE_ERROR,
+			 g_file_error_from_errno (errno),
+			 _("Error while writing to '%s' (%s)."),
+			 cts->tmpname, g_strerror (errno));
+	    return FALSE;
+	}
+	data += written;
+	len -= written;
+	offset += written;
+    }
+    return TRUE;
+}
+
+/* Feed the bytes of @cts from cts->hashed up to @end, which must
+   still be in memory, to cts->checksum. The back-patches recorded by
+   the sizing pass are hashed instead of the placeholders they will
+   replace. */
+static void wcontents_hash (WContents *cts, gulong end)
+{
+    WContentsPatch *patches = (WContentsPatch *)cts->patches->data;
+    guint nr_patches = cts->patches->len;
+    gulong pos = cts->hashed;
+
+    while (pos < end)
+    {
+	WContentsPatch *patch = NULL;
+	gulong next = end;
+
+	/* skip the patches hashed completely */
+	while ((cts->next_patch < nr_patches) &&
+	       (patches[cts->next_patch].seek +
+		patches[cts->next_patch].len <= pos))
+	{
+	    ++cts->next_patch;
+	}
+	if ((cts->next_patch < nr_patches) &&
+	    (patches[cts->next_patch].seek < end))
+	{
+	    patch = &patches[cts->next_patch];
+	    next = MAX (patch->seek, pos);
+	}
+
+	/* bytes up to the next patch as they are */
+	itdb_device_checksum_update (cts->checksum,
+				     (guchar *)&cts->contents[pos-cts->flushed],
+				     next - pos);
+	pos = next;
+	if (patch)
+	{
+	    gulong patch_end = MIN (patch->seek + patch->len, end);
+	    itdb_device_checksum_update (cts->checksum,
+					 patch->data + (pos - patch->seek),
+					 patch_end - pos);
+	    pos = patch_end;
+	}
+    }
+    cts->hashed = end;
+}
+
+/* Remember a back-patch made during the sizing pass for
+   wcontents_hash() */
+static void wcontents_record_patch (WContents *cts, const gchar *data,
+				    gulong len, gulong seek)
+{
+    WContentsPatch patch;
+
+    g_return_if_fail (len <= sizeof (patch.data));
+
+    patch.seek = seek;
+    patch.len = len;
+    patch.index = cts->patches->len;
+    memcpy (patch.data, data, len);
+    g_array_append_val (cts->patches, patch);
+}
+
+static gint wcontents_patch_compare (gconstpointer a, gconstpointer b)
+{
+    const WContentsPatch *pa = a;
+    const WContentsPatch *pb = b;
+
+    if (pa->seek != pb->seek)
+	return (pa->seek < pb->seek) ? -1 : 1;
+    return (gint)pa->index - (gint)pb->index;
+}
+
+/* Sort the patches recorded by the sizing pass by position. Where the
+   same bytes were patched several times only the last patch is
+   kept. */
+static void wcontents_sort_patches (WContents *cts)
+{
+    WContentsPatch *patches;
+    guint i, n = 0;
+
+    g_array_sort (cts->patches, wcontents_patch_compare);
+    patches = (WContentsPatch *)cts->patches->data;
+    for (i=0; i<cts->patches->len; ++i)
+    {
+	if ((n > 0) && (patches[n-1].seek == patches[i].seek) &&
+	    (patches[n-1].len == patches[i].len))
+	    patches[n-1] = patches[i];
+	else
+	    patches[n++] = patches[i];
+    }
+    g_array_set_size (cts->patches, n);
+    cts->next_patch = 0;
+}
+
+/* Write the bytes of @cts kept in memory to its temporary file */
+static void wcontents_flush (WContents *cts)
+{
+    g_return_if_fail (cts);
+
+    if (cts->checksum)
+    {   /* the bytes are gone from memory after this */
+	wcontents_hash (cts, cts->pos);
+    }
+    if (cts->streaming && (cts->pos > cts->flushed))
+    {
+	wcontents_pwrite (cts, cts->contents,
+			  cts->pos - cts->flushed, cts->flushed);
+	cts->flushed = cts->pos;
+    }
+}
+
+/* will expand @cts when necessary in order to accomodate @len bytes
+   starting at @seek */
+static void wcontents_maybe_expand (WContents *cts, gulong len,
+				    gulong seek)
+{
+    gulong end;
+
+    g_return_if_fail (cts);
+
+    if (cts->checksum && (cts->pos - cts->hashed >= WCONTENTS_HASH_STEP))
+    {   /* checksum the data while it is still in the cache */
+	wcontents_hash (cts, cts->pos);
+    }
+
+    /* back-patching a header must not grow the buffer */
+    end = MAX (seek+len, cts->pos);
+    if (cts->streaming && (end - cts->flushed > cts->total))
+    {   /* make room by writing out what we have */
+	wcontents_flush (cts);
+    }
+    while (end - cts->flushed > cts->total)
+    {
+	cts->total += WCONTENTS_STEPSIZE;
+	cts->contents = g_realloc (cts->contents, cts->total);
+    }
+}
+
+
+/* Write @data, @n bytes long to position @seek. Will always be
+ * successful because glib terminates when out of memory */
+static void put_data_seek (WContents *cts, gchar *data,
+			   gulong len, gulong seek)
+{
+    g_return_if_fail (cts);
+
+    if (len != 0)
+    {
+	g_return_if_fail (data);
+	if (cts->sizing)
+	{   /* only the position counts -- and the back-patches for
+	       the fused checksum */
+	    if (cts->patches && (seek < cts->pos))
+		wcontents_record_patch (cts, data, len, seek);
+	}
+	else if (seek < cts->flushed)
+	{   /* back-patch data already written to disk */
+	    gulong n = MIN (len, cts->flushed - seek);
+	    wcontents_pwrite (cts, data, n, seek);
+	    if (n < len)
+		memcpy (cts->contents, data+n, len-n);
+	}
+	else
+	{
+	    wcontents_maybe_expand (cts, len, seek);
+	    memcpy (&cts->contents[seek-cts->flushed], data, len);
+	}
+	/* adjust end position if necessary */
+	if (seek+len > cts->pos)
 	    cts->pos = seek+len;
     }
 }
@@ -3484,6 +4459,82 @@ static void put_string (WContents *cts, gchar *string)
     put_data (cts, string, strlen(string));
 }
 
+/* Returns the length of @string if it consists of ASCII characters
+ * only, -1 otherwise */
+static glong ascii_strlen (const gchar *string)
+{
+    gsize len, i = 0;
+
+    len = strlen (string);
+#ifdef __SSE2__
+    for (; i+16 <= len; i+=16)
+    {
+	if (_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)(string+i))))
+	    return -1;
+    }
+#endif
+    for (; i<len; ++i)
+    {
+	if ((guchar)string[i] & 0x80)
+	    return -1;
+    }
+    return len;
+}
+
+/* Write the @len ASCII characters of @string (see ascii_strlen())
+ * as UTF-16LE without trailing Null to end of @cts. */
+static void put_ascii_as_utf16l (WContents *cts, const gchar *string,
+				 gulong len)
+{
+    guchar *out;
+    gulong i = 0;
+
+    g_return_if_fail (cts);
+
+    if (cts->sizing)
+    {
+	cts->pos += 2*len;
+	return;
+    }
+    wcontents_maybe_expand (cts, 2*len, cts->pos);
+    out = (guchar *)&cts->contents[cts->pos-cts->flushed];
+#ifdef __SSE2__
+    {
+	const __m128i zero = _mm_setzero_si128 ();
+	for (; i+16 <= len; i+=16)
+	{
+	    __m128i v = _mm_loadu_si128 ((const __m128i *)(string+i));
+	    _mm_storeu_si128 ((__m128i *)(out+2*i),
+			      _mm_unpacklo_epi8 (v, zero));
+	    _mm_storeu_si128 ((__m128i *)(out+2*i+16),
+			      _mm_unpackhi_epi8 (v, zero));
+	}
+    }
+#endif
+    for (; i<len; ++i)
+    {
+	out[2*i] = string[i];
+	out[2*i+1] = 0;
+    }
+    cts->pos += 2*len;
+}
+
+/* Returns the number of UTF-16 code units g_utf8_to_utf16() will
+ * produce for the valid UTF-8 @string */
+static glong utf8_utf16_len (const gchar *string)
+{
+    glong len = 0;
+
+    for (; *string; string = g_utf8_next_char (string))
+    {
+	if (g_utf8_get_char (string) > 0xffff)
+	    len += 2;   /* surrogate pair */
+	else
+	    len += 1;
+    }
+    return len;
+}
+
 /* Write 4-byte long @header identifcation taking into account
  * possible reversed endianess */
 static void put_header (WContents *cts, gchar *header)
@@ -3667,8 +4718,11 @@ static void put16_n0 (WContents *cts, gulong n)
 
     if (n>0)
     {
-	wcontents_maybe_expand (cts, 2*n, cts->pos);
-	memset (&cts->contents[cts->pos], 0, 2*n);
+	if (!cts->sizing)
+	{
+	    wcontents_maybe_expand (cts, 2*n, cts->pos);
+	    memset (&cts->contents[cts->pos-cts->flushed], 0, 2*n);
+	}
 	cts->pos += 2*n;
     }
 }
@@ -3680,8 +4734,11 @@ static void put32_n0 (WContents *cts, gulong n)
 
     if (n>0)
     {
-	wcontents_maybe_expand (cts, 4*n, cts->pos);
-	memset (&cts->contents[cts->pos], 0, 4*n);
+	if (!cts->sizing)
+	{
+	    wcontents_maybe_expand (cts, 4*n, cts->pos);
+	    memset (&cts->contents[cts->pos-cts->flushed], 0, 4*n);
+	}
 	cts->pos += 4*n;
     }
 }
@@ -4148,14 +5205,28 @@ static gchar *get_sort_artist (Itdb_Track *track)
 
 
 
-static gint mhod52_sort_title (const struct mhod52track *a, const struct mhod52track *b)
+/* The MHOD 52 comparison functions are called by g_ptr_array_sort()
+   with pointers to the struct mhod52track pointers. They fall back to
+   the track index so that the result does not depend on the order of
+   the array -- the same array is sorted repeatedly during one
+   export. */
+static gint mhod52_sort_title (gconstpointer pa, gconstpointer pb)
 {
-    return strcmp (a->title, b->title);
+    const struct mhod52track *a = *(struct mhod52track * const *)pa;
+    const struct mhod52track *b = *(struct mhod52track * const *)pb;
+    gint result;
+
+    result = strcmp (a->title, b->title);
+    if (result == 0)
+	result = a->index - b->index;
+    return result;
 }
 
 
-static gint mhod52_sort_album (const struct mhod52track *a, const struct mhod52track *b)
+static gint mhod52_sort_album (gconstpointer pa, gconstpointer pb)
 {
+    const struct mhod52track *a = *(struct mhod52track * const *)pa;
+    const struct mhod52track *b = *(struct mhod52track * const *)pb;
     gint result;
 
     result = strcmp (a->album, b->album);
@@ -4165,11 +5236,15 @@ static gint mhod52_sort_album (const struct mhod52track *a, const struct mhod52t
 	result = a->track_nr - b->track_nr;
     if (result == 0)
 	result = strcmp (a->title, b->title);
+    if (result == 0)
+	result = a->index - b->index;
     return result;
 }
 
-static gint mhod52_sort_artist (struct mhod52track *a, struct mhod52track *b)
+static gint mhod52_sort_artist (gconstpointer pa, gconstpointer pb)
 {
+    const struct mhod52track *a = *(struct mhod52track * const *)pa;
+    const struct mhod52track *b = *(struct mhod52track * const *)pb;
     gint result;
 
     result = strcmp (a->artist, b->artist);
@@ -4181,11 +5256,15 @@ static gint mhod52_sort_artist (struct mhod52track *a, struct mhod52track *b)
 	result = a->track_nr - b->track_nr;
     if (result == 0)
 	result = strcmp (a->title, b->title);
+    if (result == 0)
+	result = a->index - b->index;
     return result;
 }
 
-static gint mhod52_sort_genre (struct mhod52track *a, struct mhod52track *b)
+static gint mhod52_sort_genre (gconstpointer pa, gconstpointer pb)
 {
+    const struct mhod52track *a = *(struct mhod52track * const *)pa;
+    const struct mhod52track *b = *(struct mhod52track * const *)pb;
     gint result;
 
     result = strcmp (a->genre, b->genre);
@@ -4199,11 +5278,15 @@ static gint mhod52_sort_genre (struct mhod52track *a, struct mhod52track *b)
 	result = a->track_nr - b->track_nr;
     if (result == 0)
 	result = strcmp (a->title, b->title);
+    if (result == 0)
+	result = a->index - b->index;
     return result;
 }
 
-static gint mhod52_sort_composer (struct mhod52track *a, struct mhod52track *b)
+static gint mhod52_sort_composer (gconstpointer pa, gconstpointer pb)
 {
+    const struct mhod52track *a = *(struct mhod52track * const *)pa;
+    const struct mhod52track *b = *(struct mhod52track * const *)pb;
     gint result;
 
     result = strcmp (a->composer, b->composer);
@@ -4215,6 +5298,8 @@ static gint mhod52_sort_composer (struct mhod52track *a, struct mhod52track *b)
 	result = a->track_nr - b->track_nr;
     if (result == 0)
 	result = strcmp (a->title, b->title);
+    if (result == 0)
+	result = a->index - b->index;
     return result;
 }
 
@@ -4222,7 +5307,7 @@ static gint mhod52_sort_composer (struct mhod52track *a, struct mhod52track *b)
 /* Return the first alpha-numeric character in the string
    Return upper-case for alpha, return 0 for all numbers */
 
-static gunichar2 jump_table_letter (gchar *p)
+static gunichar2 jump_table_letter (const gchar *p)
 {
     gunichar chr = 0;
     gboolean found_alnum_chars = FALSE;
@@ -4271,134 +5356,212 @@ static gunichar2 jump_table_letter (gchar *p)
 }
 
 
-/* Create a new list containing all tracks but with collate keys
-   instead of the actual strings (title, artist, album, genre,
-   composer) */
-static GList *mhod52_make_collate_keys (GList *tracks)
-{
-    gint numtracks = g_list_length (tracks);
-    GList *gl, *coltracks = NULL;
-    gint index=0;
+/* indices into track->priv->collate_keys */
+enum {
+    COLLATE_KEY_ALBUM,
+    COLLATE_KEY_TITLE,
+    COLLATE_KEY_ARTIST,
+    COLLATE_KEY_GENRE,
+    COLLATE_KEY_COMPOSER
+};
 
-    for (gl=tracks; gl; gl=gl->next)
+/* Bring the cached collate key @ck up to date with @str, which may be
+   NULL. The key is only recomputed if @str differs from the string
+   it was created from last time. */
+static void update_collate_key (Itdb_CollateKey *ck, const gchar *str)
+{
+    if (ck->key)
     {
-	gchar *str;
-	struct mhod52track *ct;
-	Itdb_Track *tr = gl->data;
-	g_return_val_if_fail (tr, NULL);
-
-	ct = g_new0 (struct mhod52track, 1);
-	coltracks = g_list_prepend (coltracks, ct);
-
-	/* album */
-	if (tr->sort_album && *tr->sort_album)
-	{
-	    ct->album = g_utf8_collate_key (tr->sort_album, -1);
-	    ct->letter_album = jump_table_letter (tr->sort_album);
-	}
-	else if (tr->album)
-	{
-	    ct->album = g_utf8_collate_key (tr->album, -1);
-	    ct->letter_album = jump_table_letter (tr->album);
-	}
-	else
-	{
-	    ct->album = g_strdup ("");
-	    ct->letter_album = '0';
-	}
-
-	/* title */
-	if (tr->sort_title && *tr->sort_title)
-	{
-	    ct->title = g_utf8_collate_key (tr->sort_title, -1);
-	    ct->letter_title = jump_table_letter (tr->sort_title);
-	}
-	else if (tr->title)
-	{
-	    ct->title = g_utf8_collate_key (tr->title, -1);
-	    ct->letter_title = jump_table_letter (tr->title);
-	}
-	else
-	{
-	    ct->title = g_strdup ("");
-	    ct->letter_title = '0';
-	}
-
-	/* artist */
-	str = get_sort_artist (tr);
-	if (str)
-	{
-	    ct->artist = g_utf8_collate_key (str, -1);
-	    ct->letter_artist = jump_table_letter (str);
-	    g_free (str);
-	}
-	else if (tr->artist)
-	{
-	    ct->artist = g_utf8_collate_key (tr->artist, -1);
-	    ct->letter_artist = jump_table_letter (tr->artist);
-	}
-	else
-	{
-	    ct->artist = g_strdup ("");
-	    ct->letter_artist = '0';
-	}
-
-	/* genre */
-	if (tr->genre)
-	{
-	    ct->genre = g_utf8_collate_key (tr->genre, -1);
-	    ct->letter_genre = jump_table_letter (tr->genre);
-	}
-	else
-	{
-	    ct->genre = g_strdup ("");
-	    ct->letter_genre = '0';
-	}
-
-	/* composer */
-	if (tr->sort_composer && *tr->sort_composer)
-	{
-	    ct->composer = g_utf8_collate_key (tr->sort_composer, -1);
-	    ct->letter_composer = jump_table_letter (tr->sort_composer);
-	}
-	else if (tr->composer)
-	{
-	    ct->composer = g_utf8_collate_key (tr->composer, -1);
-	    ct->letter_composer = jump_table_letter (tr->composer);
-	}
-	else
-	{
-	    ct->composer = g_strdup ("");
-	    ct->letter_composer = '0';
-	}
+	if (str == NULL && ck->source == NULL)
+	    return;
+	if (str && ck->source && (strcmp (str, ck->source) == 0))
+	    return;
+    }
 
-	ct->track_nr = tr->track_nr;
-	ct->cd_nr = tr->cd_nr;
-	ct->numtracks = numtracks;
-	ct->index = index++;
+    g_free (ck->source);
+    g_free (ck->key);
+    ck->source = g_strdup (str);
+    if (str)
+    {
+	ck->key = g_utf8_collate_key (str, -1);
+	ck->letter = jump_table_letter (str);
+    }
+    else
+    {
+	ck->key = g_strdup ("");
+	ck->letter = '0';
     }
-    return coltracks;
 }
 
-
-/* Free all memory used up by the collate keys */
-static void mhod52_free_collate_keys (GList *coltracks)
+/* Bring the collate keys of the strings of @tr used for the MHOD 52
+   lists up to date. Only the keys of strings that changed since the
+   last write are recomputed. */
+static void update_collate_keys (Itdb_Track *tr)
 {
-    GList *gl;
+    Itdb_CollateKey *keys;
+    gchar *str;
 
-    for (gl=coltracks; gl; gl=gl->next)
+    if (!tr->priv->collate_keys)
     {
-	struct mhod52track *ct = gl->data;
-	g_return_if_fail (ct);
-	g_free (ct->album);
-	g_free (ct->title);
-	g_free (ct->artist);
-	g_free (ct->genre);
-	g_free (ct->composer);
-	g_free (ct);
+	tr->priv->collate_keys = g_new0 (Itdb_CollateKey, ITDB_COLLATE_KEYS);
     }
-    g_list_free (coltracks);
-}
+    keys = tr->priv->collate_keys;
+
+    if (tr->sort_album && *tr->sort_album)
+	update_collate_key (&keys[COLLATE_KEY_ALBUM], tr->sort_album);
+    else
+	update_collate_key (&keys[COLLATE_KEY_ALBUM], tr->album);
+
+    if (tr->sort_title && *tr->sort_title)
+	update_collate_key (&keys[COLLATE_KEY_TITLE], tr->sort_title);
+    else
+	update_collate_key (&keys[COLLATE_KEY_TITLE], tr->title);
+
+    if (tr->sort_artist && *tr->sort_artist)
+    {   /* avoid the copy made by get_sort_artist() */
+	update_collate_key (&keys[COLLATE_KEY_ARTIST], tr->sort_artist);
+    }
+    else
+    {
+	str = get_sort_artist (tr);
+	update_collate_key (&keys[COLLATE_KEY_ARTIST],
+			    str ? str : tr->artist);
+	g_free (str);
+    }
+
+    update_collate_key (&keys[COLLATE_KEY_GENRE], tr->genre);
+
+    if (tr->sort_composer && *tr->sort_composer)
+	update_collate_key (&keys[COLLATE_KEY_COMPOSER], tr->sort_composer);
+    else
+	update_collate_key (&keys[COLLATE_KEY_COMPOSER], tr->composer);
+}
+
+/* A range of tracks whose collate keys are updated by one thread */
+typedef struct
+{
+    Itdb_Track **tracks;
+    guint32 n;
+} CollateRange;
+
+static void update_collate_range (gpointer data, gpointer user_data)
+{
+    CollateRange *range = data;
+    guint32 i;
+
+    for (i=0; i<range->n; ++i)
+    {
+	update_collate_keys (range->tracks[i]);
+    }
+}
+
+/* Update the collate keys of all tracks of @itdb with @nr_threads
+   threads. If no thread pool can be created the keys are left to
+   mhod52_make_collate_keys() to update. */
+static void update_collate_keys_threaded (Itdb_iTunesDB *itdb,
+					  guint nr_threads)
+{
+    guint32 nr_tracks = g_list_length (itdb->tracks);
+    guint32 nr_ranges = (nr_tracks + COLLATE_KEYS_RANGE - 1) / COLLATE_KEYS_RANGE;
+    Itdb_Track **tracks;
+    CollateRange *ranges;
+    GThreadPool *pool;
+    GList *gl;
+    guint32 i;
+
+    pool = g_thread_pool_new (update_collate_range, NULL,
+			      nr_threads, FALSE, NULL);
+    if (!pool)
+	return;
+
+    tracks = g_new (Itdb_Track *, nr_tracks);
+    i = 0;
+    for (gl=itdb->tracks; gl; gl=gl->next)
+	tracks[i++] = gl->data;
+
+    ranges = g_new (CollateRange, nr_ranges);
+    for (i=0; i<nr_ranges; ++i)
+    {
+	ranges[i].tracks = &tracks[i*COLLATE_KEYS_RANGE];
+	ranges[i].n = MIN (COLLATE_KEYS_RANGE, nr_tracks - i*COLLATE_KEYS_RANGE);
+	g_thread_pool_push (pool, &ranges[i], NULL);
+    }
+    /* wait for all keys to be updated */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    g_free (ranges);
+    g_free (tracks);
+}
+
+/* Create a new array containing all tracks but with collate keys
+   instead of the actual strings (title, artist, album, genre,
+   composer). The keys are cached with the tracks and only recomputed
+   for strings that changed since the last write. */
+static GPtrArray *mhod52_make_collate_keys (Itdb_iTunesDB *itdb,
+					    GList *tracks)
+{
+    gint numtracks = g_list_length (tracks);
+    GPtrArray *coltracks;
+    GList *gl;
+    gint index=0;
+    guint nr_threads;
+
+    /* Computing the keys is expensive: spread the tracks of the
+       itdb over several threads. The MPL may list a track twice, so
+       it cannot be split up safely itself. */
+    nr_threads = itdb_thread_count ();
+    if ((nr_threads > 1) && (numtracks >= COLLATE_KEYS_THREADED_MIN))
+    {
+	update_collate_keys_threaded (itdb, nr_threads);
+    }
+
+    coltracks = g_ptr_array_sized_new (numtracks);
+    for (gl=tracks; gl; gl=gl->next)
+    {
+	struct mhod52track *ct;
+	Itdb_CollateKey *keys;
+	Itdb_Track *tr = gl->data;
+	g_return_val_if_fail (tr, coltracks);
+
+	/* nothing to do if the keys were updated above */
+	update_collate_keys (tr);
+	keys = tr->priv->collate_keys;
+
+	ct = g_new (struct mhod52track, 1);
+	g_ptr_array_add (coltracks, ct);
+
+	ct->album = keys[COLLATE_KEY_ALBUM].key;
+	ct->letter_album = keys[COLLATE_KEY_ALBUM].letter;
+	ct->title = keys[COLLATE_KEY_TITLE].key;
+	ct->letter_title = keys[COLLATE_KEY_TITLE].letter;
+	ct->artist = keys[COLLATE_KEY_ARTIST].key;
+	ct->letter_artist = keys[COLLATE_KEY_ARTIST].letter;
+	ct->genre = keys[COLLATE_KEY_GENRE].key;
+	ct->letter_genre = keys[COLLATE_KEY_GENRE].letter;
+	ct->composer = keys[COLLATE_KEY_COMPOSER].key;
+	ct->letter_composer = keys[COLLATE_KEY_COMPOSER].letter;
+
+	ct->track_nr = tr->track_nr;
+	ct->cd_nr = tr->cd_nr;
+	ct->numtracks = numtracks;
+	ct->index = index++;
+    }
+    return coltracks;
+}
+
+
+/* Free all memory used up by the collate keys array (the keys
+   themselves stay cached with the tracks) */
+static void mhod52_free_collate_keys (GPtrArray *coltracks)
+{
+    guint i;
+
+    for (i=0; i<coltracks->len; ++i)
+    {
+	g_free (g_ptr_array_index (coltracks, i));
+    }
+    g_ptr_array_free (coltracks, TRUE);
+}
 
 static void
 itdb_chapterdata_build_chapter_blob_internal (WContents *cts,
@@ -4498,10 +5661,20 @@ static void mk_mhod (FExport *fexp, MHODData *mhod)
       if (!cts->reversed)
       {
 	  /* convert to utf16  */
-	  glong len;
-	  gunichar2 *entry_utf16 = g_utf8_to_utf16 (mhod->data.string, -1,
-						    NULL, &len, NULL);
-	  fixup_little_utf16 (entry_utf16);
+	  gunichar2 *entry_utf16 = NULL;
+	  glong len = ascii_strlen (mhod->data.string);
+	  gboolean ascii = (len != -1);
+	  if (!ascii && cts->sizing &&
+	      g_utf8_validate (mhod->data.string, -1, NULL))
+	  {   /* only the length is needed */
+	      len = utf8_utf16_len (mhod->data.string);
+	  }
+	  else if (!ascii)
+	  {
+	      entry_utf16 = g_utf8_to_utf16 (mhod->data.string, -1,
+					     NULL, &len, NULL);
+	      fixup_little_utf16 (entry_utf16);
+	  }
 	  put_header (cts, "mhod");   /* header                     */
 	  put32lint (cts, 24);        /* size of header             */
 	  put32lint (cts, sizeof (gunichar2)*len+40);  /* size of header + body      */
@@ -4512,7 +5685,12 @@ static void mk_mhod (FExport *fexp, MHODData *mhod)
 	  put32lint (cts, sizeof (gunichar2)*len);     /* size of string             */
 	  put32lint (cts, 1);         /* unknown, but is set to 1 */
 	  put32lint (cts, 0);
-	  put_data (cts, (gchar *)entry_utf16, sizeof (gunichar2)*len);/* the string */
+	  if (ascii)
+	      put_ascii_as_utf16l (cts, mhod->data.string, len);
+	  else if (cts->sizing)
+	      cts->pos += sizeof (gunichar2)*len;
+	  else
+	      put_data (cts, (gchar *)entry_utf16, sizeof (gunichar2)*len);/* the string */
 	  g_free (entry_utf16);
       }
       else
@@ -4692,12 +5870,13 @@ static void mk_mhod (FExport *fexp, MHODData *mhod)
       break;
   case MHOD_ID_LIBPLAYLISTINDEX:
       g_return_if_fail (mhod->data.mhod52coltracks);
-      g_return_if_fail (mhod->data.mhod52coltracks->data);
+      g_return_if_fail (mhod->data.mhod52coltracks->len > 0);
       {
-	  struct mhod52track *ct = mhod->data.mhod52coltracks->data;
+	  GPtrArray *coltracks = mhod->data.mhod52coltracks;
+	  struct mhod52track *ct = g_ptr_array_index (coltracks, 0);
 	  gint numtracks = ct->numtracks;
-	  GList *gl;
-	  gpointer compfunc = NULL;
+	  guint i;
+	  GCompareFunc compfunc = NULL;
  	  gunichar2 sortkey = 0;
           gunichar2 lastsortkey = 0;
 	  guint32 mhod53index = 0;
@@ -4725,8 +5904,7 @@ static void mk_mhod (FExport *fexp, MHODData *mhod)
 	  g_return_if_fail (compfunc);
 
 	  /* sort the tracks */
-	  mhod->data.mhod52coltracks = g_list_sort (mhod->data.mhod52coltracks,
-						    compfunc);
+	  g_ptr_array_sort (coltracks, compfunc);
 	  /* Write the MHOD */
 	  put_header (cts, "mhod");         /* header                     */
 	  put32lint (cts, 24);              /* size of header             */
@@ -4737,9 +5915,9 @@ static void mk_mhod (FExport *fexp, MHODData *mhod)
 	  put32lint (cts, mhod->mhod52sorttype);   /* sort type     */
 	  put32lint (cts, numtracks);       /* number of entries          */
 	  put32_n0 (cts, 10);               /* unknown                    */
-	  for (gl=mhod->data.mhod52coltracks; gl; gl=gl->next)
+	  for (i=0; i<coltracks->len; ++i)
 	  {
-	      ct = gl->data;
+	      ct = g_ptr_array_index (coltracks, i);
 	      g_return_if_fail (ct);
 	      put32lint (cts, ct->index);
 
@@ -5052,6 +6230,366 @@ static void mk_mhip (FExport *fexp,
 }
 
 
+/* Copy the mhit of @track cached by the last write (see
+   itdb_set_change_tracking()) and fill in the IDs assigned by
+   prepare_itdb_for_write() and the ArtworkDB writer. */
+static void put_cached_mhit (WContents *cts, Itdb_Track *track)
+{
+    GByteArray *cache = track->priv->mhit_cache;
+    gulong mhit_seek = cts->pos;
+
+    put_data (cts, (gchar *)cache->data, cache->len);
+    /* offsets as written by mk_mhit() */
+    put32lint_seek (cts, track->id, mhit_seek+0x10);
+    put32lint_seek (cts, track->priv->album_id, mhit_seek+0x120);
+    put32lint_seek (cts, track->mhii_link, mhit_seek+0x160);
+    put32lint_seek (cts, track->priv->artist_id, mhit_seek+0x1E0);
+    put32lint_seek (cts, track->priv->composer_id, mhit_seek+0x1F4);
+}
+
+/* Keep a copy of the mhit of @track just written at @mhit_seek for
+   the next write. Tracks partly flushed to disk in streaming mode are
+   not cached. */
+static void cache_mhit (WContents *cts, Itdb_Track *track,
+			gulong mhit_seek)
+{
+    gulong len = cts->pos - mhit_seek;
+
+    if (cts->sizing)
+	return;
+
+    itdb_track_drop_mhit_cache (track);
+    if (mhit_seek < cts->flushed)
+	return;
+    track->priv->mhit_cache = g_byte_array_sized_new (len);
+    g_byte_array_append (track->priv->mhit_cache,
+			 (guint8 *)&cts->contents[mhit_seek-cts->flushed],
+			 len);
+}
+
+/* Write the mhit of @track with all its mhods to fexp->wcontents,
+   reusing the cached mhit if @use_cache is set */
+static void write_track (FExport *fexp, Itdb_Track *track,
+			 gboolean use_cache)
+{
+    WContents *cts = fexp->wcontents;
+    guint32 mhod_num = 0;
+    gulong mhit_seek = cts->pos;
+    MHODData mhod;
+
+    g_return_if_fail (track);
+
+    if (use_cache && track->priv->mhit_cache)
+    {
+	put_cached_mhit (cts, track);
+	return;
+    }
+
+    mhod.valid = TRUE;
+
+    mk_mhit (cts, track);
+    if (track->title && *track->title)
+    {
+	mhod.type = MHOD_ID_TITLE;
+	mhod.data.string = track->title;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->artist && *track->artist)
+    {
+	mhod.type = MHOD_ID_ARTIST;
+	mhod.data.string = track->artist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->album && *track->album)
+    {
+	mhod.type = MHOD_ID_ALBUM;
+	mhod.data.string = track->album;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->filetype && *track->filetype)
+    {
+	mhod.type = MHOD_ID_FILETYPE;
+	mhod.data.string = track->filetype;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->comment && *track->comment)
+    {
+	mhod.type = MHOD_ID_COMMENT;
+	mhod.data.string = track->comment;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->ipod_path && *track->ipod_path)
+    {
+	mhod.type = MHOD_ID_PATH;
+	mhod.data.string = track->ipod_path;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->genre && *track->genre)
+    {
+	mhod.type = MHOD_ID_GENRE;
+	mhod.data.string = track->genre;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->category && *track->category)
+    {
+	mhod.type = MHOD_ID_CATEGORY;
+	mhod.data.string = track->category;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->composer && *track->composer)
+    {
+	mhod.type = MHOD_ID_COMPOSER;
+	mhod.data.string = track->composer;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->grouping && *track->grouping)
+    {
+	mhod.type = MHOD_ID_GROUPING;
+	mhod.data.string = track->grouping;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->description && *track->description)
+    {
+	mhod.type = MHOD_ID_DESCRIPTION;
+	mhod.data.string = track->description;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->subtitle && *track->subtitle)
+    {
+	mhod.type = MHOD_ID_SUBTITLE;
+	mhod.data.string = track->subtitle;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvshow && *track->tvshow)
+    {
+	mhod.type = MHOD_ID_TVSHOW;
+	mhod.data.string = track->tvshow;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvepisode && *track->tvepisode)
+    {
+	mhod.type = MHOD_ID_TVEPISODE;
+	mhod.data.string = track->tvepisode;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->tvnetwork && *track->tvnetwork)
+    {
+	mhod.type = MHOD_ID_TVNETWORK;
+	mhod.data.string = track->tvnetwork;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->albumartist && *track->albumartist)
+    {
+	mhod.type = MHOD_ID_ALBUMARTIST;
+	mhod.data.string = track->albumartist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->keywords && *track->keywords)
+    {
+	mhod.type = MHOD_ID_KEYWORDS;
+	mhod.data.string = track->keywords;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->podcasturl && *track->podcasturl)
+    {
+	mhod.type = MHOD_ID_PODCASTURL;
+	mhod.data.string = track->podcasturl;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->podcastrss && *track->podcastrss)
+    {
+	mhod.type = MHOD_ID_PODCASTRSS;
+	mhod.data.string = track->podcastrss;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_artist && *track->sort_artist)
+    {
+	mhod.type = MHOD_ID_SORT_ARTIST;
+	mhod.data.string = track->sort_artist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_title && *track->sort_title)
+    {
+	mhod.type = MHOD_ID_SORT_TITLE;
+	mhod.data.string = track->sort_title;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_album && *track->sort_album)
+    {
+	mhod.type = MHOD_ID_SORT_ALBUM;
+	mhod.data.string = track->sort_album;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_albumartist && *track->sort_albumartist)
+    {
+	mhod.type = MHOD_ID_SORT_ALBUMARTIST;
+	mhod.data.string = track->sort_albumartist;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_composer && *track->sort_composer)
+    {
+	mhod.type = MHOD_ID_SORT_COMPOSER;
+	mhod.data.string = track->sort_composer;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->sort_tvshow && *track->sort_tvshow)
+    {
+	mhod.type = MHOD_ID_SORT_TVSHOW;
+	mhod.data.string = track->sort_tvshow;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    if (track->chapterdata && track->chapterdata->chapters)
+    {
+	mhod.type = MHOD_ID_CHAPTERDATA;
+	mhod.data.chapterdata = track->chapterdata;
+	mk_mhod (fexp, &mhod);
+	++mhod_num;
+    }
+    /* Fill in the missing items of the mhit header */
+    fix_mhit (cts, mhit_seek, mhod_num);
+
+    if (fexp->itdb->priv->change_tracking)
+	cache_mhit (cts, track, mhit_seek);
+}
+
+/* a range of tracks serialized by one thread of write_tracks_threaded() */
+typedef struct
+{
+    FExport *fexp;        /* shared export state (read only) */
+    Itdb_Track **tracks;  /* tracks to serialize */
+    guint32 n;            /* number of tracks in this range */
+    gboolean use_cache;   /* see write_track() */
+    WContents cts;        /* private buffer the mhits are written to */
+    GError *error;        /* set if serializing the range failed */
+} TrackRange;
+
+/* Serializes the range @data and pushes it to the GAsyncQueue
+   @user_data when done */
+static void write_track_range (gpointer data, gpointer user_data)
+{
+    TrackRange *range = data;
+    FExport fexp;
+    guint32 i;
+
+    /* private copy writing to the range's own buffer */
+    fexp = *range->fexp;
+    fexp.wcontents = &range->cts;
+    fexp.error = NULL;
+
+    for (i=0; (i<range->n) && !fexp.error; ++i)
+    {
+	write_track (&fexp, range->tracks[i], range->use_cache);
+    }
+    range->error = fexp.error;
+    g_async_queue_push (user_data, range);
+}
+
+/* Writes the mhits of the @nr_tracks @tracks to fexp->wcontents,
+   serializing ranges of WRITE_TRACKS_RANGE tracks in parallel with
+   @nr_threads threads and appending them in order. At most a few
+   ranges per thread are held in memory at any time. Errors of the
+   threads are passed on in fexp->error. */
+static void write_tracks_threaded (FExport *fexp, Itdb_Track **tracks,
+				   guint32 nr_tracks, guint nr_threads,
+				   gboolean use_cache)
+{
+    WContents *cts = fexp->wcontents;
+    GThreadPool *pool;
+    GAsyncQueue *finished;
+    TrackRange *ranges;
+    guint nr_ranges;
+    guint32 done;
+    guint i;
+
+    finished = g_async_queue_new ();
+    pool = g_thread_pool_new (write_track_range, finished,
+			      nr_threads, FALSE, NULL);
+    if (!pool)
+    {   /* serialize the tracks in this thread */
+	for (done=0; done<nr_tracks; ++done)
+	    write_track (fexp, tracks[done], use_cache);
+	g_async_queue_unref (finished);
+	return;
+    }
+
+    /* use a few more ranges than threads to even out the load */
+    nr_ranges = nr_threads * 4;
+    ranges = g_new0 (TrackRange, nr_ranges);
+
+    for (done=0; (done<nr_tracks) && !fexp->error; )
+    {
+	guint n;
+
+	for (n=0; (n<nr_ranges) && (done<nr_tracks); ++n)
+	{
+	    ranges[n].fexp = fexp;
+	    ranges[n].tracks = &tracks[done];
+	    ranges[n].n = MIN (WRITE_TRACKS_RANGE, nr_tracks - done);
+	    ranges[n].use_cache = use_cache;
+	    ranges[n].cts.reversed = cts->reversed;
+	    ranges[n].cts.sizing = cts->sizing;
+	    ranges[n].cts.fd = -1;
+	    ranges[n].cts.pos = 0;
+	    done += ranges[n].n;
+	    g_thread_pool_push (pool, &ranges[n], NULL);
+	}
+	/* wait for all ranges of this round to be serialized */
+	for (i=0; i<n; ++i)
+	    g_async_queue_pop (finished);
+
+	for (i=0; i<n; ++i)
+	{
+	    if (ranges[i].error)
+	    {   /* keep the first error */
+		if (!fexp->error)
+		    g_propagate_error (&fexp->error, ranges[i].error);
+		else
+		    g_error_free (ranges[i].error);
+		ranges[i].error = NULL;
+	    }
+	    else if (fexp->error)
+		continue;
+	    else if (cts->sizing)
+		cts->pos += ranges[i].cts.pos;
+	    else
+		put_data (cts, ranges[i].cts.contents, ranges[i].cts.pos);
+	}
+    }
+
+    g_thread_pool_free (pool, FALSE, TRUE);
+    g_async_queue_unref (finished);
+    for (i=0; i<nr_ranges; ++i)
+    {
+	g_free (ranges[i].cts.contents);
+    }
+    g_free (ranges);
+}
+
 /* Write first mhsd hunk. Return FALSE in case of error and set
  * fexp->error */
 static gboolean write_mhsd_tracks (FExport *fexp)
@@ -5059,215 +6597,59 @@ static gboolean write_mhsd_tracks (FExport *fexp)
     GList *gl;
     gulong mhsd_seek;
     WContents *cts;
+    Itdb_iTunesDB_Private *priv;
+    gboolean use_cache;
+    guint32 nr_tracks;
+    guint nr_threads;
 
     g_return_val_if_fail (fexp, FALSE);
     g_return_val_if_fail (fexp->itdb, FALSE);
     g_return_val_if_fail (fexp->wcontents, FALSE);
 
     cts = fexp->wcontents;
+    priv = fexp->itdb->priv;
+
+    /* mhits cached by the last write can be reused unless they were
+       written for a different byte order, time zone or id_0x24 */
+    use_cache = priv->change_tracking &&
+	(priv->mhit_cache_reversed == cts->reversed) &&
+	(priv->mhit_cache_timezone_shift == fexp->itdb->device->timezone_shift) &&
+	(priv->mhit_cache_id_0x24 == priv->id_0x24);
     
     mhsd_seek = cts->pos;      /* get position of mhsd header  */
     mk_mhsd (fexp, 1);         /* write header: type 1: tracks */
     /* write header with nr. of tracks */
-    mk_mhlt (fexp, g_list_length (fexp->itdb->tracks));
-    for (gl=fexp->itdb->tracks; gl; gl=gl->next)  /* Write each track */
+    nr_tracks = g_list_length (fexp->itdb->tracks);
+    mk_mhlt (fexp, nr_tracks);
+    nr_threads = itdb_thread_count ();
+    if ((nr_threads > 1) && (nr_tracks >= WRITE_TRACKS_THREADED_MIN))
     {
-	Itdb_Track *track = gl->data;
-	guint32 mhod_num = 0;
-	gulong mhit_seek = cts->pos;
-	MHODData mhod;
+	Itdb_Track **tracks = g_new (Itdb_Track *, nr_tracks);
+	guint32 i = 0;
 
-	g_return_val_if_fail (track, FALSE);
-
-	mhod.valid = TRUE;
-
-	mk_mhit (cts, track);
-	if (track->title && *track->title)
-	{
-	    mhod.type = MHOD_ID_TITLE;
-	    mhod.data.string = track->title;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->artist && *track->artist)
-	{
-	    mhod.type = MHOD_ID_ARTIST;
-	    mhod.data.string = track->artist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->album && *track->album)
-	{
-	    mhod.type = MHOD_ID_ALBUM;
-	    mhod.data.string = track->album;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->filetype && *track->filetype)
-	{
-	    mhod.type = MHOD_ID_FILETYPE;
-	    mhod.data.string = track->filetype;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->comment && *track->comment)
-	{
-	    mhod.type = MHOD_ID_COMMENT;
-	    mhod.data.string = track->comment;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->ipod_path && *track->ipod_path)
-	{
-	    mhod.type = MHOD_ID_PATH;
-	    mhod.data.string = track->ipod_path;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->genre && *track->genre)
-	{
-	    mhod.type = MHOD_ID_GENRE;
-	    mhod.data.string = track->genre;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->category && *track->category)
-	{
-	    mhod.type = MHOD_ID_CATEGORY;
-	    mhod.data.string = track->category;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->composer && *track->composer)
-	{
-	    mhod.type = MHOD_ID_COMPOSER;
-	    mhod.data.string = track->composer;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->grouping && *track->grouping)
-	{
-	    mhod.type = MHOD_ID_GROUPING;
-	    mhod.data.string = track->grouping;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->description && *track->description)
-	{
-	    mhod.type = MHOD_ID_DESCRIPTION;
-	    mhod.data.string = track->description;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->subtitle && *track->subtitle)
-	{
-	    mhod.type = MHOD_ID_SUBTITLE;
-	    mhod.data.string = track->subtitle;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvshow && *track->tvshow)
-	{
-	    mhod.type = MHOD_ID_TVSHOW;
-	    mhod.data.string = track->tvshow;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvepisode && *track->tvepisode)
-	{
-	    mhod.type = MHOD_ID_TVEPISODE;
-	    mhod.data.string = track->tvepisode;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->tvnetwork && *track->tvnetwork)
-	{
-	    mhod.type = MHOD_ID_TVNETWORK;
-	    mhod.data.string = track->tvnetwork;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->albumartist && *track->albumartist)
-	{
-	    mhod.type = MHOD_ID_ALBUMARTIST;
-	    mhod.data.string = track->albumartist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->keywords && *track->keywords)
-	{
-	    mhod.type = MHOD_ID_KEYWORDS;
-	    mhod.data.string = track->keywords;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->podcasturl && *track->podcasturl)
-	{
-	    mhod.type = MHOD_ID_PODCASTURL;
-	    mhod.data.string = track->podcasturl;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->podcastrss && *track->podcastrss)
-	{
-	    mhod.type = MHOD_ID_PODCASTRSS;
-	    mhod.data.string = track->podcastrss;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_artist && *track->sort_artist)
-	{
-	    mhod.type = MHOD_ID_SORT_ARTIST;
-	    mhod.data.string = track->sort_artist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_title && *track->sort_title)
-	{
-	    mhod.type = MHOD_ID_SORT_TITLE;
-	    mhod.data.string = track->sort_title;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_album && *track->sort_album)
-	{
-	    mhod.type = MHOD_ID_SORT_ALBUM;
-	    mhod.data.string = track->sort_album;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_albumartist && *track->sort_albumartist)
-	{
-	    mhod.type = MHOD_ID_SORT_ALBUMARTIST;
-	    mhod.data.string = track->sort_albumartist;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_composer && *track->sort_composer)
-	{
-	    mhod.type = MHOD_ID_SORT_COMPOSER;
-	    mhod.data.string = track->sort_composer;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->sort_tvshow && *track->sort_tvshow)
-	{
-	    mhod.type = MHOD_ID_SORT_TVSHOW;
-	    mhod.data.string = track->sort_tvshow;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
-	}
-	if (track->chapterdata && track->chapterdata->chapters)
+	for (gl=fexp->itdb->tracks; gl; gl=gl->next)
+	    tracks[i++] = gl->data;
+	write_tracks_threaded (fexp, tracks, nr_tracks, nr_threads,
+			       use_cache);
+	g_free (tracks);
+    }
+    else
+    {
+	for (gl=fexp->itdb->tracks; gl; gl=gl->next)  /* Write each track */
 	{
-	    mhod.type = MHOD_ID_CHAPTERDATA;
-	    mhod.data.chapterdata = track->chapterdata;
-	    mk_mhod (fexp, &mhod);
-	    ++mhod_num;
+	    Itdb_Track *track = gl->data;
+	    g_return_val_if_fail (track, FALSE);
+	    write_track (fexp, track, use_cache);
 	}
-        /* Fill in the missing items of the mhit header */
-	fix_mhit (cts, mhit_seek, mhod_num);
     }
     fix_header (cts, mhsd_seek);
+
+    if (priv->change_tracking && !cts->sizing)
+    {   /* all cached mhits now match these settings */
+	priv->mhit_cache_reversed = cts->reversed;
+	priv->mhit_cache_timezone_shift = fexp->itdb->device->timezone_shift;
+	priv->mhit_cache_id_0x24 = priv->id_0x24;
+    }
     return TRUE;
 }
 
@@ -5542,8 +6924,11 @@ static gboolean write_playlist (FExport *fexp,
 	/* We have to sort all tracks five times. To speed this up,
 	   translate the utf8 keys into collate_keys and use the
 	   faster strcmp() for comparison */
+	if (!fexp->mpl_coltracks)
+	    fexp->mpl_coltracks = mhod52_make_collate_keys (fexp->itdb,
+							     pl->members);
 	mhod.valid = TRUE;
-	mhod.data.mhod52coltracks = mhod52_make_collate_keys (pl->members);
+	mhod.data.mhod52coltracks = fexp->mpl_coltracks;
 	mhod.mhod53_list = NULL;	
 
 	mk_mhod52 (MHOD52_SORTTYPE_TITLE, fexp, &mhod);	
@@ -5556,8 +6941,6 @@ static gboolean write_playlist (FExport *fexp,
 	mk_mhod53 (MHOD52_SORTTYPE_GENRE, fexp, &mhod);
 	mk_mhod52 (MHOD52_SORTTYPE_COMPOSER, fexp, &mhod);
 	mk_mhod53 (MHOD52_SORTTYPE_COMPOSER, fexp, &mhod);
-
-	mhod52_free_collate_keys (mhod.data.mhod52coltracks);
     }
     else  if (pl->is_spl)
     {  /* write the smart rules */
@@ -5730,21 +7113,209 @@ static WContents *wcontents_new (const gchar *filename)
 
     cts = g_new0 (WContents, 1);
     cts->filename = g_strdup (filename);
+    cts->fd = -1;
 
     return cts;
 }
 
 
+/* Create a temporary file next to cts->filename and store its name
+   in @tmpname. Return the file descriptor or -1 and set @error. */
+static gint wcontents_mkstemp (WContents *cts, gchar **tmpname,
+			       GError **error)
+{
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+    gint fd;
+
+    *tmpname = g_strdup_printf ("%s.XXXXXX", cts->filename);
+#if GLIB_CHECK_VERSION(2,22,0)
+    fd = g_mkstemp_full (*tmpname, O_RDWR | O_BINARY, 0666);
+#else
+    fd = g_mkstemp (*tmpname);
+#endif
+    if (fd == -1)
+    {
+	g_set_error (error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Error opening '%s' for writing (%s)."),
+		     *tmpname, g_strerror (errno));
+	g_free (*tmpname);
+	*tmpname = NULL;
+    }
+    return fd;
+}
+
+
+/* Put the empty @cts into streaming mode: from now on only up to
+   WCONTENTS_STEPSIZE bytes are kept in memory, everything else is
+   written to a temporary file which wcontents_write() renames into
+   place. Headers already on disk are back-patched in place. */
+static gboolean wcontents_stream_open (WContents *cts, GError **error)
+{
+    g_return_val_if_fail (cts, FALSE);
+    g_return_val_if_fail (cts->pos == 0, FALSE);
+
+    cts->fd = wcontents_mkstemp (cts, &cts->tmpname, error);
+    if (cts->fd == -1)
+	return FALSE;
+
+    cts->streaming = TRUE;
+    cts->flushed = 0;
+    cts->total = WCONTENTS_STEPSIZE;
+    cts->contents = g_realloc (cts->contents, cts->total);
+    return TRUE;
+}
+
+
+/* Pipeline stage for streaming mode: replace the uncompressed
+   iTunesDB in the temporary file of @cts by a compressed iTunesCDB
+   written to a new temporary file, using zlib @level. */
+static gboolean wcontents_stream_compress (WContents *cts, gint level,
+					   GError **error)
+{
+    GMappedFile *mapped_file;
+    gchar *tmpname;
+    gsize compressed_len;
+    gboolean result;
+    gint fd;
+
+    g_return_val_if_fail (cts, FALSE);
+    g_return_val_if_fail (cts->streaming, FALSE);
+
+    mapped_file = g_mapped_file_new (cts->tmpname, FALSE, error);
+    if (!mapped_file)
+	return FALSE;
+
+    fd = wcontents_mkstemp (cts, &tmpname, error);
+    if (fd == -1)
+    {
+	g_mapped_file_free (mapped_file);
+	return FALSE;
+    }
+
+    result = itdb_zlib_compress_to_fd (g_mapped_file_get_contents (mapped_file),
+				       cts->pos, fd, level, &compressed_len,
+				       error);
+    g_mapped_file_free (mapped_file);
+
+    if (!result)
+    {
+	close (fd);
+	g_unlink (tmpname);
+	g_free (tmpname);
+	return FALSE;
+    }
+
+    close (cts->fd);
+    g_unlink (cts->tmpname);
+    g_free (cts->tmpname);
+    cts->fd = fd;
+    cts->tmpname = tmpname;
+    cts->pos = compressed_len;
+    cts->flushed = compressed_len;
+    return TRUE;
+}
+
+
+/* Pipeline stage for streaming mode: checksum the iTunesDB in the
+   temporary file of @cts. The file is mapped privately, the
+   checksums only change the mhbd header, which is then written back
+   to the file. */
+static gboolean wcontents_stream_checksum (WContents *cts,
+					   Itdb_Device *device,
+					   GError **error)
+{
+    GMappedFile *mapped_file;
+    gchar *data;
+    guint32 header_len;
+
+    g_return_val_if_fail (cts, FALSE);
+    g_return_val_if_fail (cts->streaming, FALSE);
+
+    if (itdb_device_get_checksum_type (device) == ITDB_CHECKSUM_NONE)
+	return TRUE;
+
+    mapped_file = g_mapped_file_new (cts->tmpname, TRUE, error);
+    if (!mapped_file)
+	return FALSE;
+    data = g_mapped_file_get_contents (mapped_file);
+
+    if (!itdb_device_write_checksum (device, (unsigned char *)data,
+				     cts->pos, error))
+    {
+	g_mapped_file_free (mapped_file);
+	return FALSE;
+    }
+
+    header_len = GUINT32_FROM_LE (*(guint32*)(data+4));
+    wcontents_pwrite (cts, data, MIN (header_len, cts->pos), 0);
+    g_mapped_file_free (mapped_file);
+
+    if (cts->error)
+    {
+	g_propagate_error (error, cts->error);
+	cts->error = NULL;
+	return FALSE;
+    }
+    return TRUE;
+}
+
+
 /* write the contents of WContents. Return FALSE on error and set
  * cts->error accordingly. */
 static gboolean wcontents_write (WContents *cts)
 {
+    int res;
+
     g_return_val_if_fail (cts, FALSE);
     g_return_val_if_fail (cts->filename, FALSE);
 
     cts->error = NULL;
-    return g_file_set_contents (cts->filename, cts->contents, 
-                                cts->pos, &cts->error);
+    if (!cts->streaming)
+    {
+	if (!g_file_set_contents (cts->filename, cts->contents,
+				  cts->pos, &cts->error))
+	    return FALSE;
+	itdb_fsync_written_file (cts->filename);
+	return TRUE;
+    }
+
+    /* move the temporary file into place. The data has to be on disk
+       before the rename, or a crash could leave a truncated database
+       behind instead of the old one. */
+    res = itdb_fdatasync (cts->fd);
+    if (close (cts->fd) != 0)
+	res = -1;
+    cts->fd = -1;
+    if (res != 0)
+    {
+	g_set_error (&cts->error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Error when closing '%s' (%s)."),
+		     cts->tmpname, g_strerror (errno));
+	return FALSE;
+    }
+    cts->fd = -1;
+#ifdef WIN32
+    g_unlink (cts->filename);
+#endif
+    if (g_rename (cts->tmpname, cts->filename) != 0)
+    {
+	g_set_error (&cts->error,
+		     G_FILE_ERROR,
+		     g_file_error_from_errno (errno),
+		     _("Failed to rename '%s' to '%s' (%s)."),
+		     cts->tmpname, cts->filename, g_strerror (errno));
+	return FALSE;
+    }
+    g_free (cts->tmpname);
+    cts->tmpname = NULL;
+    itdb_fsync_written_file (cts->filename);
+    return TRUE;
 }
 
 
@@ -5753,8 +7324,18 @@ static void wcontents_free (WContents *cts)
 {
     if (cts)
     {
+	if (cts->fd != -1)
+	    close (cts->fd);
+	if (cts->tmpname)
+	{   /* streaming was aborted */
+	    g_unlink (cts->tmpname);
+	    g_free (cts->tmpname);
+	}
 	g_free (cts->filename);
 	g_free (cts->contents);
+	itdb_device_checksum_free (cts->checksum);
+	if (cts->patches)
+	    g_array_free (cts->patches, TRUE);
 	/* must not g_error_free (cts->error) because the error was
 	   propagated -> might free the error twice */
 	g_free (cts);
@@ -5763,6 +7344,10 @@ static void wcontents_free (WContents *cts)
 
 static gboolean safe_str_equal (gconstpointer v1, gconstpointer v2)
 {
+    /* shortcut for strings shared through the string pool */
+    if (v1 == v2) {
+        return TRUE;
+    }
     if ((v1 == NULL) || (v2 == NULL)) {
         return (v1 == v2);
     } else {
@@ -5857,6 +7442,62 @@ static gboolean itdb_composer_equal (gconstpointer v1, gconstpointer v2)
   return safe_str_equal (track1->composer, track2->composer);
 }
 
+/* Move the tracks of @mpl to the front of itdb->tracks, in the order
+   of @mpl->members. The remaining tracks (podcasts) keep their order.
+   The list links are looked up in a hash table so that this takes
+   linear time. */
+static void reorder_tracks_like_mpl (Itdb_iTunesDB *itdb,
+				     Itdb_Playlist *mpl)
+{
+    GHashTable *links;
+    GList *gl, *head = NULL, *tail = NULL;
+
+    /* link of every track in itdb->tracks */
+    links = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (gl=itdb->tracks; gl; gl=gl->next)
+	g_hash_table_insert (links, gl->data, gl);
+
+    for (gl=mpl->members; gl; gl=gl->next)
+    {
+	Itdb_Track *track = gl->data;
+	GList *link;
+
+	if (!g_hash_table_lookup_extended (links, track, NULL,
+					   (gpointer *)&link))
+	{
+	    g_warning ("%s: MPL member %p is not part of itdb->tracks",
+		       G_STRFUNC, (void *)track);
+	    continue;
+	}
+	if (!link)
+	    continue;  /* listed more than once, already moved */
+	g_hash_table_insert (links, track, NULL);
+
+	/* move @link from itdb->tracks to the end of the new list */
+	itdb->tracks = g_list_remove_link (itdb->tracks, link);
+	if (tail)
+	{
+	    tail->next = link;
+	    link->prev = tail;
+	}
+	else
+	{
+	    head = link;
+	}
+	tail = link;
+    }
+
+    if (tail)
+    {
+	tail->next = itdb->tracks;
+	if (itdb->tracks)
+	    itdb->tracks->prev = tail;
+	itdb->tracks = head;
+    }
+
+    g_hash_table_destroy (links);
+}
+
 /* - reassign the iPod IDs
    - make sure the itdb->tracks are in the same order as the mpl
    - assign album IDs to write the MHLA
@@ -5884,18 +7525,7 @@ static void prepare_itdb_for_write (FExport *fexp)
     mpl = itdb_playlist_mpl (itdb);
     g_return_if_fail (mpl);
 
-    for (gl=g_list_last(mpl->members); gl; gl=gl->prev)
-    {
-	GList *link;
-	Itdb_Track *track = gl->data;
-	g_return_if_fail (track);
-	link = g_list_find (itdb->tracks, track);
-	g_return_if_fail (link);
-
-	/* move this track to the beginning of itdb_tracks */
-	itdb->tracks = g_list_delete_link (itdb->tracks, link);
-	itdb->tracks = g_list_prepend (itdb->tracks, track);
-    }
+    reorder_tracks_like_mpl (itdb, mpl);
 
     fexp->next_id = FIRST_IPOD_ID;
 
@@ -5911,6 +7541,9 @@ static void prepare_itdb_for_write (FExport *fexp)
     fexp->composers = g_hash_table_new_full (itdb_composer_hash, itdb_composer_equal,
 					     NULL, g_free);
 
+    /* the id index is rebuilt on the next lookup */
+    itdb_track_index_invalidate (itdb);
+
     /* assign unique IDs and create sort keys */
     for (gl=itdb->tracks; gl; gl=gl->next)
     {
@@ -5964,49 +7597,14 @@ static void prepare_itdb_for_write (FExport *fexp)
     }
 }
 
-static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
-					  const gchar *filename,
-					  GError **error)
+/* Write the mhbd with all its mhsds to fexp->wcontents. Return FALSE
+   in case of error and set fexp->error */
+static gboolean write_mhbd (FExport *fexp)
 {
-    FExport *fexp;
-    gulong mhbd_seek = 0;
-    WContents *cts;
-    gboolean result = TRUE;
+    WContents *cts = fexp->wcontents;
+    gulong mhbd_seek = cts->pos;
     guint32 num_mhsds;
 
-    g_return_val_if_fail (itdb, FALSE);
-    g_return_val_if_fail (itdb->device, FALSE);
-    g_return_val_if_fail (filename || itdb->filename, FALSE);
-
-    if (!filename) filename = itdb->filename;
-
-    /* set endianess flag */
-    if (!itdb->device->byte_order)
-	itdb_device_autodetect_endianess (itdb->device);
-
-    fexp = g_new0 (FExport, 1);
-    fexp->itdb = itdb;
-    fexp->wcontents = wcontents_new (filename);
-    cts = fexp->wcontents;
-
-    cts->reversed = (itdb->device->byte_order == G_BIG_ENDIAN);
-
-    prepare_itdb_for_write (fexp);
-
-#if HAVE_GDKPIXBUF
-    /* only write ArtworkDB if we deal with an iPod
-       FIXME: figure out a way to store the artwork data when storing
-       to local directories. At the moment it's the application's task
-       to handle this. */
-    /* The ArtworkDB must be written after the call to
-     * prepare_itdb_for_write since it needs Itdb_Track::id to be set
-     * to its final value to write properly on nano video/ipod classics
-     */
-    if (itdb_device_supports_artwork (itdb->device)) {
-        ipod_write_artwork_db (itdb);
-    }
-#endif
-
     /* default mhsd count */
     num_mhsds = 8; /* eight mhsds */
 
@@ -6023,7 +7621,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing list of tracks (mhsd type 1)"));
-	goto err;
+	return FALSE;
     }
 
     /* write special podcast version mhsd (mhsd type 3) */
@@ -6032,7 +7630,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing special podcast playlists (mhsd type 3)"));
-	goto err;
+	return FALSE;
     }
     /* write standard playlist mhsd (mhsd type 2) */
     if (!fexp->error && !write_mhsd_playlists (fexp, 2)) {
@@ -6040,7 +7638,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing standard playlists (mhsd type 2)"));
-	goto err;
+	return FALSE;
     }
 
     /* write albums (mhsd type 4) */
@@ -6049,7 +7647,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing list of albums (mhsd type 4)"));
-	goto err;
+	return FALSE;
     }
     /* write artists (mhsd type 8) */
     if (!fexp->error && !write_mhsd_artists (fexp)) {
@@ -6057,7 +7655,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing list of artists (mhsd type 8)"));
-	goto err;
+	return FALSE;
     }
 
     /* write empty mhsd type 6, whatever it is */
@@ -6066,7 +7664,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing mhsd type 6"));
-	goto err;
+	return FALSE;
     }
 
     /* write empty mhsd type 10, whatever it is */
@@ -6075,7 +7673,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing mhsd type 10"));
-	goto err;
+	return FALSE;
     }
 
     /* write mhsd5 playlists */
@@ -6084,7 +7682,7 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_ITDB_CORRUPT,
 		     _("Error writing mhsd5 playlists"));
-	goto err;
+	return FALSE;
     }
 
     if (fexp->itdb->priv->genius_cuid) {
@@ -6094,25 +7692,203 @@ static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
 		    ITDB_FILE_ERROR,
 		    ITDB_FILE_ERROR_ITDB_CORRUPT,
 		    _("Error writing mhsd type 9"));
-	    goto err;
+	    return FALSE;
 	}
     }
 
     fix_header (cts, mhbd_seek);
+    return !fexp->error;
+}
 
-    if (itdb_device_supports_compressed_itunesdb (itdb->device)) {
-	if (!itdb_zlib_check_compress_fexp (fexp)) {
+/* Serialize the iTunesDB without storing anything to determine its
+   exact size. Return 0 in case of error and set fexp->error */
+static gulong measure_mhbd (FExport *fexp)
+{
+    WContents *cts = fexp->wcontents;
+    guint32 next_id = fexp->next_id;
+    gulong size = 0;
+
+    cts->sizing = TRUE;
+    if (write_mhbd (fexp))
+	size = cts->pos;
+    cts->sizing = FALSE;
+    cts->pos = 0;
+    /* the podcast groups take their IDs from next_id */
+    fexp->next_id = next_id;
+
+    return size;
+}
+
+/* Complete the checksum computed while writing @cts and fill it into
+   the mhbd header */
+static gboolean wcontents_checksum_finish (WContents *cts, GError **error)
+{
+    const guchar *header;
+    gsize header_len;
+    gboolean result;
+
+    g_return_val_if_fail (cts->checksum, FALSE);
+
+    wcontents_hash (cts, cts->pos);
+    result = itdb_device_checksum_finish (cts->checksum,
+					  &header, &header_len, error);
+    if (result)
+	put_data_seek (cts, (gchar *)header, header_len, 0);
+    itdb_device_checksum_free (cts->checksum);
+    cts->checksum = NULL;
+    return result;
+}
+
+/* Free @fexp including its WContents */
+static void fexport_free (FExport *fexp)
+{
+    wcontents_free (fexp->wcontents);
+    if (fexp->albums != NULL) {
+	g_hash_table_destroy (fexp->albums);
+    }
+    if (fexp->artists != NULL) {
+	g_hash_table_destroy (fexp->artists);
+    }
+    if (fexp->composers != NULL) {
+	g_hash_table_destroy (fexp->composers);
+    }
+    if (fexp->mpl_coltracks != NULL) {
+	mhod52_free_collate_keys (fexp->mpl_coltracks);
+    }
+    g_free (fexp);
+}
+
+static gboolean itdb_write_file_internal (Itdb_iTunesDB *itdb,
+					  const gchar *filename,
+					  GError **error)
+{
+    FExport *fexp;
+    WContents *cts;
+    gulong size;
+    gboolean fused_checksum;
+    gboolean result = TRUE;
+
+    g_return_val_if_fail (itdb, FALSE);
+    g_return_val_if_fail (itdb->device, FALSE);
+    g_return_val_if_fail (filename || itdb->filename, FALSE);
+
+    if (!filename) filename = itdb->filename;
+
+    if (!itdb_materialize_tracks (itdb, error))
+	return FALSE;
+
+    /* set endianess flag */
+    if (!itdb->device->byte_order)
+	itdb_device_autodetect_endianess (itdb->device);
+
+    fexp = g_new0 (FExport, 1);
+    fexp->itdb = itdb;
+    fexp->wcontents = wcontents_new (filename);
+    cts = fexp->wcontents;
+
+    cts->reversed = (itdb->device->byte_order == G_BIG_ENDIAN);
+
+    prepare_itdb_for_write (fexp);
+
+#if HAVE_GDKPIXBUF
+    /* only write ArtworkDB if we deal with an iPod
+       FIXME: figure out a way to store the artwork data when storing
+       to local directories. At the moment it's the application's task
+       to handle this. */
+    /* The ArtworkDB must be written after the call to
+     * prepare_itdb_for_write since it needs Itdb_Track::id to be set
+     * to its final value to write properly on nano video/ipod classics
+     */
+    if (itdb_device_supports_artwork (itdb->device)) {
+        ipod_write_artwork_db (itdb);
+    }
+#endif
+
+    /* Checksum the iTunesDB as it is written rather than in another
+       pass afterwards. A compressed iTunesCDB is checksummed after
+       compression, which can't be fused. */
+    fused_checksum =
+	!itdb_device_supports_compressed_itunesdb (itdb->device) &&
+	(itdb_device_get_checksum_type (itdb->device) != ITDB_CHECKSUM_NONE);
+    if (fused_checksum)
+    {   /* let the sizing pass record the back-patches */
+	cts->patches = g_array_new (FALSE, FALSE, sizeof (WContentsPatch));
+    }
+
+    /* size the iTunesDB first so that its buffer is allocated only
+       once */
+    size = measure_mhbd (fexp);
+    if (fexp->error)
+	goto err;
+    if (fused_checksum)
+    {
+	wcontents_sort_patches (cts);
+	cts->checksum = itdb_device_checksum_new (itdb->device,
+						  &fexp->error);
+	if (!cts->checksum)
+	    goto err;
+    }
+    if (size >= WCONTENTS_STREAMING_MIN)
+    {   /* keep memory use flat for large libraries */
+	if (!wcontents_stream_open (cts, &fexp->error))
+	    goto err;
+    }
+    else
+    {
+	cts->total = size;
+	cts->contents = g_malloc (cts->total);
+    }
+
+    if (!write_mhbd (fexp))
+	goto err;
+
+    if (fused_checksum && !wcontents_checksum_finish (cts, &fexp->error))
+	goto err;
+
+    if (cts->streaming)
+    {
+	wcontents_flush (cts);
+	if (cts->error)
+	{
+	    g_propagate_error (&fexp->error, cts->error);
+	    cts->error = NULL;
+	    goto err;
+	}
+	/* the buffer is not needed any more */
+	g_free (cts->contents);
+	cts->contents = NULL;
+	cts->total = 0;
+
+	if (itdb_device_supports_compressed_itunesdb (itdb->device)) {
+	    if (!wcontents_stream_compress (cts, itdb->priv->compression_level,
+					    &fexp->error)) {
+		goto err;
+	    }
+	}
+
+	if (!fused_checksum &&
+	    !wcontents_stream_checksum (cts, itdb->device, &fexp->error)) {
 	    goto err;
 	}
     }
+    else
+    {
+	if (itdb_device_supports_compressed_itunesdb (itdb->device)) {
+	    if (!itdb_zlib_check_compress_fexp (fexp)) {
+		goto err;
+	    }
+	}
 
-    /* Set checksum (ipods require it starting from Classic and Nano Video) */
-    itdb_device_write_checksum (itdb->device,
-				(unsigned char *)fexp->wcontents->contents,
-				fexp->wcontents->pos,
-				&fexp->error);
-    if (fexp->error) {
+	/* Set checksum (ipods require it starting from Classic and Nano Video) */
+	if (!fused_checksum) {
+	    itdb_device_write_checksum (itdb->device,
+					(unsigned char *)fexp->wcontents->contents,
+					fexp->wcontents->pos,
+					&fexp->error);
+	}
+	if (fexp->error) {
 	    goto err;
+	}
     }
 
     if (itdb_device_supports_sqlite_db (itdb->device)) {
@@ -6143,14 +7919,7 @@ err:
 	g_propagate_error (error, fexp->error);
 	result = FALSE;
     }
-    wcontents_free (cts);
-    if (fexp->albums != NULL) {
-	g_hash_table_destroy (fexp->albums);
-    }
-    if (fexp->artists != NULL) {
-	g_hash_table_destroy (fexp->artists);
-    }
-    g_free (fexp);
+    fexport_free (fexp);
     if (result == TRUE)
     {
 	gchar *fn = g_strdup (filename);
@@ -6160,11 +7929,83 @@ err:
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    itdb_fsync ();
+    itdb_fsync (itdb, filename);
 
     return result;
 }
 
+/**
+ * itdb_predict_size:
+ * @itdb:   an #Itdb_iTunesDB
+ * @error:  return location for a #GError or NULL
+ *
+ * Determines how many bytes the iTunesDB for @itdb will take without
+ * writing anything. On devices using a compressed iTunesCDB this is
+ * the size before compression. Like itdb_write(), this reassigns
+ * unique IDs to all tracks and arranges @itdb->tracks in the order of
+ * the master playlist.
+ *
+ * Returns: the exact size of the iTunesDB or 0 on error, in which
+ * case @error is set accordingly.
+ *
+ * Since: 0.8.2
+ */
+gsize itdb_predict_size (Itdb_iTunesDB *itdb, GError **error)
+{
+    FExport *fexp;
+    gsize size;
+
+    g_return_val_if_fail (itdb, 0);
+    g_return_val_if_fail (itdb->device, 0);
+
+    if (!itdb_materialize_tracks (itdb, error))
+	return 0;
+
+    /* set endianess flag */
+    if (!itdb->device->byte_order)
+	itdb_device_autodetect_endianess (itdb->device);
+
+    fexp = g_new0 (FExport, 1);
+    fexp->itdb = itdb;
+    fexp->wcontents = wcontents_new ("");
+    fexp->wcontents->reversed = (itdb->device->byte_order == G_BIG_ENDIAN);
+
+    prepare_itdb_for_write (fexp);
+
+    size = measure_mhbd (fexp);
+    if (fexp->error)
+    {
+	g_propagate_error (error, fexp->error);
+	size = 0;
+    }
+    fexport_free (fexp);
+
+    return size;
+}
+
+/**
+ * itdb_set_compression_level:
+ * @itdb:  an #Itdb_iTunesDB
+ * @level: zlib compression level from 0 (none) to 9 (best), or -1 for
+ *         the zlib default
+ *
+ * Sets how hard itdb_write() compresses the iTunesCDB on devices
+ * using a compressed database (e.g. Nano 5G, iPhone). The default is
+ * 1, the fastest level. When the application has initialized GLib
+ * threads, large databases are compressed in independent blocks on
+ * all CPUs, which makes higher levels affordable at a slightly lower
+ * compression ratio.
+ *
+ * Since: 0.8.2
+ */
+void itdb_set_compression_level (Itdb_iTunesDB *itdb, gint level)
+{
+    g_return_if_fail (itdb);
+    g_return_if_fail ((level >= -1) && (level <= 9));
+
+    itdb->priv->compression_level = level;
+}
+
 /**
  * itdb_write_file:
  * @itdb:       the #Itdb_iTunesDB to save
@@ -6237,7 +8078,8 @@ gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error)
 	 * empty iTunesDB
 	 */
 	itunes_filename = g_build_filename (itunes_path, "iTunesDB", NULL);
-	g_file_set_contents(itunes_filename, NULL, 0, NULL);
+	if (g_file_set_contents(itunes_filename, NULL, 0, NULL))
+	    itdb_fsync_written_file (itunes_filename);
 	g_free (itunes_filename);
     }
 
@@ -6255,7 +8097,7 @@ gboolean itdb_write (Itdb_iTunesDB *itdb, GError **error)
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    itdb_fsync ();
+    itdb_fsync (itdb, NULL);
 
     itdb_stop_sync (itdb);
 
@@ -6494,7 +8336,7 @@ gboolean itdb_shuffle_write (Itdb_iTunesDB *itdb, GError **error)
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    itdb_fsync ();
+    itdb_fsync (itdb, NULL);
 
     return result;
 }
@@ -6885,6 +8727,9 @@ gboolean itdb_shuffle_write_file (Itdb_iTunesDB *itdb,
     g_return_val_if_fail (filename, FALSE);
     g_return_val_if_fail (itdb->device, FALSE);
 
+    if (!itdb_materialize_tracks (itdb, error))
+	return FALSE;
+
     /* Set endianess flag just in case */
     if (!itdb->device->byte_order)
 	    itdb_device_autodetect_endianess (itdb->device);
@@ -6996,7 +8841,7 @@ serr:
 
     /* make sure all buffers are flushed as some people tend to
        disconnect as soon as gtkpod returns */
-    itdb_fsync ();
+    itdb_fsync (itdb, filename);
 
     return result;
 }
@@ -7116,6 +8961,10 @@ gboolean itdb_rename_files (const gchar *mp, GError **error)
 	}
     }
 
+    /* all of the above changed @itunesdir */
+    if (plcname_o || otgname || shuname || istname)
+	itdb_fsync_written_file (plcname_n);
+
     g_free (plcname_o);
     g_free (plcname_n);
     g_free (otgname);
@@ -7429,6 +9278,7 @@ Itdb_Track *itdb_cp_finalize (Itdb_Track *track,
 			      GError **error)
 {
     const gchar *suffix;
+    gchar *ipod_path;
     Itdb_Track *use_track;
     gint i, mplen;
     struct stat statbuf;
@@ -7505,19 +9355,21 @@ Itdb_Track *itdb_cp_finalize (Itdb_Track *track,
 
     /* now extract filepath for use_track->ipod_path from ipod_fullfile */
     /* ipod_path must begin with a '/' */
-    g_free (use_track->ipod_path);
     mplen = strlen (mountpoint); /* length of mountpoint in bytes */
     if (dest_filename[mplen] == G_DIR_SEPARATOR)
     {
-	use_track->ipod_path = g_strdup (&dest_filename[mplen]);
+	ipod_path = g_strdup (&dest_filename[mplen]);
     }
     else
     {
-	use_track->ipod_path = g_strdup_printf ("%c%s", G_DIR_SEPARATOR,
-						&dest_filename[mplen]);
+	ipod_path = g_strdup_printf ("%c%s", G_DIR_SEPARATOR,
+				     &dest_filename[mplen]);
     }
     /* convert to iPod type */
-    itdb_filename_fs2ipod (use_track->ipod_path);
+    itdb_filename_fs2ipod (ipod_path);
+    itdb_track_set_string (use_track, &use_track->ipod_path, ipod_path);
+    /* size, filetype_marker and transferred have changed as well */
+    itdb_track_changed (use_track);
 
     return use_track;
 }
@@ -7745,6 +9597,8 @@ gboolean itdb_cp (const gchar *from_file, const gchar *to_file,
 		     to_file, g_strerror (errno));
 	goto err_out;
     }
+    /* tracks are usually copied to the iPod */
+    itdb_fsync_written_file (to_file);
     g_free (data);
     return TRUE;
 
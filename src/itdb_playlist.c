@@ -373,6 +373,8 @@ gboolean itdb_splr_eval (Itdb_SPLRule *splr, Itdb_Track *track)
     g_return_val_if_fail (track, FALSE);
     g_return_val_if_fail (track->itdb, FALSE);
 
+    itdb_track_materialize (track, NULL);
+
     ft = itdb_splr_get_field_type (splr);
     at = itdb_splr_get_action_type (splr);
 
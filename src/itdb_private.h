@@ -73,6 +73,9 @@ typedef struct FContents_
 {
     gchar *filename;
     gchar *contents;
+    /* set if @contents points into a read-only mapping of the file
+       rather than into a heap buffer */
+    GMappedFile *mapped_file;
     /* indicate that endian order is reversed as in the case of the
        iTunesDBs for mobile phones */
     gboolean reversed;
@@ -92,7 +95,12 @@ typedef struct
     GList *tracks;       /* temporary list to store tracks */
     GList *playcounts;   /* contents of Play Counts file */
     GHashTable *pcounts2;/* contents of the PlayCounts.plist file */
-    GTree *idtree;       /* temporary tree with track id tree */
+    ItdbParseFlags flags;/* flags passed to itdb_parse_with_flags() */
+    /* set by itdb_parse_file_with_callbacks(): tracks and playlists
+       are passed to the callbacks instead of being added to itdb */
+    const ItdbParseCallbacks *callbacks;
+    gpointer user_data;
+    gboolean stopped;    /* a callback requested to stop parsing */
     GError *error;       /* where to report errors to */
 } FImport;
 
@@ -125,13 +133,50 @@ typedef struct
     gboolean reversed;
     gulong pos;          /* current write position ("end of file") */
     gulong total;        /* current total size of *contents array  */
+    /* only advance pos without storing anything, used to determine
+       the size of the iTunesDB before writing it */
+    gboolean sizing;
+    /* streaming mode: everything before @flushed has been written to
+       the temporary file @tmpname, @contents only holds the bytes
+       from @flushed up to @pos */
+    gboolean streaming;
+    gint fd;
+    gchar *tmpname;
+    gulong flushed;
+    /* fused checksumming: everything before @hashed has been fed to
+       @checksum. The back-patches of the final pass are not done yet
+       at that point, so the sizing pass records them in @patches
+       (WContentsPatch sorted by seek), @next_patch being the first
+       one not entirely hashed yet. */
+    Itdb_ChecksumState *checksum;
+    gulong hashed;
+    GArray *patches;
+    guint next_patch;
     GError *error;       /* place to report errors to */
 } WContents;
 
+/* a back-patch of at most 8 bytes recorded by the sizing pass */
+typedef struct
+{
+    gulong seek;
+    guint len;
+    guint index;         /* order in which the patches were made */
+    guchar data[8];
+} WContentsPatch;
+
+/* amount of data the fused checksum lags behind at most while the
+ * iTunesDB is assembled in memory */
+#define WCONTENTS_HASH_STEP 65536
+
 /* size of memory by which the total size of above WContents gets
- * increased (1.5 MB) */
+ * increased (1.5 MB) if it was not allocated with the right size
+ * beforehand. Also the size of the buffer in streaming mode. */
 #define WCONTENTS_STEPSIZE 1572864
 
+/* iTunesDBs of at least this size are streamed to disk instead of
+ * being assembled in memory (16 MB) */
+#define WCONTENTS_STREAMING_MIN 16777216
+
 /* struct used to hold all necessary information when exporting a
  * Itdb_iTunesDB */
 typedef struct
@@ -142,6 +187,9 @@ typedef struct
     GHashTable *albums;    /* used to build the MHLA    */
     GHashTable *artists;   /* used to build the MHLI    */
     GHashTable *composers;
+    /* collate keys of the MPL members, shared by all MHOD 52 lists
+       written during one export */
+    GPtrArray *mpl_coltracks;
     GError *error;         /* where to report errors to */
 } FExport;
 
@@ -183,6 +231,9 @@ enum _Itdb_Playlist_Mhsd5_Type {
 };
 typedef enum _Itdb_Playlist_Mhsd5_Type Itdb_Playlist_Mhsd5_Type;
 
+/* memory arena used with ITDB_PARSE_FLAGS_ARENA (see itdb_track.c) */
+typedef struct _Itdb_Arena Itdb_Arena;
+
 struct _Itdb_iTunesDB_Private
 {
     GList *mhsd5_playlists;
@@ -199,13 +250,63 @@ struct _Itdb_iTunesDB_Private
     gint16 unk_0xa6;
     gint16 unk_0xa8;
     gchar *genius_cuid;
+    /* contents of the iTunesDB kept around until all tracks parsed
+       with ITDB_PARSE_FLAGS_LAZY_TRACKS have been materialized */
+    FContents *lazy_contents;
+    /* strings shared between tracks (ITDB_PARSE_FLAGS_INTERN_STRINGS),
+       maps each string to its reference count */
+    GHashTable *string_pool;
+    /* arena the tracks are allocated from (ITDB_PARSE_FLAGS_ARENA) */
+    Itdb_Arena *arena;
+    /* track->id -> track and track->dbid -> track, built on first
+       lookup and then maintained by itdb_track_add/remove/unlink */
+    GHashTable *id_index;
+    GHashTable *dbid_index;
+    /* TRUE if some tracks are missing from the indexes because
+       another track has the same ID. IDs of 0 are not indexed. */
+    gboolean index_duplicates;
+    /* itdb->tracks as an array for itdb_track_nth(), built on first
+       use and dropped whenever itdb->tracks is changed */
+    GPtrArray *track_array;
+    /* see itdb_set_change_tracking(). The cached mhits depend on the
+       byte order, the time zone and id_0x24 they were written with. */
+    gboolean change_tracking;
+    gboolean mhit_cache_reversed;
+    gint mhit_cache_timezone_shift;
+    guint64 mhit_cache_id_0x24;
+    /* zlib level for the iTunesCDB, see itdb_set_compression_level() */
+    gint compression_level;
 };
 
+/* number of strings of a track with a cached collate key (album,
+   title, artist, genre and composer), see mhod52_make_collate_keys() */
+#define ITDB_COLLATE_KEYS 5
+
+/* collate key of one of the strings used to sort the MHOD 52 lists */
+typedef struct
+{
+    gchar *source;     /* string the key was created from, may be NULL */
+    gchar *key;        /* g_utf8_collate_key() of @source */
+    gunichar2 letter;  /* jump table letter of @source */
+} Itdb_CollateKey;
+
 /* private data for Itdb_Track */
 struct _Itdb_Track_Private {
 	guint32 album_id;
 	guint32 artist_id;
 	guint32 composer_id;
+	/* offset of the track's mhit in itdb->priv->lazy_contents, 0
+	   once all mhods have been decoded */
+	glong mhit_seek;
+	/* arena the track, its private data and (some of) its strings
+	   were allocated from. Holds a reference on the arena. */
+	Itdb_Arena *arena;
+	/* the mhit with its mhods as written last time, only kept with
+	   change tracking and dropped by itdb_track_changed() */
+	GByteArray *mhit_cache;
+	/* ITDB_COLLATE_KEYS collate keys as of the last write, NULL
+	   before the first write */
+	Itdb_CollateKey *collate_keys;
 };
 
 struct _Itdb_Playlist_Private {
@@ -229,13 +330,34 @@ G_GNUC_INTERNAL time_t device_time_mac_to_time_t (Itdb_Device *device,
 G_GNUC_INTERNAL guint64 device_time_time_t_to_mac (Itdb_Device *device,
 						 time_t timet);
 G_GNUC_INTERNAL gint itdb_musicdirs_number_by_mountpoint (const gchar *mountpoint);
+G_GNUC_INTERNAL guint itdb_thread_count (void);
+G_GNUC_INTERNAL void itdb_set_thread_count (guint n);
+G_GNUC_INTERNAL void itdb_fsync_file (const gchar *filename);
+G_GNUC_INTERNAL void itdb_fsync_written_file (const gchar *filename);
+G_GNUC_INTERNAL int itdb_sqlite_update_file (const gchar *from_dir,
+					     const gchar *to_dir,
+					     const gchar *fname);
+G_GNUC_INTERNAL gboolean itdb_sqlite_cbk_calc_sha1s (const gchar *filename,
+						  GArray *cbk,
+						  guint cbk_header_size);
+G_GNUC_INTERNAL void itdb_track_intern_strings (Itdb_Track *track);
+G_GNUC_INTERNAL void itdb_track_set_string (Itdb_Track *track, gchar **field,
+					     gchar *value);
+G_GNUC_INTERNAL void itdb_track_index_invalidate (Itdb_iTunesDB *itdb);
+G_GNUC_INTERNAL void itdb_track_drop_mhit_cache (Itdb_Track *track);
+G_GNUC_INTERNAL void itdb_track_drop_collate_keys (Itdb_Track *track);
+G_GNUC_INTERNAL Itdb_Arena *itdb_arena_new (void);
+G_GNUC_INTERNAL void itdb_arena_unref (Itdb_Arena *arena);
+G_GNUC_INTERNAL gchar *itdb_arena_strdup (Itdb_Arena *arena,
+					  const gchar *str);
+G_GNUC_INTERNAL Itdb_Track *itdb_track_new_from_arena (Itdb_Arena *arena);
 G_GNUC_INTERNAL int itdb_sqlite_generate_itdbs(FExport *fexp);
 G_GNUC_INTERNAL gboolean itdb_hashAB_write_hash (const Itdb_Device *device,
 						 unsigned char *itdb_data,
 						 gsize itdb_len,
 						 GError **error);
 G_GNUC_INTERNAL gboolean itdb_hash72_extract_hash_info(const Itdb_Device *device,
-						       unsigned char *itdb_data,
+						       const unsigned char *itdb_data,
 						       gsize itdb_len);
 G_GNUC_INTERNAL gboolean itdb_hash72_write_hash (const Itdb_Device *device,
 						 unsigned char *itdb_data,
@@ -245,6 +367,8 @@ G_GNUC_INTERNAL gboolean itdb_hash58_write_hash (Itdb_Device *device,
 						 unsigned char *itdb_data,
 						 gsize itdb_len,
 						 GError **error);
+G_GNUC_INTERNAL unsigned char *itdb_hash58_get_key (Itdb_Device *device,
+						    GError **error);
 G_GNUC_INTERNAL gboolean itdb_hashAB_compute_hash_for_sha1 (const Itdb_Device *device,
 							    const guchar sha1[20],
 							    guchar signature[57],
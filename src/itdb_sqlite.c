@@ -43,6 +43,9 @@
 #include "itdb_private.h"
 #include "itdb_sqlite_queries.h"
 
+/* minimum number of tracks for build_itdb_files() to build the
+   databases with several threads */
+#define BUILD_ITDB_FILES_THREADED_MIN 1000
 
 /** time zone offset in seconds */
 static uint32_t tzoffset = 0;
@@ -180,6 +183,46 @@ static void destroy_key_orders(GHashTable **orders)
     g_free(orders);
 }
 
+/* Opens the database @dbf for building it from scratch with one of
+ * the mk_* functions. The databases are built in a temporary directory
+ * and copied to the iPod in one go once finished, so there is nothing
+ * to protect against a crash: no journal, no syncing and no locking
+ * between statements. The page size is left at the sqlite default,
+ * which is what the iPod reads. A pragma that fails only makes the
+ * build slower, so it is logged and otherwise ignored. */
+static int open_itdb_for_build(const char *dbf, sqlite3 **db)
+{
+    static const char *pragmas[] = {
+	"PRAGMA synchronous = OFF;",
+	"PRAGMA journal_mode = OFF;",
+	"PRAGMA locking_mode = EXCLUSIVE;",
+	"PRAGMA temp_store = MEMORY;",
+	/* in KiB: large enough to keep the whole database in the cache
+	 * until it is written */
+	"PRAGMA cache_size = -65536;"
+    };
+    char *errmsg = NULL;
+    guint i;
+
+    if (SQLITE_OK != sqlite3_open(dbf, db)) {
+	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(*db));
+	return -1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(pragmas); i++) {
+	if (SQLITE_OK != sqlite3_exec(*db, pragmas[i], NULL, NULL, &errmsg)) {
+	    fprintf(stderr, "[%s] '%s' failed on '%s': %s\n", __func__,
+		    pragmas[i], dbf, errmsg ? errmsg : sqlite3_errmsg(*db));
+	    if (errmsg) {
+		sqlite3_free(errmsg);
+		errmsg = NULL;
+	    }
+	}
+    }
+
+    return 0;
+}
+
 static int mk_Dynamic(Itdb_iTunesDB *itdb, const char *outpath)
 {
     int res = -1;
@@ -208,13 +251,10 @@ static int mk_Dynamic(Itdb_iTunesDB *itdb, const char *outpath)
 	}
     }
 
-    if (SQLITE_OK != sqlite3_open((const char*)dbf, &db)) {
-	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(db));
+    if (open_itdb_for_build(dbf, &db) != 0) {
 	goto leave;
     }
 
-    sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
-
     fprintf(stderr, "[%s] creating table structure\n", __func__);
     /* db structure needs to be created. */
     if (SQLITE_OK != sqlite3_exec(db, Dynamic_create, NULL, NULL, &errmsg)) {
@@ -378,13 +418,10 @@ static int mk_Extras(Itdb_iTunesDB *itdb, const char *outpath)
 	}
     }
 
-    if (SQLITE_OK != sqlite3_open((const char*)dbf, &db)) {
-	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(db));
+    if (open_itdb_for_build(dbf, &db) != 0) {
 	goto leave;
     }
 
-    sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
-
     if (rebuild) {
 	fprintf(stderr, "[%s] re-building table structure\n", __func__);
 	/* db structure needs to be created. */
@@ -490,13 +527,10 @@ static int mk_Genius(Itdb_iTunesDB *itdb, const char *outpath)
 	}
     }
 
-    if (SQLITE_OK != sqlite3_open((const char*)dbf, &db)) {
-	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(db));
+    if (open_itdb_for_build(dbf, &db) != 0) {
 	goto leave;
     }
 
-    sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
-
     if (rebuild) {
 	fprintf(stderr, "[%s] re-building table structure\n", __func__);
 	/* db structure needs to be created. */
@@ -634,13 +668,10 @@ static int mk_Library(Itdb_iTunesDB *itdb,
 	}
     }
 
-    if (SQLITE_OK != sqlite3_open((const char*)dbf, &db)) {
-	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(db));
+    if (open_itdb_for_build(dbf, &db) != 0) {
 	goto leave;
     }
 
-    sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
-
     fprintf(stderr, "[%s] building table structure\n", __func__);
     /* db structure needs to be created. */
     if (SQLITE_OK != sqlite3_exec(db, Library_create, NULL, NULL, &errmsg)) {
@@ -1318,7 +1349,19 @@ static int mk_Library(Itdb_iTunesDB *itdb,
 	}
     }
 
-    sqlite3_exec(db, "UPDATE album SET artwork_item_pid = (SELECT item.pid FROM item WHERE item.artwork_cache_id != 0 AND item.album_pid = album.pid LIMIT 1);", NULL, NULL, NULL);
+    sqlite3_exec(db, Library_album_artwork, NULL, NULL, NULL);
+
+    /* the triggers would have updated every item right after
+     * inserting it, set their flags for all items at once instead */
+    if (SQLITE_OK != sqlite3_exec(db, Library_create_triggers, NULL, NULL, &errmsg)) {
+	fprintf(stderr, "[%s] sqlite3_exec error: %s\n", __func__, sqlite3_errmsg(db));
+	if (errmsg) {
+	    fprintf(stderr, "[%s] additional error information: %s\n", __func__, errmsg);
+	    sqlite3_free(errmsg);
+	    errmsg = NULL;
+	}
+	goto leave;
+    }
 
     sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
 
@@ -1393,13 +1436,10 @@ static int mk_Locations(Itdb_iTunesDB *itdb, const char *outpath, const char *uu
 	}
     }
 
-    if (SQLITE_OK != sqlite3_open((const char*)dbf, &db)) {
-	fprintf(stderr, "Error opening database '%s': %s\n", dbf, sqlite3_errmsg(db));
+    if (open_itdb_for_build(dbf, &db) != 0) {
 	goto leave;
     }
 
-    sqlite3_exec(db, "PRAGMA synchronous = OFF;", NULL, NULL, NULL);
-
     fprintf(stderr, "[%s] re-building table structure\n", __func__);
     /* db structure needs to be created. */
     if (SQLITE_OK != sqlite3_exec(db, Locations_create, NULL, NULL, &errmsg)) {
@@ -1581,14 +1621,14 @@ static void sort_key_get_buffer_boundaries(const char* sval, int *length, int *w
 	int i = 0;
 	int l = 0;
 	int o = 0;
-	char *sval_uppercase = NULL;
-	if (sval && strlen(sval)) {
-		sval_uppercase = g_ascii_strup(sval, strlen(sval));
-		while (sval_uppercase[i]) {
-			if (g_ascii_isalnum(sval_uppercase[i])) {
+	if (sval && sval[0]) {
+		/* uppercasing changes neither what is alphanumeric nor
+		 * the other characters, so the string is scanned as is */
+		while (sval[i]) {
+			if (g_ascii_isalnum(sval[i])) {
 				l++;
 			} else {
-				switch (sval_uppercase[i]) {
+				switch (sval[i]) {
 					case ' ':
 						word_count++;
 						l++;
@@ -1605,7 +1645,6 @@ static void sort_key_get_buffer_boundaries(const char* sval, int *length, int *w
 			}
 			i++;
 		}
-		free(sval_uppercase);
 
 		word_count++;
 		/* magic + transformed string + length + word weights + null */
@@ -1619,11 +1658,11 @@ static void sort_key_get_buffer_boundaries(const char* sval, int *length, int *w
 	*word_offset = o;
 }
 
-static void sqlite_func_iphone_sort_key(sqlite3_context *context, int argc, sqlite3_value **argv)
+/* Builds the sort key of the text @sval as returned by the
+ * iPhoneSortKey() sqlite function */
+static GByteArray *iphone_sort_key_new(const char *sval)
 {
-	const char *sval;
-	char *sval_uppercase = NULL;
-
+	GByteArray *key;
 	char *buffer = NULL;
 
 	int word_count = 0;
@@ -1633,93 +1672,122 @@ static void sqlite_func_iphone_sort_key(sqlite3_context *context, int argc, sqli
 	int buffer_index = 0;
 	int buffer_size = 0;
 
+	sort_key_get_buffer_boundaries(sval, &buffer_size, &word_offset);
+	key = g_byte_array_sized_new(buffer_size);
+	g_byte_array_set_size(key, buffer_size);
+	buffer = (char*)key->data;
+	memset(buffer, '\0', buffer_size);
+	buffer[buffer_index] = 0x31;
+	if (sval) {
+		if (buffer_size > 4) {
+			buffer[buffer_index++] = 0x30;
+			/* transform text value */
+			while (sval[i]) {
+				/* uppercase the text */
+				char c = g_ascii_toupper(sval[i]);
+				word_length++;
+				if (g_ascii_isalnum(c)) {
+					/* transform regular character */
+					buffer[buffer_index++] = c - (0x55 - c);
+				} else {
+					/* transform special chars (punctuation,special) */
+					switch (c) {
+						case ' ':
+							buffer[buffer_index++] = 0x06;
+							word_length--;
+
+							/* since we reached word end, calculate word weight */
+							buffer[word_offset + word_count*2] = 0x8f;
+							buffer[word_offset + word_count*2 + 1] = (char)(0x86 - word_length);
+							word_count++;
+							word_length = 0;
+							break;
+						case ':':
+							buffer[buffer_index++] = 0x07;
+							buffer[buffer_index++] = 0xd8;
+							break;
+						case '-':
+							buffer[buffer_index++] = 0x07;
+							buffer[buffer_index++] = 0x90;
+							break;
+						case ',':
+							buffer[buffer_index++] = 0x07;
+							buffer[buffer_index++] = 0xb2;
+							break;
+						case '.':
+							buffer[buffer_index++] = 0x08;
+							buffer[buffer_index++] = 0x51;
+							break;
+						case '\'':
+							buffer[buffer_index++] = 0x07;
+							buffer[buffer_index++] = 0x31;
+							break;
+						default:
+							/* FIXME: We just simulate "-" for any other char, needs proper conversion */
+							buffer[buffer_index++] = 0x07;
+							buffer[buffer_index++] = 0x90;
+							break;
+					}
+				}
+				i++;
+			}
+
+			/* calculate word weight for last word */
+			buffer[word_offset + word_count*2] = 0x8f;
+			buffer[word_offset + word_count*2 + 1] = 3 + word_length;
+			word_count++;
+			word_length = 0;
+
+			/* write length of input string */
+			buffer[word_offset - 3] = 0x01;
+			buffer[word_offset - 2] = i + 4; /* length of input string + 4 */
+			buffer[word_offset - 1] = 0x01;
+		} else {
+			buffer[0] = 0x31;
+			buffer[1] = 0x01;
+			buffer[2] = 0x01;
+		}
+	}
+	return key;
+}
+
+static void free_sort_key(gpointer data)
+{
+	g_byte_array_free(data, TRUE);
+}
+
+/* iPhoneSortKey(): the post process commands call it for every row
+ * and for each of title, album, artist, ... so the same strings come
+ * up again and again. The keys are cached in the GHashTable given as
+ * user data of the function, which must outlive the statements. */
+static void sqlite_func_iphone_sort_key(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+	GHashTable *cache = sqlite3_user_data(context);
+	const char *sval;
+	GByteArray *key;
+
 	if (argc != 1)
 		fprintf(stderr, "[%s] Error: Unexpected number of arguments: %d\n", __func__, argc);
 
 	switch (sqlite3_value_type(argv[0])) {
 		case SQLITE_TEXT:
 			sval = (const char*)sqlite3_value_text(argv[0]);
-			sort_key_get_buffer_boundaries(sval, &buffer_size, &word_offset);
-			buffer = (char*)malloc(buffer_size);
-			memset(buffer, '\0', buffer_size);
-			buffer[buffer_index] = 0x31;
-			if (sval) {
-				if (buffer_size > 4) {
-					buffer[buffer_index++] = 0x30;
-					/* transform text value */
-					/* uppercase the text */
-					sval_uppercase = g_ascii_strup(sval, strlen(sval));
-					while (sval_uppercase[i]) {
-						word_length++;
-						if (g_ascii_isalnum(sval_uppercase[i])) {
-							/* transform regular character */
-							buffer[buffer_index++] = sval_uppercase[i] - (0x55 - sval_uppercase[i]);
-						} else {
-							/* transform special chars (punctuation,special) */
-							switch (sval_uppercase[i]) {
-								case ' ':
-									buffer[buffer_index++] = 0x06;
-									word_length--;
-
-									/* since we reached word end, calculate word weight */
-									buffer[word_offset + word_count*2] = 0x8f;
-									buffer[word_offset + word_count*2 + 1] = (char)(0x86 - word_length);
-									word_count++;
-									word_length = 0;
-									break;
-								case ':':
-									buffer[buffer_index++] = 0x07;
-									buffer[buffer_index++] = 0xd8;
-									break;
-								case '-':
-									buffer[buffer_index++] = 0x07;
-									buffer[buffer_index++] = 0x90;
-									break;
-								case ',':
-									buffer[buffer_index++] = 0x07;
-									buffer[buffer_index++] = 0xb2;
-									break;
-								case '.':
-									buffer[buffer_index++] = 0x08;
-									buffer[buffer_index++] = 0x51;
-									break;
-								case '\'':
-									buffer[buffer_index++] = 0x07;
-									buffer[buffer_index++] = 0x31;
-									break;
-								default:
-									/* FIXME: We just simulate "-" for any other char, needs proper conversion */
-									buffer[buffer_index++] = 0x07;
-									buffer[buffer_index++] = 0x90;
-									break;
-							}
-						}
-						i++;
-					}
-					g_free(sval_uppercase);
-
-					/* calculate word weight for last word */
-					buffer[word_offset + word_count*2] = 0x8f;
-					buffer[word_offset + word_count*2 + 1] = 3 + word_length;
-					word_count++;
-					word_length = 0;
-
-					/* write length of input string */
-					buffer[word_offset - 3] = 0x01;
-					buffer[word_offset - 2] = i + 4; /* length of input string + 4 */
-					buffer[word_offset - 1] = 0x01;
-				} else {
-					buffer[0] = 0x31;
-					buffer[1] = 0x01;
-					buffer[2] = 0x01;
-				}
+			key = (cache && sval) ? g_hash_table_lookup(cache, sval) : NULL;
+			if (key) {
+				sqlite3_result_blob(context, key->data, key->len, SQLITE_STATIC);
+				break;
+			}
+			key = iphone_sort_key_new(sval);
+			if (cache && sval) {
+				g_hash_table_insert(cache, g_strdup(sval), key);
+				sqlite3_result_blob(context, key->data, key->len, SQLITE_STATIC);
+			} else {
+				sqlite3_result_blob(context, key->data, key->len, SQLITE_TRANSIENT);
+				free_sort_key(key);
 			}
-			sqlite3_result_blob(context, buffer, buffer_size, free);
 			break;
 		case SQLITE_NULL:
-			buffer = (char*)malloc(4);
-			memcpy(buffer, "\x31\x01\x01\x00", 4);
-			sqlite3_result_blob(context, buffer, 4, free);
+			sqlite3_result_blob(context, "\x31\x01\x01\x00", 4, SQLITE_STATIC);
 			break;
 		default:
 			sqlite3_result_null(context);
@@ -1757,6 +1825,7 @@ static void run_post_process_commands(Itdb_iTunesDB *itdb, const char *outpath,
     const gchar *otherdbs[] = {"Dynamic.itdb", "Extras.itdb", "Genius.itdb", "Locations.itdb", NULL};
     int res;
     sqlite3 *db = NULL;
+    GHashTable *sort_keys = NULL;
 
 #ifdef HAVE_LIBIMOBILEDEVICE
     if (itdb_device_is_iphone_family(itdb->device)) {
@@ -1921,7 +1990,9 @@ static void run_post_process_commands(Itdb_iTunesDB *itdb, const char *outpath,
 			}
 
 			printf("[%s] binding functions\n", __func__);
-			sqlite3_create_function(db, "iPhoneSortKey", 1, SQLITE_ANY, NULL, &sqlite_func_iphone_sort_key, NULL, NULL);
+			sort_keys = g_hash_table_new_full(g_str_hash, g_str_equal,
+							  g_free, free_sort_key);
+			sqlite3_create_function(db, "iPhoneSortKey", 1, SQLITE_ANY, sort_keys, &sqlite_func_iphone_sort_key, NULL, NULL);
 			sqlite3_create_function(db, "iPhoneSortSection", 1, SQLITE_ANY, NULL, &sqlite_func_iphone_sort_section, NULL, NULL);
 
 			cnt = plist_array_get_size(user_ver_cmds);
@@ -1977,91 +2048,19 @@ leave:
     if (db) {
 	sqlite3_close(db);
     }
+    if (sort_keys) {
+	g_hash_table_destroy(sort_keys);
+    }
     if (plist_node) {
 	plist_free(plist_node);
     }
 
 }
 
-static int cbk_calc_sha1_one_block(FILE *f, unsigned char sha1[20])
-{
-    const guint BLOCK_SIZE = 1024;
-    unsigned char block[BLOCK_SIZE];
-    size_t read_count;
-    GChecksum *checksum;
-    gsize sha1_len;
-
-    read_count = fread(block, BLOCK_SIZE, 1, f);
-    if ((read_count != 1)) {
-	if (feof(f)) {
-	    return 1;
-	} else {
-	    return -1;
-	}
-    }
-
-    sha1_len = g_checksum_type_get_length(G_CHECKSUM_SHA1);
-    g_assert (sha1_len == 20);
-    checksum = g_checksum_new(G_CHECKSUM_SHA1);
-    g_checksum_update(checksum, block, BLOCK_SIZE);
-    g_checksum_get_digest(checksum, sha1, &sha1_len);
-    g_checksum_free(checksum);
-
-    return 0;
-}
-
-static gboolean cbk_calc_sha1s(const char *filename, GArray *sha1s)
-{
-    FILE *f;
-    int calc_ok;
-
-    f = fopen(filename, "rb");
-    if (f == NULL) {
-	return FALSE;
-    }
-
-    do {
-	unsigned char sha1[20];
-	calc_ok = cbk_calc_sha1_one_block(f, sha1);
-	if (calc_ok != 0) {
-	    break;
-	}
-	g_array_append_vals(sha1s, sha1, sizeof(sha1));
-    } while (calc_ok == 0);
-
-    if (calc_ok < 0) {
-	goto error;
-    }
-
-    fclose(f);
-    return TRUE;
-
-error:
-    fclose(f);
-    return FALSE;
-}
-
-static void cbk_calc_sha1_of_sha1s(GArray *cbk, guint cbk_header_size)
-{
-    GChecksum *checksum;
-    unsigned char* final_sha1;
-    unsigned char* sha1s;
-    gsize final_sha1_len;
-
-    g_assert (cbk->len > cbk_header_size + 20);
-
-    final_sha1 = &g_array_index(cbk, guchar, cbk_header_size);
-    sha1s = &g_array_index(cbk, guchar, cbk_header_size + 20);
-    final_sha1_len = g_checksum_type_get_length(G_CHECKSUM_SHA1);
-    g_assert (final_sha1_len == 20);
-
-    checksum = g_checksum_new(G_CHECKSUM_SHA1);
-    g_checksum_update(checksum, sha1s, cbk->len - (cbk_header_size + 20));
-    g_checksum_get_digest(checksum, final_sha1, &final_sha1_len);
-    g_checksum_free(checksum);
-}
-
-static gboolean mk_Locations_cbk(Itdb_iTunesDB *itdb, const char *dirname)
+/* Writes the checksums of @dirname/Locations.itdb to
+ * @cbk_dirname/Locations.itdb.cbk */
+static gboolean mk_Locations_cbk(Itdb_iTunesDB *itdb, const char *dirname,
+				 const char *cbk_dirname)
 {
     char *locations_filename;
     char *cbk_filename;
@@ -2097,13 +2096,13 @@ static gboolean mk_Locations_cbk(Itdb_iTunesDB *itdb, const char *dirname)
     g_array_set_size(cbk, cbk_header_size + 20);
 
     locations_filename = g_build_filename(dirname, "Locations.itdb", NULL);
-    success = cbk_calc_sha1s(locations_filename, cbk);
+    success = itdb_sqlite_cbk_calc_sha1s(locations_filename, cbk,
+					 cbk_header_size);
     g_free(locations_filename);
     if (!success) {
 	g_array_free(cbk, TRUE);
 	return FALSE;
     }
-    cbk_calc_sha1_of_sha1s(cbk, cbk_header_size);
     final_sha1 = &g_array_index(cbk, guchar, cbk_header_size);
     cbk_hash = &g_array_index(cbk, guchar, 0);
     switch (checksum_type) {
@@ -2125,48 +2124,128 @@ static gboolean mk_Locations_cbk(Itdb_iTunesDB *itdb, const char *dirname)
 	return FALSE;
     }
 
-    cbk_filename = g_build_filename(dirname, "Locations.itdb.cbk", NULL);
+    cbk_filename = g_build_filename(cbk_dirname, "Locations.itdb.cbk", NULL);
     success = g_file_set_contents(cbk_filename, cbk->data, cbk->len, NULL);
     g_free(cbk_filename);
     g_array_free(cbk, TRUE);
     return success;
 }
 
+/* The sqlite databases built by build_itdb_files(), in the order in
+ * which errors are reported */
+typedef enum {
+    ITDB_FILE_DYNAMIC,
+    ITDB_FILE_EXTRAS,
+    ITDB_FILE_GENIUS,
+    ITDB_FILE_LIBRARY,
+    ITDB_FILE_LOCATIONS,
+    ITDB_FILE_COUNT
+} ItdbFileType;
+
+typedef struct {
+    ItdbFileType type;
+    Itdb_iTunesDB *itdb;
+    GHashTable *album_ids;
+    GHashTable *artist_ids;
+    GHashTable *composer_ids;
+    const char *outpath;
+    const char *uuid;
+    int res;
+} ItdbFileJob;
+
+static const char *itdb_file_names[ITDB_FILE_COUNT] = {
+    "Dynamic.itdb", "Extras.itdb", "Genius.itdb",
+    "Library.itdb", "Locations.itdb"
+};
+
+/* Builds the database of @data (an ItdbFileJob). Each database has its
+ * own file and sqlite connection and only reads the iTunesDB, so they
+ * can be built on several threads at once. */
+static void build_itdb_file(gpointer data, gpointer user_data)
+{
+    ItdbFileJob *job = data;
+
+    switch (job->type) {
+    case ITDB_FILE_DYNAMIC:
+	job->res = mk_Dynamic(job->itdb, job->outpath);
+	break;
+    case ITDB_FILE_EXTRAS:
+	job->res = mk_Extras(job->itdb, job->outpath);
+	break;
+    case ITDB_FILE_GENIUS:
+	job->res = mk_Genius(job->itdb, job->outpath);
+	break;
+    case ITDB_FILE_LIBRARY:
+	job->res = mk_Library(job->itdb, job->album_ids, job->artist_ids,
+			      job->composer_ids, job->outpath);
+	break;
+    case ITDB_FILE_LOCATIONS:
+	job->res = mk_Locations(job->itdb, job->outpath, job->uuid);
+	break;
+    default:
+	g_return_if_reached ();
+    }
+}
+
 static int build_itdb_files(Itdb_iTunesDB *itdb,
 			     GHashTable *album_ids, GHashTable *artist_ids,
 			     GHashTable *composer_ids,
 			     const char *outpath, const char *uuid,
                              GError **error)
 {
-    if (mk_Dynamic(itdb, outpath) != 0) {
-	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
-		     "an error occurred during Dynamic.itdb generation");
-	return -1;
-    }
-    if (mk_Extras(itdb, outpath) != 0) {
-	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
-		     "an error occurred during Extras.itdb generation");
-	return -1;
-    }
-    if (mk_Genius(itdb, outpath) != 0) {
-	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
-		     "an error occurred during Genius.itdb generation");
-	return -1;
+    ItdbFileJob jobs[ITDB_FILE_COUNT];
+    GThreadPool *pool = NULL;
+    guint nr_threads;
+    int i;
+
+    for (i = 0; i < ITDB_FILE_COUNT; i++) {
+	jobs[i].type = i;
+	jobs[i].itdb = itdb;
+	jobs[i].album_ids = album_ids;
+	jobs[i].artist_ids = artist_ids;
+	jobs[i].composer_ids = composer_ids;
+	jobs[i].outpath = outpath;
+	jobs[i].uuid = uuid;
+	jobs[i].res = -1;
+    }
+
+    /* sqlite must have been built thread safe to use several
+     * connections at once. The progress messages of the databases
+     * built at the same time are interleaved line by line, each one
+     * names the function that printed it. */
+    nr_threads = itdb_thread_count();
+    if ((nr_threads > 1) &&
+	(g_list_length(itdb->tracks) >= BUILD_ITDB_FILES_THREADED_MIN) &&
+	sqlite3_threadsafe()) {
+	pool = g_thread_pool_new(build_itdb_file, NULL,
+				 MIN(nr_threads, ITDB_FILE_COUNT),
+				 FALSE, NULL);
+    }
+    for (i = 0; i < ITDB_FILE_COUNT; i++) {
+	if (pool) {
+	    g_thread_pool_push(pool, &jobs[i], NULL);
+	} else {
+	    /* build the databases one after another instead */
+	    build_itdb_file(&jobs[i], NULL);
+	}
     }
-    if (mk_Library(itdb, album_ids, artist_ids, composer_ids, outpath) != 0) {
-	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
-		     "an error occurred during Library.itdb generation");
-	return -1;
+    if (pool) {
+	/* wait for all databases to be built */
+	g_thread_pool_free(pool, FALSE, TRUE);
     }
-    if (mk_Locations(itdb, outpath, uuid) != 0) {
-	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
-		     "an error occurred during Locations.itdb generation");
-	return -1;
+
+    for (i = 0; i < ITDB_FILE_COUNT; i++) {
+	if (jobs[i].res != 0) {
+	    g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
+			 "an error occurred during %s generation",
+			 itdb_file_names[i]);
+	    return -1;
+	}
     }
 
     run_post_process_commands(itdb, outpath, uuid);
 
-    if (!mk_Locations_cbk(itdb, outpath)) {
+    if (!mk_Locations_cbk(itdb, outpath, outpath)) {
 	g_set_error (error, ITDB_ERROR, ITDB_ERROR_SQLITE,
 		     "an error occurred during Locations.itdb.cbk generation");
 	return -1;
@@ -2196,6 +2275,55 @@ static int ensure_itlp_dir_exists(const char *itlpdir, GError **error)
     return TRUE;
 }
 
+#define COMPARE_BLOCK_SIZE 65536
+
+/* Returns TRUE if @name1 and @name2 both exist and have the same
+ * contents */
+static gboolean itdb_files_equal(const gchar *name1, const gchar *name2)
+{
+    struct stat st1, st2;
+    FILE *f1 = NULL;
+    FILE *f2 = NULL;
+    gchar *buf1 = NULL;
+    gchar *buf2 = NULL;
+    gboolean equal = FALSE;
+    size_t n1, n2;
+
+    if ((g_stat(name1, &st1) != 0) || (g_stat(name2, &st2) != 0)) {
+	return FALSE;
+    }
+    if (st1.st_size != st2.st_size) {
+	return FALSE;
+    }
+
+    f1 = fopen(name1, "rb");
+    f2 = fopen(name2, "rb");
+    if (!f1 || !f2) {
+	goto leave;
+    }
+    buf1 = g_malloc(COMPARE_BLOCK_SIZE);
+    buf2 = g_malloc(COMPARE_BLOCK_SIZE);
+    do {
+	n1 = fread(buf1, 1, COMPARE_BLOCK_SIZE, f1);
+	n2 = fread(buf2, 1, COMPARE_BLOCK_SIZE, f2);
+	if ((n1 != n2) || (memcmp(buf1, buf2, n1) != 0)) {
+	    goto leave;
+	}
+    } while (n1 == COMPARE_BLOCK_SIZE);
+    equal = !ferror(f1) && !ferror(f2);
+
+leave:
+    g_free(buf1);
+    g_free(buf2);
+    if (f1) {
+	fclose(f1);
+    }
+    if (f2) {
+	fclose(f2);
+    }
+    return equal;
+}
+
 static int copy_itdb_file(const gchar *from_dir, const gchar *to_dir,
 			  const gchar *fname, GError **error)
 {
@@ -2203,15 +2331,37 @@ static int copy_itdb_file(const gchar *from_dir, const gchar *to_dir,
 
     gchar *srcname = g_build_filename(from_dir, fname, NULL);
     gchar *dstname = g_build_filename(to_dir, fname, NULL);
-
-    if (itdb_cp(srcname, dstname, error)) {
-	fprintf(stderr, "itdbprep: copying '%s'\n", fname);
-	res++;
+    gchar *tmpname = g_strconcat(dstname, ".tmp", NULL);
+
+    if (itdb_files_equal(srcname, dstname)) {
+	/* the databases are built the same way every time, so a file
+	 * already on the iPod with the same contents needs no writing.
+	 * After a small change most of the files are left alone. */
+	fprintf(stderr, "itdbprep: '%s' is unchanged\n", fname);
+    } else if (itdb_cp(srcname, tmpname, error)) {
+	/* copied next to the destination, rename into place so that a
+	 * crash or an early disconnect never leaves a partial database */
+	itdb_fsync_file(tmpname);
+#ifdef WIN32
+	g_unlink(dstname);
+#endif
+	if (g_rename(tmpname, dstname) == 0) {
+	    itdb_fsync_written_file(dstname);
+	    fprintf(stderr, "itdbprep: copying '%s'\n", fname);
+	    res++;
+	} else {
+	    g_set_error (error, G_FILE_ERROR,
+			 g_file_error_from_errno(errno),
+			 "Could not rename '%s' to '%s': %s",
+			 tmpname, dstname, strerror(errno));
+	    g_unlink(tmpname);
+	}
     }
     if (error && *error) {
 	fprintf(stderr, "Error copying '%s' to '%s': %s\n", srcname, dstname, (*error)->message);
     }
 
+    g_free(tmpname);
     if (srcname) {
 	g_free(srcname);
     }
@@ -2300,7 +2450,23 @@ int itdb_sqlite_generate_itdbs(FExport *fexp)
 	GError *error = NULL;
 	g_assert (fexp->error == NULL);
 	for (file = itdb_files; *file != NULL; file++) {
-	    copy_itdb_file(tmpdir, itlpdir, *file, &error);
+	    int updated = -1;
+
+	    if (g_str_has_suffix(*file, ".itdb")) {
+		updated = itdb_sqlite_update_file(tmpdir, itlpdir, *file);
+	    }
+	    if ((updated >= 0) && (strcmp(*file, "Locations.itdb") == 0)) {
+		/* the checksums have to match the file on the iPod, which
+		 * differs from the new one byte for byte once it has been
+		 * updated, even if its rows are the same now */
+		if (!mk_Locations_cbk(fexp->itdb, itlpdir, tmpdir)) {
+		    g_set_error (&error, ITDB_ERROR, ITDB_ERROR_SQLITE,
+				 "an error occurred during Locations.itdb.cbk generation");
+		}
+	    }
+	    if (updated < 0) {
+		copy_itdb_file(tmpdir, itlpdir, *file, &error);
+	    }
 	    if (error) {
 		res = -1;
 		/* only the last error will be reported, but this way we
@@ -19,8 +19,12 @@
 #ifndef __LIBITDBPREP_H
 #define __LIBITDBPREP_H
 
+#include <glib.h>
+
+/* not every file including this header uses all the statements */
+
 /** creation statement for 'Dynamic.itdb' */
-static const char Dynamic_create[] =
+static const char Dynamic_create[] G_GNUC_UNUSED =
 	"BEGIN TRANSACTION;" \
 	"CREATE TABLE item_stats (item_pid INTEGER NOT NULL, has_been_played INTEGER DEFAULT 0, date_played INTEGER DEFAULT 0, play_count_user INTEGER DEFAULT 0, play_count_recent INTEGER DEFAULT 0, date_skipped INTEGER DEFAULT 0, skip_count_user INTEGER DEFAULT 0, skip_count_recent INTEGER DEFAULT 0, bookmark_time_ms REAL, bookmark_time_ms_common REAL, user_rating INTEGER DEFAULT 0, user_rating_common INTEGER DEFAULT 0, rental_expired INTEGER DEFAULT 0, hidden INTEGER DEFAULT 0, deleted INTEGER DEFAULT 0, has_changes INTEGER DEFAULT 0, PRIMARY KEY (item_pid));" \
 	"CREATE TABLE container_ui (container_pid INTEGER NOT NULL, play_order INTEGER DEFAULT 0, is_reversed INTEGER DEFAULT 0, album_field_order INTEGER DEFAULT 0, repeat_mode INTEGER DEFAULT 0, shuffle_items INTEGER DEFAULT 0, has_been_shuffled INTEGER DEFAULT 0, PRIMARY KEY (container_pid));" \
@@ -28,7 +32,7 @@ static const char Dynamic_create[] =
 	"COMMIT;";
 
 /** creation statement for 'Extras.itdb' */
-static const char Extras_create[] =
+static const char Extras_create[] G_GNUC_UNUSED =
 	"BEGIN TRANSACTION;" \
 	"CREATE TABLE chapter (item_pid INTEGER NOT NULL, data BLOB, PRIMARY KEY (item_pid));" \
 	"CREATE TABLE lyrics (item_pid INTEGER NOT NULL, checksum INTEGER, lyrics TEXT, PRIMARY KEY (item_pid));" \
@@ -38,7 +42,7 @@ static const char Extras_create[] =
 	"COMMIT;";
 
 /** creation statement for 'Genius.itdb' */
-static const char Genius_create[] =
+static const char Genius_create[] G_GNUC_UNUSED =
 	"BEGIN TRANSACTION;" \
 	"CREATE TABLE genius_metadata (genius_id INTEGER NOT NULL, version INTEGER, data BLOB, PRIMARY KEY (genius_id));" \
 	"CREATE TABLE genius_similarities (genius_id INTEGER NOT NULL, version INTEGER, data BLOB, PRIMARY KEY (genius_id));" \
@@ -46,7 +50,7 @@ static const char Genius_create[] =
 	"COMMIT;";
 
 /** creation statement for 'Library.itdb' */
-static const char Library_create[] =
+static const char Library_create[] G_GNUC_UNUSED =
 	"BEGIN TRANSACTION;" \
 	"CREATE TABLE version_info (id INTEGER PRIMARY KEY, major INTEGER, minor INTEGER, compatibility INTEGER DEFAULT 0, update_level INTEGER DEFAULT 0, device_update_level INTEGER DEFAULT 0, platform INTEGER DEFAULT 0);" \
 	"CREATE TABLE db_info (pid INTEGER NOT NULL, primary_container_pid INTEGER, media_folder_url TEXT, audio_language INTEGER, subtitle_language INTEGER, genius_cuid TEXT, bib BLOB, rib BLOB, PRIMARY KEY (pid));" \
@@ -69,16 +73,32 @@ static const char Library_create[] =
 	"CREATE TABLE location_kind_map (id INTEGER NOT NULL, kind TEXT NOT NULL, PRIMARY KEY (id), UNIQUE (kind));" \
 	"CREATE TABLE genre_map (id INTEGER NOT NULL, genre TEXT NOT NULL, genre_order INTEGER DEFAULT 0, PRIMARY KEY (id), UNIQUE (genre));" \
 	"CREATE TABLE category_map (id INTEGER NOT NULL, category TEXT NOT NULL, PRIMARY KEY (id), UNIQUE (category));" \
+	"COMMIT;";
+
+/** triggers of 'Library.itdb'. They are created once the items are
+ *  inserted, after setting the flags the triggers would have set for
+ *  each item. Runs inside the transaction of the inserts. */
+static const char Library_create_triggers[] G_GNUC_UNUSED =
+	"UPDATE item SET is_song=((media_kind&1)!=0), is_audio_book=((media_kind&8)!=0), is_music_video=((media_kind&32)!=0), is_movie=((media_kind&2)!=0), is_tv_show=((media_kind&64)!=0), is_ringtone=((media_kind&16384)!=0), is_podcast=((media_kind&4)!=0), is_rental=((media_kind&32768)!=0);" \
 	"CREATE TRIGGER insert_item AFTER INSERT ON item BEGIN " \
 	"UPDATE item SET is_song=((new.media_kind&1)!=0), is_audio_book=((new.media_kind&8)!=0), is_music_video=((new.media_kind&32)!=0), is_movie=((new.media_kind&2)!=0), is_tv_show=((new.media_kind&64)!=0), is_ringtone=((new.media_kind&16384)!=0), is_podcast=((new.media_kind&4)!=0), is_rental=((new.media_kind&32768)!=0) WHERE pid = new.pid;" \
 	"END;" \
 	"CREATE TRIGGER update_item_media_kind AFTER UPDATE OF media_kind ON item BEGIN " \
 	"UPDATE item SET is_song=((new.media_kind&1)!=0), is_audio_book=((new.media_kind&8)!=0), is_music_video=((new.media_kind&32)!=0), is_movie=((new.media_kind&2)!=0), is_tv_show=((new.media_kind&64)!=0), is_ringtone=((new.media_kind&16384)!=0), is_podcast=((new.media_kind&4)!=0), is_rental=((new.media_kind&32768)!=0) WHERE pid = new.pid;" \
-	"END;" \
-	"COMMIT;";
+	"END;";
+
+/** sets the artwork item of each album of 'Library.itdb' to its first
+ *  item with artwork. item has no index on album_pid, so the items are
+ *  looked up through a temporary table instead of being scanned for
+ *  every album. */
+static const char Library_album_artwork[] G_GNUC_UNUSED =
+	"CREATE TEMP TABLE album_artwork (album_pid INTEGER PRIMARY KEY, item_pid INTEGER);" \
+	"INSERT INTO album_artwork SELECT album_pid, MIN(pid) FROM item WHERE artwork_cache_id != 0 AND album_pid IS NOT NULL GROUP BY album_pid;" \
+	"UPDATE album SET artwork_item_pid = (SELECT item_pid FROM album_artwork WHERE album_artwork.album_pid = album.pid);" \
+	"DROP TABLE album_artwork;";
 
 /** creation statement for 'Locations.itdb' */
-static const char Locations_create[] =
+static const char Locations_create[] G_GNUC_UNUSED =
 	"BEGIN TRANSACTION;" \
 	"CREATE TABLE location (item_pid INTEGER NOT NULL, sub_id INTEGER NOT NULL DEFAULT 0, base_location_id INTEGER DEFAULT 0, location_type INTEGER, location TEXT, extension INTEGER, kind_id INTEGER DEFAULT 0, date_created INTEGER DEFAULT 0, file_size INTEGER DEFAULT 0, file_creator INTEGER, file_type INTEGER, num_dir_levels_file INTEGER, num_dir_levels_lib INTEGER, PRIMARY KEY (item_pid,sub_id));" \
 	"CREATE TABLE base_location (id INTEGER NOT NULL, path TEXT, PRIMARY KEY (id));" \
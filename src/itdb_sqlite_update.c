@@ -0,0 +1,444 @@
+/*
+|  Copyright (C) 2009 Nikias Bassen <nikias@gmx.li>
+|  Copyright (C) 2009 Christophe Fergeau <cfergeau@mandriva.com>
+|  Copyright (C) 2009 Hector Martin <hector@marcansoft.com>
+|
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+|  USA
+*/
+
+/* Updating the sqlite databases on the iPod and the checksums of
+ * Locations.itdb. These only need sqlite and GLib, unlike the rest of
+ * itdb_sqlite.c, so the tests can build them on their own. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "itdb_private.h"
+
+static int cbk_calc_sha1_one_block(FILE *f, unsigned char sha1[20])
+{
+    const guint BLOCK_SIZE = 1024;
+    unsigned char block[BLOCK_SIZE];
+    size_t read_count;
+    GChecksum *checksum;
+    gsize sha1_len;
+
+    read_count = fread(block, BLOCK_SIZE, 1, f);
+    if ((read_count != 1)) {
+	if (feof(f)) {
+	    return 1;
+	} else {
+	    return -1;
+	}
+    }
+
+    sha1_len = g_checksum_type_get_length(G_CHECKSUM_SHA1);
+    g_assert (sha1_len == 20);
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, block, BLOCK_SIZE);
+    g_checksum_get_digest(checksum, sha1, &sha1_len);
+    g_checksum_free(checksum);
+
+    return 0;
+}
+
+static gboolean cbk_calc_sha1s(const char *filename, GArray *sha1s)
+{
+    FILE *f;
+    int calc_ok;
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+	return FALSE;
+    }
+
+    do {
+	unsigned char sha1[20];
+	calc_ok = cbk_calc_sha1_one_block(f, sha1);
+	if (calc_ok != 0) {
+	    break;
+	}
+	g_array_append_vals(sha1s, sha1, sizeof(sha1));
+    } while (calc_ok == 0);
+
+    if (calc_ok < 0) {
+	goto error;
+    }
+
+    fclose(f);
+    return TRUE;
+
+error:
+    fclose(f);
+    return FALSE;
+}
+
+static void cbk_calc_sha1_of_sha1s(GArray *cbk, guint cbk_header_size)
+{
+    GChecksum *checksum;
+    unsigned char* final_sha1;
+    unsigned char* sha1s;
+    gsize final_sha1_len;
+
+    g_assert (cbk->len > cbk_header_size + 20);
+
+    final_sha1 = &g_array_index(cbk, guchar, cbk_header_size);
+    sha1s = &g_array_index(cbk, guchar, cbk_header_size + 20);
+    final_sha1_len = g_checksum_type_get_length(G_CHECKSUM_SHA1);
+    g_assert (final_sha1_len == 20);
+
+    checksum = g_checksum_new(G_CHECKSUM_SHA1);
+    g_checksum_update(checksum, sha1s, cbk->len - (cbk_header_size + 20));
+    g_checksum_get_digest(checksum, final_sha1, &final_sha1_len);
+    g_checksum_free(checksum);
+}
+
+
+/* Appends the SHA-1 of each block of @filename to @cbk and stores the
+ * SHA-1 of all of them after the header of @cbk, which must be
+ * @cbk_header_size + 20 bytes long. The signature in the header is
+ * left to the caller. */
+gboolean itdb_sqlite_cbk_calc_sha1s(const gchar *filename, GArray *cbk,
+				    guint cbk_header_size)
+{
+    if (!cbk_calc_sha1s(filename, cbk)) {
+	return FALSE;
+    }
+    if (cbk->len <= cbk_header_size + 20) {
+	/* no blocks at all */
+	return FALSE;
+    }
+    cbk_calc_sha1_of_sha1s(cbk, cbk_header_size);
+    return TRUE;
+}
+
+
+/* The databases are built from scratch in a temporary directory on
+ * every write. Rather than copying them over the ones on the iPod, the
+ * rows that differ are applied to the databases on the iPod, so that a
+ * small change to the iTunesDB (a rating, a new track) only writes the
+ * few pages of the databases holding the changed rows. This is done
+ * only if the database on the iPod has the same schema as the new one,
+ * i.e. if it was written by libgpod for the same device; otherwise, or
+ * if anything goes wrong, the new database is copied to the iPod. */
+
+static gboolean update_exec(sqlite3 *db, const char *sql)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+	fprintf(stderr, "Error executing '%s': %s\n", sql,
+		errmsg ? errmsg : sqlite3_errmsg(db));
+	sqlite3_free(errmsg);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Stores the first column of the first row returned by @sql in
+ * @value */
+static gboolean update_query_int(sqlite3 *db, const char *sql,
+				 sqlite3_int64 *value)
+{
+    sqlite3_stmt *stmt = NULL;
+    gboolean res = FALSE;
+
+    if ((sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) &&
+	(sqlite3_step(stmt) == SQLITE_ROW)) {
+	*value = sqlite3_column_int64(stmt, 0);
+	res = TRUE;
+    } else {
+	fprintf(stderr, "Error executing '%s': %s\n", sql, sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+    return res;
+}
+
+/* Returns the first column of all rows returned by @sql, or NULL on
+ * error */
+static GPtrArray *update_query_strings(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    GPtrArray *strings;
+    int res;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	fprintf(stderr, "Error executing '%s': %s\n", sql, sqlite3_errmsg(db));
+	return NULL;
+    }
+    strings = g_ptr_array_new();
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+	g_ptr_array_add(strings,
+			g_strdup((const char *)sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+    if (res != SQLITE_DONE) {
+	fprintf(stderr, "Error executing '%s': %s\n", sql, sqlite3_errmsg(db));
+	g_ptr_array_foreach(strings, (GFunc)g_free, NULL);
+	g_ptr_array_free(strings, TRUE);
+	return NULL;
+    }
+    return strings;
+}
+
+static void update_free_strings(GPtrArray *strings)
+{
+    if (strings) {
+	g_ptr_array_foreach(strings, (GFunc)g_free, NULL);
+	g_ptr_array_free(strings, TRUE);
+    }
+}
+
+/* Makes @table of the database attached as "main" (the one on the
+ * iPod) the same as @table of the database attached as "new": rows
+ * missing from "new" are deleted, rows missing from "main" are
+ * inserted or replace the old ones. Rows are matched on the primary
+ * key of @table (the pid of an item, a container, an album, ...) and
+ * on all of their columns if @table has none, like item_to_container.
+ * Falls back to replacing all rows of @table if that doesn't give the
+ * same number of rows, as with duplicate rows. */
+static gboolean update_itdb_table(sqlite3 *db, const char *table)
+{
+    sqlite3_stmt *stmt = NULL;
+    GString *key_match = g_string_new(NULL);
+    GString *row_match = g_string_new(NULL);
+    GString *columns = g_string_new(NULL);
+    sqlite3_int64 old_count, new_count;
+    char *sql;
+    gboolean res = FALSE;
+
+    sql = sqlite3_mprintf("PRAGMA main.table_info(\"%w\");", table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+	fprintf(stderr, "Error executing '%s': %s\n", sql, sqlite3_errmsg(db));
+	sqlite3_free(sql);
+	goto leave;
+    }
+    sqlite3_free(sql);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+	const char *column = (const char *)sqlite3_column_text(stmt, 1);
+	char *match;
+
+	if (sqlite3_column_int(stmt, 5) > 0) {
+	    match = sqlite3_mprintf("%sn.\"%w\" = main.\"%w\".\"%w\"",
+				    key_match->len ? " AND " : "",
+				    column, table, column);
+	    g_string_append(key_match, match);
+	    sqlite3_free(match);
+	}
+	match = sqlite3_mprintf("%sg.\"%w\" IS main.\"%w\".\"%w\"",
+				row_match->len ? " AND " : "",
+				column, table, column);
+	g_string_append(row_match, match);
+	sqlite3_free(match);
+	match = sqlite3_mprintf("%s\"%w\"", columns->len ? ", " : "", column);
+	g_string_append(columns, match);
+	sqlite3_free(match);
+    }
+    sqlite3_finalize(stmt);
+    if (columns->len == 0) {
+	goto leave;
+    }
+
+    if (key_match->len) {
+	sql = sqlite3_mprintf("DELETE FROM main.\"%w\" WHERE NOT EXISTS (SELECT 1 FROM new.\"%w\" AS n WHERE %s);"
+			      "INSERT OR REPLACE INTO main.\"%w\" SELECT * FROM new.\"%w\" EXCEPT SELECT * FROM main.\"%w\";",
+			      table, table, key_match->str,
+			      table, table, table);
+    } else {
+	sql = sqlite3_mprintf("CREATE TEMP TABLE itdb_gone AS SELECT * FROM main.\"%w\" EXCEPT SELECT * FROM new.\"%w\";"
+			      "CREATE INDEX temp.itdb_gone_index ON itdb_gone (%s);"
+			      "DELETE FROM main.\"%w\" WHERE EXISTS (SELECT 1 FROM temp.itdb_gone AS g WHERE %s);"
+			      "DROP TABLE temp.itdb_gone;"
+			      "INSERT INTO main.\"%w\" SELECT * FROM new.\"%w\" EXCEPT SELECT * FROM main.\"%w\";",
+			      table, table, columns->str,
+			      table, row_match->str,
+			      table, table, table);
+    }
+    res = update_exec(db, sql);
+    sqlite3_free(sql);
+    if (!res) {
+	goto leave;
+    }
+
+    sql = sqlite3_mprintf("SELECT COUNT(*) FROM main.\"%w\";", table);
+    res = update_query_int(db, sql, &old_count);
+    sqlite3_free(sql);
+    sql = sqlite3_mprintf("SELECT COUNT(*) FROM new.\"%w\";", table);
+    res = res && update_query_int(db, sql, &new_count);
+    sqlite3_free(sql);
+    if (res && (old_count != new_count)) {
+	sql = sqlite3_mprintf("DELETE FROM main.\"%w\";"
+			      "INSERT INTO main.\"%w\" SELECT * FROM new.\"%w\";",
+			      table, table, table);
+	res = update_exec(db, sql);
+	sqlite3_free(sql);
+    }
+
+leave:
+    g_string_free(key_match, TRUE);
+    g_string_free(row_match, TRUE);
+    g_string_free(columns, TRUE);
+    return res;
+}
+
+/* Applies the differences between @from_dir/@fname and the database
+ * @to_dir/@fname on the iPod to the latter. Returns 1 if the database
+ * on the iPod was updated, 0 if it already had the same contents and
+ * -1 if it has to be replaced by the new one instead. */
+int itdb_sqlite_update_file(const gchar *from_dir, const gchar *to_dir,
+			    const gchar *fname)
+{
+    gchar *srcname = g_build_filename(from_dir, fname, NULL);
+    gchar *dstname = g_build_filename(to_dir, fname, NULL);
+    sqlite3 *db = NULL;
+    GPtrArray *tables = NULL;
+    GPtrArray *changed = NULL;
+    GPtrArray *trigger_names = NULL;
+    GPtrArray *triggers = NULL;
+    sqlite3_int64 differs, old_version, new_version;
+    gboolean in_transaction = FALSE;
+    char *sql;
+    int res = -1;
+    guint i;
+
+    if (!g_file_test(dstname, G_FILE_TEST_IS_REGULAR)) {
+	goto leave;
+    }
+    if (sqlite3_open(dstname, &db) != SQLITE_OK) {
+	fprintf(stderr, "Error opening database '%s': %s\n", dstname, sqlite3_errmsg(db));
+	goto leave;
+    }
+    /* the journal of the database on the iPod is kept, so that a crash
+     * or an early disconnect never leaves a partial update. The rows
+     * are copied as they are and the triggers don't run, so the
+     * functions the post process commands use (iPhoneSortKey(), ...)
+     * are not needed here. */
+    sqlite3_exec(db, "PRAGMA temp_store = MEMORY;", NULL, NULL, NULL);
+
+    sql = sqlite3_mprintf("ATTACH DATABASE '%q' AS new;", srcname);
+    if (!update_exec(db, sql)) {
+	sqlite3_free(sql);
+	goto leave;
+    }
+    sqlite3_free(sql);
+
+    /* only rows are updated, the schema has to be the same */
+    if (!update_query_int(db, "SELECT EXISTS (SELECT type, name, tbl_name, sql FROM main.sqlite_master EXCEPT SELECT type, name, tbl_name, sql FROM new.sqlite_master)"
+			  " OR EXISTS (SELECT type, name, tbl_name, sql FROM new.sqlite_master EXCEPT SELECT type, name, tbl_name, sql FROM main.sqlite_master);",
+			  &differs) ||
+	!update_query_int(db, "PRAGMA main.user_version;", &old_version) ||
+	!update_query_int(db, "PRAGMA new.user_version;", &new_version)) {
+	goto leave;
+    }
+    if (differs || (old_version != new_version)) {
+	fprintf(stderr, "itdbprep: '%s' has a different schema\n", fname);
+	goto leave;
+    }
+
+    tables = update_query_strings(db, "SELECT name FROM main.sqlite_master WHERE type = 'table';");
+    if (!tables) {
+	goto leave;
+    }
+    changed = g_ptr_array_new();
+    for (i = 0; i < tables->len; i++) {
+	const char *table = g_ptr_array_index(tables, i);
+	gboolean ok;
+
+	sql = sqlite3_mprintf("SELECT EXISTS (SELECT * FROM main.\"%w\" EXCEPT SELECT * FROM new.\"%w\")"
+			      " OR EXISTS (SELECT * FROM new.\"%w\" EXCEPT SELECT * FROM main.\"%w\")"
+			      " OR (SELECT COUNT(*) FROM main.\"%w\") != (SELECT COUNT(*) FROM new.\"%w\");",
+			      table, table, table, table, table, table);
+	ok = update_query_int(db, sql, &differs);
+	sqlite3_free(sql);
+	if (!ok) {
+	    goto leave;
+	}
+	if (differs) {
+	    g_ptr_array_add(changed, (gpointer)table);
+	}
+    }
+    if (changed->len == 0) {
+	fprintf(stderr, "itdbprep: '%s' is unchanged\n", fname);
+	res = 0;
+	goto leave;
+    }
+
+    if (!update_exec(db, "BEGIN IMMEDIATE;")) {
+	goto leave;
+    }
+    in_transaction = TRUE;
+
+    /* the new database holds the rows as left by the triggers and the
+     * post process commands already, they must not run again */
+    trigger_names = update_query_strings(db, "SELECT name FROM main.sqlite_master WHERE type = 'trigger' ORDER BY name;");
+    triggers = update_query_strings(db, "SELECT sql FROM main.sqlite_master WHERE type = 'trigger' ORDER BY name;");
+    if (!trigger_names || !triggers) {
+	goto leave;
+    }
+    for (i = 0; i < trigger_names->len; i++) {
+	gboolean ok;
+
+	sql = sqlite3_mprintf("DROP TRIGGER main.\"%w\";",
+			      (const char *)g_ptr_array_index(trigger_names, i));
+	ok = update_exec(db, sql);
+	sqlite3_free(sql);
+	if (!ok) {
+	    goto leave;
+	}
+    }
+
+    for (i = 0; i < changed->len; i++) {
+	if (!update_itdb_table(db, g_ptr_array_index(changed, i))) {
+	    goto leave;
+	}
+    }
+
+    for (i = 0; i < triggers->len; i++) {
+	if (!update_exec(db, g_ptr_array_index(triggers, i))) {
+	    goto leave;
+	}
+    }
+
+    if (!update_exec(db, "COMMIT;")) {
+	goto leave;
+    }
+    in_transaction = FALSE;
+    fprintf(stderr, "itdbprep: updated %u tables of '%s'\n", changed->len, fname);
+    res = 1;
+
+leave:
+    if (in_transaction) {
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+    if (db) {
+	sqlite3_close(db);
+    }
+    if (changed) {
+	g_ptr_array_free(changed, TRUE);
+    }
+    update_free_strings(tables);
+    update_free_strings(trigger_names);
+    update_free_strings(triggers);
+    g_free(srcname);
+    g_free(dstname);
+    return res;
+}
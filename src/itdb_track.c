@@ -52,6 +52,189 @@ Itdb_Track *itdb_track_new (void)
     return track;
 }
 
+/* Tracks parsed with ITDB_PARSE_FLAGS_ARENA are carved from large
+ * blocks of memory together with their private data and strings. The
+ * blocks are released all at once when the last track and the itdb
+ * have dropped their reference. */
+struct _Itdb_Arena
+{
+    guint ref_count;
+    GArray *blocks;      /* ArenaBlocks sorted by address */
+    gchar *free_pos;     /* unused memory of the current block */
+    gsize free_len;
+};
+
+typedef struct
+{
+    gchar *mem;
+    gsize len;
+} ArenaBlock;
+
+#define ARENA_BLOCK_SIZE (256*1024)
+
+Itdb_Arena *itdb_arena_new (void)
+{
+    Itdb_Arena *arena = g_new0 (Itdb_Arena, 1);
+
+    arena->ref_count = 1;
+    arena->blocks = g_array_new (FALSE, FALSE, sizeof (ArenaBlock));
+    return arena;
+}
+
+static Itdb_Arena *itdb_arena_ref (Itdb_Arena *arena)
+{
+    ++arena->ref_count;
+    return arena;
+}
+
+void itdb_arena_unref (Itdb_Arena *arena)
+{
+    guint i;
+
+    g_return_if_fail (arena);
+    g_return_if_fail (arena->ref_count > 0);
+
+    if (--arena->ref_count > 0)
+	return;
+
+    for (i=0; i<arena->blocks->len; ++i)
+	g_free (g_array_index (arena->blocks, ArenaBlock, i).mem);
+    g_array_free (arena->blocks, TRUE);
+    g_free (arena);
+}
+
+/* index of the last block starting at or below @mem, -1 if none */
+static gint arena_find_block (Itdb_Arena *arena, gconstpointer mem)
+{
+    gint low = 0, high = (gint)arena->blocks->len - 1;
+
+    while (low <= high)
+    {
+	gint mid = (low + high) / 2;
+	if ((const gchar *)mem < g_array_index (arena->blocks, ArenaBlock, mid).mem)
+	    high = mid - 1;
+	else
+	    low = mid + 1;
+    }
+    return high;
+}
+
+static gboolean itdb_arena_contains (Itdb_Arena *arena, gconstpointer mem)
+{
+    ArenaBlock *block;
+    gint i;
+
+    if (!mem) return FALSE;
+    i = arena_find_block (arena, mem);
+    if (i < 0) return FALSE;
+    block = &g_array_index (arena->blocks, ArenaBlock, i);
+    return ((const gchar *)mem < block->mem + block->len);
+}
+
+static gchar *arena_add_block (Itdb_Arena *arena, gsize len)
+{
+    ArenaBlock block;
+
+    block.mem = g_malloc (len);
+    block.len = len;
+    g_array_insert_val (arena->blocks,
+			arena_find_block (arena, block.mem) + 1, block);
+    return block.mem;
+}
+
+static gpointer itdb_arena_alloc0 (Itdb_Arena *arena, gsize len)
+{
+    gchar *mem;
+
+    /* keep everything pointer aligned */
+    len = (len + sizeof (gpointer) - 1) & ~(sizeof (gpointer) - 1);
+
+    if (len > ARENA_BLOCK_SIZE/4)
+    {   /* large allocations get a block of their own */
+	mem = arena_add_block (arena, len);
+    }
+    else
+    {
+	if (len > arena->free_len)
+	{
+	    arena->free_pos = arena_add_block (arena, ARENA_BLOCK_SIZE);
+	    arena->free_len = ARENA_BLOCK_SIZE;
+	}
+	mem = arena->free_pos;
+	arena->free_pos += len;
+	arena->free_len -= len;
+    }
+    memset (mem, 0, len);
+    return mem;
+}
+
+gchar *itdb_arena_strdup (Itdb_Arena *arena, const gchar *str)
+{
+    gsize len;
+    gchar *copy;
+
+    if (!str) return NULL;
+    len = strlen (str) + 1;
+    copy = itdb_arena_alloc0 (arena, len);
+    memcpy (copy, str, len);
+    return copy;
+}
+
+/* Same as itdb_track_new(), but the track and its private data are
+ * allocated from @arena */
+Itdb_Track *itdb_track_new_from_arena (Itdb_Arena *arena)
+{
+    Itdb_Track *track;
+
+    g_return_val_if_fail (arena, NULL);
+
+    track = itdb_arena_alloc0 (arena, sizeof (Itdb_Track));
+    track->artwork = itdb_artwork_new ();
+    track->chapterdata = itdb_chapterdata_new ();
+    track->priv = itdb_arena_alloc0 (arena, sizeof (Itdb_Track_Private));
+    track->priv->arena = itdb_arena_ref (arena);
+
+    track->visible = 1;
+    return track;
+}
+
+/* TRUE if @mem belongs to the arena @track was allocated from */
+static gboolean track_arena_contains (Itdb_Track *track, gconstpointer mem)
+{
+    return track->priv->arena && itdb_arena_contains (track->priv->arena, mem);
+}
+
+/* all string fields of Itdb_Track */
+static const glong string_fields[] = {
+    G_STRUCT_OFFSET (Itdb_Track, title),
+    G_STRUCT_OFFSET (Itdb_Track, ipod_path),
+    G_STRUCT_OFFSET (Itdb_Track, album),
+    G_STRUCT_OFFSET (Itdb_Track, artist),
+    G_STRUCT_OFFSET (Itdb_Track, genre),
+    G_STRUCT_OFFSET (Itdb_Track, filetype),
+    G_STRUCT_OFFSET (Itdb_Track, comment),
+    G_STRUCT_OFFSET (Itdb_Track, category),
+    G_STRUCT_OFFSET (Itdb_Track, composer),
+    G_STRUCT_OFFSET (Itdb_Track, grouping),
+    G_STRUCT_OFFSET (Itdb_Track, description),
+    G_STRUCT_OFFSET (Itdb_Track, podcasturl),
+    G_STRUCT_OFFSET (Itdb_Track, podcastrss),
+    G_STRUCT_OFFSET (Itdb_Track, subtitle),
+    G_STRUCT_OFFSET (Itdb_Track, tvshow),
+    G_STRUCT_OFFSET (Itdb_Track, tvepisode),
+    G_STRUCT_OFFSET (Itdb_Track, tvnetwork),
+    G_STRUCT_OFFSET (Itdb_Track, albumartist),
+    G_STRUCT_OFFSET (Itdb_Track, keywords),
+    G_STRUCT_OFFSET (Itdb_Track, sort_artist),
+    G_STRUCT_OFFSET (Itdb_Track, sort_title),
+    G_STRUCT_OFFSET (Itdb_Track, sort_album),
+    G_STRUCT_OFFSET (Itdb_Track, sort_albumartist),
+    G_STRUCT_OFFSET (Itdb_Track, sort_composer),
+    G_STRUCT_OFFSET (Itdb_Track, sort_tvshow)
+};
+
+static void track_index_build (Itdb_iTunesDB *itdb);
+
 static gboolean haystack (gchar *filetype, gchar **desclist)
 {
     gchar **dlp;
@@ -175,19 +358,16 @@ static void itdb_track_set_defaults (Itdb_Track *tr)
     /* set unique ID when not yet set */
     if (tr->dbid == 0)
     {
-	GList *gl;
 	guint64 id;
+	if (!tr->itdb->priv->dbid_index)
+	    track_index_build (tr->itdb);
 	do
 	{
 	    id = ((guint64)g_random_int () << 32) |
 		((guint64)g_random_int ());
 	    /* check if id is really unique */
-	    for (gl=tr->itdb->tracks; id && gl; gl=gl->next)
-	    {
-		Itdb_Track *g_tr = gl->data;
-		g_return_if_fail (g_tr);
-		if (id == g_tr->dbid)  id = 0;
-	    }
+	    if (id && g_hash_table_lookup (tr->itdb->priv->dbid_index, &id))
+		id = 0;
 	} while (id == 0);
 	tr->dbid = id;
 	tr->dbid2= id;
@@ -195,6 +375,242 @@ static void itdb_track_set_defaults (Itdb_Track *tr)
     if (tr->dbid2 == 0)  tr->dbid2 = tr->dbid;
 }
 
+/* string fields of Itdb_Track that are shared between tracks if the
+ * itdb was parsed with ITDB_PARSE_FLAGS_INTERN_STRINGS */
+static const glong interned_fields[] = {
+    G_STRUCT_OFFSET (Itdb_Track, album),
+    G_STRUCT_OFFSET (Itdb_Track, artist),
+    G_STRUCT_OFFSET (Itdb_Track, albumartist),
+    G_STRUCT_OFFSET (Itdb_Track, genre),
+    G_STRUCT_OFFSET (Itdb_Track, composer),
+    G_STRUCT_OFFSET (Itdb_Track, filetype),
+    G_STRUCT_OFFSET (Itdb_Track, sort_artist),
+    G_STRUCT_OFFSET (Itdb_Track, sort_album),
+    G_STRUCT_OFFSET (Itdb_Track, sort_albumartist),
+    G_STRUCT_OFFSET (Itdb_Track, sort_composer)
+};
+
+/* Drops one reference to @string if it is owned by @pool. Returns
+ * FALSE if @string is not part of @pool (it may still be equal to one
+ * of the strings in @pool if the application assigned a new value). */
+static gboolean string_pool_release (GHashTable *pool, gchar *string)
+{
+    gpointer orig, count;
+
+    if (!string ||
+	!g_hash_table_lookup_extended (pool, string, &orig, &count) ||
+	(orig != string))
+	return FALSE;
+
+    if (GPOINTER_TO_UINT (count) > 1)
+	g_hash_table_insert (pool, orig,
+			     GUINT_TO_POINTER (GPOINTER_TO_UINT (count) - 1));
+    else
+	g_hash_table_remove (pool, orig);
+    return TRUE;
+}
+
+/* Sets the string field @field of @track to @value, which @track takes
+ * ownership of. The previous string is only freed if it was allocated
+ * with g_malloc(): strings in @track's arena go away with the arena and
+ * for shared strings the reference in the string pool is dropped. */
+static void track_replace_string (Itdb_Track *track, gchar **field,
+				  gchar *value)
+{
+    if (*field == value) return;
+
+    if (!(track->itdb && track->itdb->priv->string_pool &&
+	  string_pool_release (track->itdb->priv->string_pool, *field)) &&
+	!track_arena_contains (track, *field))
+	g_free (*field);
+    *field = value;
+}
+
+/* Same as track_replace_string() for changes made by libgpod on
+ * behalf of the application, which have to be written out again
+ * when change tracking is enabled */
+void itdb_track_set_string (Itdb_Track *track, gchar **field, gchar *value)
+{
+    g_return_if_fail (track);
+    g_return_if_fail (field);
+
+    track_replace_string (track, field, value);
+    itdb_track_changed (track);
+}
+
+/* Replaces the strings listed in interned_fields[] by their shared
+ * copy in @track->itdb's string pool, adding them to the pool if
+ * necessary. Does nothing if the itdb doesn't use a string pool. */
+void itdb_track_intern_strings (Itdb_Track *track)
+{
+    GHashTable *pool;
+    guint i;
+
+    g_return_if_fail (track);
+    g_return_if_fail (track->itdb);
+
+    pool = track->itdb->priv->string_pool;
+    if (!pool) return;
+
+    for (i=0; i<G_N_ELEMENTS (interned_fields); ++i)
+    {
+	gchar **field = G_STRUCT_MEMBER_P (track, interned_fields[i]);
+	gpointer orig, count;
+
+	if (!*field) continue;
+	if (g_hash_table_lookup_extended (pool, *field, &orig, &count))
+	{
+	    if (orig == *field) continue; /* already shared */
+	    /* same contents, the track doesn't change */
+	    track_replace_string (track, field, orig);
+	    g_hash_table_insert (pool, orig,
+				 GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+	}
+	else
+	{
+	    /* the pool frees its strings with g_free() */
+	    if (track_arena_contains (track, *field))
+		*field = g_strdup (*field);
+	    g_hash_table_insert (pool, *field, GUINT_TO_POINTER (1));
+	}
+    }
+}
+
+/* Gives @track private copies of its shared strings (or, if @copy is
+ * FALSE, sets them to NULL) and releases the references held in the
+ * string pool of @track->itdb */
+static void track_release_interned_strings (Itdb_Track *track,
+					    gboolean copy)
+{
+    GHashTable *pool;
+    guint i;
+
+    if (!track->itdb || !track->itdb->priv->string_pool) return;
+    pool = track->itdb->priv->string_pool;
+
+    for (i=0; i<G_N_ELEMENTS (interned_fields); ++i)
+    {
+	gchar **field = G_STRUCT_MEMBER_P (track, interned_fields[i]);
+	gchar *string = copy ? g_strdup (*field) : NULL;
+
+	if (string_pool_release (pool, *field))
+	    *field = string;
+	else
+	    g_free (string);
+    }
+}
+
+/* The ID indexes in itdb->priv are built on first use and then kept
+ * up to date by itdb_track_add(), itdb_track_remove() and
+ * itdb_track_unlink(). They are the only thing the lookups look at:
+ * writing the database, which assigns new IDs, invalidates them, and
+ * so does removing a track that can't simply be taken out of them. */
+
+static guint dbid_hash (gconstpointer v)
+{
+    guint64 dbid = *(const guint64 *)v;
+    return (guint)(dbid ^ (dbid >> 32));
+}
+
+static gboolean dbid_equal (gconstpointer v1, gconstpointer v2)
+{
+    return *(const guint64 *)v1 == *(const guint64 *)v2;
+}
+
+static void track_array_invalidate (Itdb_iTunesDB *itdb)
+{
+    if (itdb->priv->track_array)
+    {
+	g_ptr_array_free (itdb->priv->track_array, TRUE);
+	itdb->priv->track_array = NULL;
+    }
+}
+
+void itdb_track_index_invalidate (Itdb_iTunesDB *itdb)
+{
+    g_return_if_fail (itdb);
+
+    track_array_invalidate (itdb);
+    if (itdb->priv->id_index)
+    {
+	g_hash_table_destroy (itdb->priv->id_index);
+	itdb->priv->id_index = NULL;
+    }
+    if (itdb->priv->dbid_index)
+    {
+	g_hash_table_destroy (itdb->priv->dbid_index);
+	itdb->priv->dbid_index = NULL;
+    }
+    itdb->priv->index_duplicates = FALSE;
+}
+
+/* Adds @track to the indexes of @itdb unless another track with the
+ * same ID is present already (the linear search used to return the
+ * first one as well). An ID of 0 is not assigned yet -- tracks added
+ * since the last write all have it -- and isn't indexed. */
+static void track_index_insert (Itdb_iTunesDB *itdb, Itdb_Track *track)
+{
+    if (!itdb->priv->id_index) return;
+
+    if (track->id != 0)
+    {
+	if (!g_hash_table_lookup (itdb->priv->id_index,
+				  GUINT_TO_POINTER (track->id)))
+	    g_hash_table_insert (itdb->priv->id_index,
+				 GUINT_TO_POINTER (track->id), track);
+	else
+	    itdb->priv->index_duplicates = TRUE;
+    }
+    if (track->dbid != 0)
+    {
+	if (!g_hash_table_lookup (itdb->priv->dbid_index, &track->dbid))
+	    g_hash_table_insert (itdb->priv->dbid_index,
+				 g_memdup (&track->dbid, sizeof (guint64)),
+				 track);
+	else
+	    itdb->priv->index_duplicates = TRUE;
+    }
+}
+
+static void track_index_build (Itdb_iTunesDB *itdb)
+{
+    GList *gl;
+
+    itdb_track_index_invalidate (itdb);
+    itdb->priv->id_index = g_hash_table_new (g_direct_hash, g_direct_equal);
+    itdb->priv->dbid_index = g_hash_table_new_full (dbid_hash, dbid_equal,
+						    g_free, NULL);
+    for (gl=itdb->tracks; gl; gl=gl->next)
+	track_index_insert (itdb, gl->data);
+}
+
+/* Must be called after @track has been removed from itdb->tracks */
+static void track_index_remove (Itdb_iTunesDB *itdb, Itdb_Track *track)
+{
+    if (!itdb->priv->id_index) return;
+
+    if (!itdb->priv->index_duplicates &&
+	((track->id == 0) ||
+	 (g_hash_table_lookup (itdb->priv->id_index,
+			       GUINT_TO_POINTER (track->id)) == track)) &&
+	((track->dbid == 0) ||
+	 (g_hash_table_lookup (itdb->priv->dbid_index,
+			       &track->dbid) == track)))
+    {
+	if (track->id != 0)
+	    g_hash_table_remove (itdb->priv->id_index,
+				 GUINT_TO_POINTER (track->id));
+	if (track->dbid != 0)
+	    g_hash_table_remove (itdb->priv->dbid_index, &track->dbid);
+    }
+    else
+    {   /* IDs were changed, or another track with the same ID has to
+	   take the place of @track: make sure no pointer to @track
+	   stays behind */
+	itdb_track_index_invalidate (itdb);
+    }
+}
+
 /**
  * itdb_track_add:
  * @itdb:   an #Itdb_iTunesDB
@@ -215,8 +631,11 @@ void itdb_track_add (Itdb_iTunesDB *itdb, Itdb_Track *track, gint32 pos)
     track->itdb = itdb;
 
     itdb_track_set_defaults (track);
+    itdb_track_intern_strings (track);
 
     itdb->tracks = g_list_insert (itdb->tracks, track, pos);
+    track_index_insert (itdb, track);
+    track_array_invalidate (itdb);
 }
 
 /**
@@ -227,8 +646,24 @@ void itdb_track_add (Itdb_iTunesDB *itdb, Itdb_Track *track, gint32 pos)
  */
 void itdb_track_free (Itdb_Track *track)
 {
+    Itdb_Arena *arena;
+    guint i;
+
     g_return_if_fail (track);
 
+    track_release_interned_strings (track, FALSE);
+
+    arena = track->priv->arena;
+    if (arena)
+    {   /* strings still pointing into the arena go away with it */
+	for (i=0; i<G_N_ELEMENTS (string_fields); ++i)
+	{
+	    gchar **field = G_STRUCT_MEMBER_P (track, string_fields[i]);
+	    if (itdb_arena_contains (arena, *field))
+		*field = NULL;
+	}
+    }
+
     g_free (track->title);
     g_free (track->ipod_path);
     g_free (track->album);
@@ -262,6 +697,14 @@ void itdb_track_free (Itdb_Track *track)
     if (track->userdata && track->userdata_destroy)
 	(*track->userdata_destroy) (track->userdata);
 
+    itdb_track_drop_mhit_cache (track);
+    itdb_track_drop_collate_keys (track);
+
+    if (arena)
+    {   /* @track and its private data are part of the arena */
+	itdb_arena_unref (arena);
+	return;
+    }
     g_free (track->priv);
     g_free (track);
 }
@@ -283,6 +726,8 @@ void itdb_track_remove (Itdb_Track *track)
     g_return_if_fail (itdb);
 
     itdb->tracks = g_list_remove (itdb->tracks, track);
+    track_index_remove (itdb, track);
+    track_array_invalidate (itdb);
     itdb_track_free (track);
 }
 
@@ -303,7 +748,17 @@ void itdb_track_unlink (Itdb_Track *track)
     itdb = track->itdb;
     g_return_if_fail (itdb);
 
+    /* fields not decoded yet can't be retrieved once @track is
+       detached from @itdb */
+    itdb_track_materialize (track, NULL);
+    track->priv->mhit_seek = 0;
+    /* the string pool belongs to @itdb */
+    track_release_interned_strings (track, TRUE);
+    itdb_track_drop_mhit_cache (track);
+
     itdb->tracks = g_list_remove (itdb->tracks, track);
+    track_index_remove (itdb, track);
+    track_array_invalidate (itdb);
     track->itdb = NULL;
 }
 
@@ -321,6 +776,8 @@ Itdb_Track *itdb_track_duplicate (Itdb_Track *tr)
 
     g_return_val_if_fail (tr, NULL);
 
+    itdb_track_materialize (tr, NULL);
+
     tr_dup = g_new (Itdb_Track, 1);
     memcpy (tr_dup, tr, sizeof (Itdb_Track));
 
@@ -356,6 +813,10 @@ Itdb_Track *itdb_track_duplicate (Itdb_Track *tr)
 
     /* Copy private data too */
     tr_dup->priv = g_memdup (tr->priv, sizeof (Itdb_Track_Private));
+    tr_dup->priv->mhit_seek = 0;
+    tr_dup->priv->arena = NULL;
+    tr_dup->priv->mhit_cache = NULL;
+    tr_dup->priv->collate_keys = NULL;
 
     /* Copy chapterdata */
     tr_dup->chapterdata = itdb_chapterdata_duplicate (tr->chapterdata);
@@ -388,6 +849,7 @@ static gboolean itdb_track_set_thumbnails_internal (Itdb_Track *track,
     g_return_val_if_fail (track, FALSE);
     g_return_val_if_fail (filename || image_data || pixbuf, FALSE);
 
+    itdb_track_changed (track);
     itdb_artwork_remove_thumbnails (track->artwork);
     /* clear artwork id */
     track->artwork->id = 0;
@@ -520,6 +982,7 @@ gboolean itdb_track_set_thumbnails_from_pixbuf (Itdb_Track *track,
 void itdb_track_remove_thumbnails (Itdb_Track *track)
 {
     g_return_if_fail (track);
+    itdb_track_changed (track);
     itdb_artwork_remove_thumbnails (track->artwork);
     track->artwork_size = 0;
     track->artwork_count = 0;
@@ -528,6 +991,84 @@ void itdb_track_remove_thumbnails (Itdb_Track *track)
     track->has_artwork = 0x02;
 }
 
+void itdb_track_drop_mhit_cache (Itdb_Track *track)
+{
+    if (track->priv->mhit_cache)
+    {
+	g_byte_array_free (track->priv->mhit_cache, TRUE);
+	track->priv->mhit_cache = NULL;
+    }
+}
+
+void itdb_track_drop_collate_keys (Itdb_Track *track)
+{
+    Itdb_CollateKey *keys = track->priv->collate_keys;
+    gint i;
+
+    if (keys)
+    {
+	for (i=0; i<ITDB_COLLATE_KEYS; ++i)
+	{
+	    g_free (keys[i].source);
+	    g_free (keys[i].key);
+	}
+	g_free (keys);
+	track->priv->collate_keys = NULL;
+    }
+}
+
+/**
+ * itdb_track_changed:
+ * @track: an #Itdb_Track
+ *
+ * Tells libgpod that fields of @track have been modified. This is
+ * only needed if change tracking has been enabled with
+ * itdb_set_change_tracking(), in which case it must be called after
+ * every modification of @track (including its chapterdata) so that
+ * the next itdb_write() serializes @track again instead of reusing
+ * what was written the last time.
+ *
+ * Since: 0.8.2
+ */
+void itdb_track_changed (Itdb_Track *track)
+{
+    g_return_if_fail (track);
+
+    itdb_track_drop_mhit_cache (track);
+}
+
+/**
+ * itdb_set_change_tracking:
+ * @itdb:   an #Itdb_iTunesDB
+ * @enable: whether to enable change tracking
+ *
+ * With change tracking enabled, itdb_write() keeps the serialized form
+ * of every track and copies it unchanged on the next write unless
+ * itdb_track_changed() has been called for the track in between. This
+ * makes repeated writes of a large database much faster at the cost of
+ * keeping a copy of the track part of the iTunesDB in memory.
+ *
+ * Only enable change tracking if every modification of a track is
+ * followed by a call to itdb_track_changed(). Tracks added, removed or
+ * reordered are handled automatically, as are the changes made by
+ * libgpod itself (e.g. itdb_track_set_thumbnails()).
+ *
+ * Since: 0.8.2
+ */
+void itdb_set_change_tracking (Itdb_iTunesDB *itdb, gboolean enable)
+{
+    GList *gl;
+
+    g_return_if_fail (itdb);
+
+    if (!enable)
+    {
+	for (gl=itdb->tracks; gl; gl=gl->next)
+	    itdb_track_drop_mhit_cache (gl->data);
+    }
+    itdb->priv->change_tracking = enable;
+}
+
 /**
  * itdb_track_by_id:
  * @itdb: an #Itdb_iTunesDB
@@ -540,26 +1081,104 @@ void itdb_track_remove_thumbnails (Itdb_Track *track)
  * because they are needed during import of the iTunesDB which is
  * referencing tracks by IDs.
  *
- * This function is very slow (linear in the number of tracks
- * contained in the database). If you need to lookup many IDs use
- * itdb_track_id_tree_create(), itdb_track_id_tree_destroy(), and
- * itdb_track_id_tree_by_id().
+ * The lookup uses an index maintained by @itdb and takes constant
+ * time. The index is kept up to date by itdb_track_add(),
+ * itdb_track_remove() and itdb_track_unlink() and rebuilt after the
+ * database has been written. Tracks are indexed under the ID they had
+ * when they were added, so a track whose ID the application sets
+ * directly afterwards is only found by its new ID once the database
+ * has been written (which assigns new IDs to all tracks anyway). Tracks
+ * with an ID of 0, such as tracks added since the database was last
+ * written, are never found.
  *
  * Returns: #Itdb_Track with the ID @id or NULL if the ID cannot be
  * found.
  */
 Itdb_Track *itdb_track_by_id (Itdb_iTunesDB *itdb, guint32 id)
 {
-    GList *gl;
+    Itdb_Track *track;
 
     g_return_val_if_fail (itdb, NULL);
 
-    for (gl=itdb->tracks; gl; gl=gl->next)
+    if (!itdb->priv->id_index)
+	track_index_build (itdb);
+
+    track = g_hash_table_lookup (itdb->priv->id_index, GUINT_TO_POINTER (id));
+    if (track && (track->id != id))
+    {   /* the application changed the ID */
+	track_index_build (itdb);
+	track = g_hash_table_lookup (itdb->priv->id_index,
+				     GUINT_TO_POINTER (id));
+    }
+    return track;
+}
+
+/**
+ * itdb_track_by_dbid:
+ * @itdb: an #Itdb_iTunesDB
+ * @dbid: ID to look for
+ *
+ * Looks up a track using its database ID (#Itdb_Track.dbid), which
+ * unlike #Itdb_Track.id stays the same when the database is
+ * written. See itdb_track_by_id() for details on the lookup: in the
+ * same way, a database ID set directly by the application is only
+ * found once the database has been written.
+ *
+ * Returns: #Itdb_Track with the database ID @dbid or NULL if the ID
+ * cannot be found.
+ *
+ * Since: 0.8.2
+ */
+Itdb_Track *itdb_track_by_dbid (Itdb_iTunesDB *itdb, guint64 dbid)
+{
+    Itdb_Track *track;
+
+    g_return_val_if_fail (itdb, NULL);
+
+    if (!itdb->priv->dbid_index)
+	track_index_build (itdb);
+
+    track = g_hash_table_lookup (itdb->priv->dbid_index, &dbid);
+    if (track && (track->dbid != dbid))
+    {   /* the application changed the database ID */
+	track_index_build (itdb);
+	track = g_hash_table_lookup (itdb->priv->dbid_index, &dbid);
+    }
+    return track;
+}
+
+/**
+ * itdb_track_nth:
+ * @itdb: an #Itdb_iTunesDB
+ * @n:    position of the track in @itdb->tracks
+ *
+ * Same as g_list_nth_data (@itdb->tracks, @n), but takes constant
+ * time. The array used for the lookup is rebuilt after tracks have
+ * been added or removed with itdb_track_add(), itdb_track_remove() or
+ * itdb_track_unlink(), and after the database has been written. It
+ * does not notice changes made to @itdb->tracks directly.
+ *
+ * Returns: the @n-th #Itdb_Track of @itdb or NULL if @itdb has fewer
+ * tracks.
+ *
+ * Since: 0.8.2
+ */
+Itdb_Track *itdb_track_nth (Itdb_iTunesDB *itdb, guint32 n)
+{
+    g_return_val_if_fail (itdb, NULL);
+
+    if (!itdb->priv->track_array)
     {
-	Itdb_Track *track = gl->data;
-	if (track->id == id)  return track;
+	GList *gl;
+
+	itdb->priv->track_array = g_ptr_array_new ();
+	for (gl=itdb->tracks; gl; gl=gl->next)
+	    g_ptr_array_add (itdb->priv->track_array, gl->data);
     }
-    return NULL;
+
+    if (n >= itdb->priv->track_array->len)
+	return NULL;
+    return g_ptr_array_index (itdb->priv->track_array, n);
 }
 
 static gint track_id_compare (gconstpointer a, gconstpointer b)
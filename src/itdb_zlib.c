@@ -26,7 +26,11 @@
 |  $Id$
 */
 #include <config.h>
+#include <errno.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 #include <zlib.h>
 
 #include <glib/gi18n-lib.h>
@@ -36,67 +40,77 @@
 
 #define CHUNK 16384
 
-static int zlib_inflate(gchar *outbuf, gchar *zdata, gsize compressed_size, gsize *uncompressed_size)
+/* Size of the blocks deflated independently in parallel mode, and the
+ * minimum amount of data for using it at all. Each block is primed
+ * with the last ZLIB_DICT_SIZE bytes of the preceding block so that
+ * the compression ratio hardly suffers. */
+#define ZLIB_BLOCK_SIZE (128*1024)
+#define ZLIB_DICT_SIZE 32768
+#define ZLIB_THREADED_MIN (4*ZLIB_BLOCK_SIZE)
+
+/* Inflates the @compressed_size bytes at @zdata in a single pass. The
+ * uncompressed data is appended to the first @*outlen bytes of
+ * @*outbuf (which must have been allocated with g_malloc()), the
+ * buffer being grown as needed. On success @*outbuf and @*outlen are
+ * updated, on error @*outbuf is left untouched. */
+static int zlib_inflate(gchar **outbuf, gsize *outlen, gchar *zdata, gsize compressed_size)
 {
     int ret;
-    guint32 inpos = 0;
-    guint32 outpos = 0;
-    unsigned have;
     z_stream strm;
-    unsigned char out[CHUNK];
+    gchar *buf;
+    gsize pos;
+    gsize total;
 
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
+    strm.avail_in = compressed_size;
+    strm.next_in = (unsigned char*)zdata;
     ret = inflateInit(&strm);
     if (ret != Z_OK)
         return ret;
 
-    *uncompressed_size = 0;
+    /* iTunesDBs usually compress to somewhat less than a quarter of
+     * their size. Start with that and double the buffer whenever it
+     * runs full. */
+    pos = *outlen;
+    total = pos + 4*compressed_size + CHUNK;
+    buf = g_realloc (*outbuf, total);
+    *outbuf = buf;
 
-    /* decompress until deflate stream ends or end of file */
     do {
-        strm.avail_in = CHUNK;
-	if (inpos+strm.avail_in > compressed_size) {
-	    strm.avail_in = compressed_size - inpos;
-	}
-        strm.next_in = (unsigned char*)zdata+inpos;
-	inpos+=strm.avail_in;
-
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = CHUNK;
-            if (outbuf)  {
-                strm.next_out = (unsigned char*)(outbuf + outpos);
-            } else {
-                strm.next_out = out;
-            }
-            ret = inflate(&strm, Z_NO_FLUSH);
-            g_assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-            have = CHUNK - strm.avail_out;
-	    *uncompressed_size += have;
-	    if (outbuf) {
-		outpos += have;
-	    }
-        } while (strm.avail_out == 0);
-
-        /* done when inflate() says it's done */
+        if (pos == total) {
+            total *= 2;
+            buf = g_realloc (buf, total);
+            *outbuf = buf;
+        }
+        strm.next_out = (unsigned char*)(buf + pos);
+        strm.avail_out = total - pos;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        g_assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
+        switch (ret) {
+        case Z_NEED_DICT:
+            ret = Z_DATA_ERROR;     /* and fall through */
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+            (void)inflateEnd(&strm);
+            return ret;
+        }
+        pos = total - strm.avail_out;
+        /* no progress possible: input truncated */
+        if ((ret == Z_BUF_ERROR) && (pos < total)) {
+            (void)inflateEnd(&strm);
+            return Z_DATA_ERROR;
+        }
     } while (ret != Z_STREAM_END);
 
     /* clean up and return */
     (void)inflateEnd(&strm);
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+    /* give back what the estimate overshot */
+    *outbuf = g_realloc (buf, pos);
+    *outlen = pos;
+    return Z_OK;
 }
 
 gboolean itdb_zlib_check_decompress_fimp (FImport *fimp)
@@ -104,7 +118,8 @@ gboolean itdb_zlib_check_decompress_fimp (FImport *fimp)
     FContents *cts;
     guint32 headerSize;
     guint32 cSize;
-    size_t uSize;
+    gchar *new_contents;
+    gsize new_length;
 
     g_return_val_if_fail (fimp, FALSE);
     g_return_val_if_fail (fimp->fcontents, FALSE);
@@ -114,7 +129,6 @@ gboolean itdb_zlib_check_decompress_fimp (FImport *fimp)
 
     cSize = GUINT32_FROM_LE (*(guint32*)(cts->contents+8));
     headerSize = GUINT32_FROM_LE (*(guint32*)(cts->contents+4));
-    uSize = 0;
 
     if (headerSize < 0xA9) {
 	g_set_error (&fimp->error,
@@ -124,27 +138,19 @@ gboolean itdb_zlib_check_decompress_fimp (FImport *fimp)
 	return FALSE;
     }
 
-    /* compression flag */
-    if (*(guint8*)(cts->contents+0xa8) == 1) {
-	*(guint8*)(cts->contents+0xa8) = 0;
-    } else {
-	g_warning ("Unknown value for 0xa8 in header: should be 1 for uncompressed, is %d.\n", *(guint8*)(cts->contents+0xa8));
-    }
-
-    if (zlib_inflate(NULL, cts->contents+headerSize, cSize-headerSize, &uSize) == 0) {
-	gchar *new_contents;
-	/*g_print("allocating %"G_GSIZE_FORMAT"\n", uSize+headerSize);*/
-	new_contents = (gchar*)g_malloc(uSize+headerSize);
-	memcpy(new_contents, cts->contents, headerSize);
-	/*g_print("decompressing\n");*/
-	if (zlib_inflate(new_contents+headerSize, cts->contents+headerSize, cSize-headerSize, &uSize) == 0) {
-	    /* update FContents structure */
-	    g_free(cts->contents);
-	    cts->contents = new_contents;
-	    cts->length = uSize+headerSize;
-	    /*g_print("uncompressed size: %"G_GSIZE_FORMAT"\n", cts->length);*/
-	}
+    /* compression flag -- cleared in the copy of the header, the file
+     * may be mapped read-only */
+    new_contents = g_memdup (cts->contents, headerSize);
+    if (*(guint8*)(new_contents+0xa8) == 1) {
+	*(guint8*)(new_contents+0xa8) = 0;
     } else {
+	g_warning ("Unknown value for 0xa8 in header: should be 1 for uncompressed, is %d.\n", *(guint8*)(new_contents+0xa8));
+    }
+
+    new_length = headerSize;
+    if ((cSize < headerSize) || (cSize > cts->length) ||
+	(zlib_inflate(&new_contents, &new_length, cts->contents+headerSize, cSize-headerSize) != Z_OK)) {
+	g_free (new_contents);
 	g_set_error (&fimp->error,
 		     ITDB_FILE_ERROR,
 		     ITDB_FILE_ERROR_CORRUPT,
@@ -153,6 +159,203 @@ gboolean itdb_zlib_check_decompress_fimp (FImport *fimp)
 	return FALSE;
     }
 
+    /* update FContents structure, the compressed data is no longer
+     * needed */
+    if (cts->mapped_file) {
+	g_mapped_file_free (cts->mapped_file);
+	cts->mapped_file = NULL;
+    } else {
+	g_free(cts->contents);
+    }
+    cts->contents = new_contents;
+    cts->length = new_length;
+    /*g_print("uncompressed size: %"G_GSIZE_FORMAT"\n", cts->length);*/
+
+    return TRUE;
+}
+
+/* Receives the pieces of the zlib stream produced by
+ * zlib_deflate_parallel() in order. */
+typedef gboolean (*ZlibWriteFunc) (const guchar *data, gsize len,
+				   gpointer user_data, GError **error);
+
+/* One block of the input of zlib_deflate_parallel() */
+typedef struct {
+    const guchar *data;
+    gsize len;
+    const guchar *dict;   /* end of the preceding block, or NULL */
+    gsize dict_len;
+    gboolean last;        /* last block of the stream */
+    gint level;
+    guchar *out;          /* raw deflate data, g_free() after use */
+    gsize out_len;
+    uLong adler;          /* adler32 of the uncompressed block */
+    gboolean ok;
+} ZlibBlock;
+
+/* Deflates one block into a raw deflate stream. All but the last
+ * block end with a sync flush, so that the blocks can be concatenated
+ * into one stream. */
+static void zlib_deflate_block (gpointer data, gpointer user_data)
+{
+    ZlibBlock *block = data;
+    z_stream strm;
+    gsize size;
+    int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int status;
+
+    block->ok = FALSE;
+    block->out = NULL;
+    block->out_len = 0;
+    block->adler = adler32 (adler32 (0L, Z_NULL, 0), block->data, block->len);
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2 (&strm, block->level, Z_DEFLATED, -MAX_WBITS,
+		      8, Z_DEFAULT_STRATEGY) != Z_OK)
+	return;
+    if (block->dict &&
+	(deflateSetDictionary (&strm, block->dict, block->dict_len) != Z_OK)) {
+	deflateEnd (&strm);
+	return;
+    }
+
+    /* room for the sync flush marker on top of deflateBound() */
+    size = deflateBound (&strm, block->len) + 16;
+    block->out = g_malloc (size);
+    strm.next_in = (guchar*)block->data;
+    strm.avail_in = block->len;
+    do {
+	if (block->out_len == size) {
+	    size *= 2;
+	    block->out = g_realloc (block->out, size);
+	}
+	strm.next_out = block->out + block->out_len;
+	strm.avail_out = size - block->out_len;
+	status = deflate (&strm, flush);
+	block->out_len = size - strm.avail_out;
+    } while ((status == Z_OK) && (strm.avail_out == 0));
+    deflateEnd (&strm);
+
+    if (block->last)
+	block->ok = (status == Z_STREAM_END);
+    else
+	block->ok = (status == Z_OK) && (strm.avail_in == 0);
+}
+
+/* Deflates the @len bytes at @data into a zlib stream at @level,
+ * pigz-style: blocks of ZLIB_BLOCK_SIZE are compressed independently
+ * by @nr_threads threads, concatenated and followed by the combined
+ * adler32. The stream is passed to @write_func piece by piece; only
+ * a few blocks per thread are held in memory at any time. */
+static gboolean zlib_deflate_parallel (const guchar *data, gsize len,
+				       gint level, guint nr_threads,
+				       ZlibWriteFunc write_func,
+				       gpointer user_data, GError **error)
+{
+    ZlibBlock *blocks;
+    gsize total_blocks, first;
+    guint nr_blocks, i, n;
+    guint head, level_flags;
+    guchar buf[4];
+    uLong adler;
+    gboolean result = TRUE;
+
+    /* zlib header (RFC 1950): deflate with 32K window, FLEVEL chosen
+       the way deflate() does, FCHECK making it a multiple of 31 */
+    if ((level == Z_DEFAULT_COMPRESSION) || (level == 6))
+	level_flags = 2;
+    else if (level < 2)
+	level_flags = 0;
+    else if (level < 6)
+	level_flags = 1;
+    else
+	level_flags = 3;
+    head = (0x78 << 8) | (level_flags << 6);
+    head += 31 - (head % 31);
+    buf[0] = head >> 8;
+    buf[1] = head & 0xff;
+    if (!write_func (buf, 2, user_data, error))
+	return FALSE;
+
+    /* an empty input still needs one (final) block */
+    total_blocks = MAX (1, (len + ZLIB_BLOCK_SIZE - 1) / ZLIB_BLOCK_SIZE);
+    /* use a few more blocks than threads to even out the load */
+    nr_blocks = nr_threads * 4;
+    blocks = g_new0 (ZlibBlock, nr_blocks);
+    adler = adler32 (0L, Z_NULL, 0);
+
+    for (first=0; result && (first<total_blocks); first+=n)
+    {
+	GThreadPool *pool;
+
+	n = MIN (nr_blocks, total_blocks - first);
+	for (i=0; i<n; ++i)
+	{
+	    gsize offset = (first + i) * ZLIB_BLOCK_SIZE;
+
+	    blocks[i].data = data + offset;
+	    blocks[i].len = MIN (ZLIB_BLOCK_SIZE, len - offset);
+	    blocks[i].dict_len = MIN (ZLIB_DICT_SIZE, offset);
+	    blocks[i].dict = offset ? data + offset - blocks[i].dict_len : NULL;
+	    blocks[i].last = (first + i + 1 == total_blocks);
+	    blocks[i].level = level;
+	}
+
+	pool = g_thread_pool_new (zlib_deflate_block, NULL,
+				  nr_threads, FALSE, NULL);
+	for (i=0; i<n; ++i)
+	{
+	    if (pool)
+		g_thread_pool_push (pool, &blocks[i], NULL);
+	    else    /* compress in this thread instead */
+		zlib_deflate_block (&blocks[i], NULL);
+	}
+	if (pool)
+	{   /* wait for all blocks of this round to be compressed */
+	    g_thread_pool_free (pool, FALSE, TRUE);
+	}
+
+	/* append the blocks in order */
+	for (i=0; i<n; ++i)
+	{
+	    if (result && !blocks[i].ok)
+	    {
+		g_set_error (error,
+			     ITDB_FILE_ERROR,
+			     ITDB_FILE_ERROR_ITDB_CORRUPT,
+			     _("Error compressing iTunesCDB file!\n"));
+		result = FALSE;
+	    }
+	    if (result)
+	    {
+		adler = adler32_combine (adler, blocks[i].adler, blocks[i].len);
+		result = write_func (blocks[i].out, blocks[i].out_len,
+				     user_data, error);
+	    }
+	    g_free (blocks[i].out);
+	    blocks[i].out = NULL;
+	}
+    }
+    g_free (blocks);
+
+    if (!result)
+	return FALSE;
+
+    /* adler32 of the whole uncompressed data, most significant byte
+       first */
+    buf[0] = (adler >> 24) & 0xff;
+    buf[1] = (adler >> 16) & 0xff;
+    buf[2] = (adler >> 8) & 0xff;
+    buf[3] = adler & 0xff;
+    return write_func (buf, 4, user_data, error);
+}
+
+static gboolean zlib_append_to_array (const guchar *data, gsize len,
+				      gpointer user_data, GError **error)
+{
+    g_byte_array_append (user_data, data, len);
     return TRUE;
 }
 
@@ -163,9 +366,12 @@ gboolean itdb_zlib_check_compress_fexp (FExport *fexp)
     uLongf compressed_len;
     guint32 uncompressed_len;
     gchar *new_contents;
+    gint level;
+    guint nr_threads;
     int status;
 
     cts = fexp->wcontents;
+    level = fexp->itdb->priv->compression_level;
 
     /*g_print("target DB needs compression\n");*/
 
@@ -187,12 +393,30 @@ gboolean itdb_zlib_check_compress_fexp (FExport *fexp)
 	g_warning ("Unknown value for 0xa8 in header: should be 0 for uncompressed, is %d.\n", *(guint8*)(cts->contents+0xa8));
     }
 
-    compressed_len = compressBound (uncompressed_len);
+    nr_threads = itdb_thread_count ();
+    if ((nr_threads > 1) && (uncompressed_len >= ZLIB_THREADED_MIN)) {
+	GByteArray *array = g_byte_array_sized_new (header_len + uncompressed_len/4);
+
+	g_byte_array_append (array, (guchar*)cts->contents, header_len);
+	if (!zlib_deflate_parallel ((guchar*)cts->contents + header_len,
+				    uncompressed_len, level, nr_threads,
+				    zlib_append_to_array, array,
+				    &fexp->error)) {
+	    g_byte_array_free (array, TRUE);
+	    return FALSE;
+	}
+	compressed_len = array->len - header_len;
+	new_contents = (gchar*)g_byte_array_free (array, FALSE);
+	status = Z_OK;
+    } else {
+	compressed_len = compressBound (uncompressed_len);
 
-    new_contents = g_malloc (header_len + compressed_len);
-    memcpy (new_contents, cts->contents, header_len);
-    status = compress2 ((guchar*)new_contents + header_len, &compressed_len,
-			(guchar*)cts->contents + header_len, uncompressed_len, 1);
+	new_contents = g_malloc (header_len + compressed_len);
+	memcpy (new_contents, cts->contents, header_len);
+	status = compress2 ((guchar*)new_contents + header_len, &compressed_len,
+			    (guchar*)cts->contents + header_len, uncompressed_len,
+			    level);
+    }
     if (status != Z_OK) {
 	g_free (new_contents);
 	g_set_error (&fexp->error,
@@ -211,3 +435,162 @@ gboolean itdb_zlib_check_compress_fexp (FExport *fexp)
 
     return TRUE;
 }
+
+/* Write @len bytes of @data to @fd. Return FALSE and set @error on
+ * error. */
+static gboolean zlib_write_all (gint fd, const guchar *data, gsize len,
+				GError **error)
+{
+    while (len > 0) {
+	gssize written = write (fd, data, len);
+	if (written < 0) {
+	    if (errno == EINTR)
+		continue;
+	    g_set_error (error,
+			 G_FILE_ERROR,
+			 g_file_error_from_errno (errno),
+			 _("Error writing compressed iTunesCDB (%s)."),
+			 g_strerror (errno));
+	    return FALSE;
+	}
+	data += written;
+	len -= written;
+    }
+    return TRUE;
+}
+
+/* Context of zlib_write_to_fd() */
+typedef struct {
+    gint fd;
+    gsize written;
+} ZlibFdWriter;
+
+static gboolean zlib_write_to_fd (const guchar *data, gsize len,
+				  gpointer user_data, GError **error)
+{
+    ZlibFdWriter *writer = user_data;
+
+    writer->written += len;
+    return zlib_write_all (writer->fd, data, len, error);
+}
+
+/* Streaming counterpart of itdb_zlib_check_compress_fexp(): writes
+ * the @len bytes long uncompressed iTunesDB at @data as iTunesCDB
+ * compressed at @level to the empty file @fd, deflating CHUNK bytes
+ * at a time (or blocks in parallel) so that the compressed data never
+ * has to be kept in memory. On success the total size of the
+ * iTunesCDB is stored in @compressed_len. */
+gboolean itdb_zlib_compress_to_fd (const gchar *data, gsize len, gint fd,
+				   gint level, gsize *compressed_len,
+				   GError **error)
+{
+    guchar out[CHUNK];
+    guchar *header;
+    guint32 header_len;
+    guint nr_threads;
+    gsize total_out;
+    z_stream strm;
+    int status;
+
+    g_return_val_if_fail (data, FALSE);
+    g_return_val_if_fail (compressed_len, FALSE);
+
+    if (len < 12) {
+	header_len = 0;
+    } else {
+	header_len = GUINT32_FROM_LE (*(guint32*)(data+4));
+    }
+    if ((header_len < 0xA9) || (header_len > len)) {
+	g_set_error (error,
+		     ITDB_FILE_ERROR,
+		     ITDB_FILE_ERROR_ITDB_CORRUPT,
+		     _("Header is too small for iTunesCDB!\n"));
+	return FALSE;
+    }
+
+    header = g_memdup (data, header_len);
+    /* compression flag */
+    if (header[0xa8] == 0) {
+	header[0xa8] = 1;
+    } else {
+	g_warning ("Unknown value for 0xa8 in header: should be 0 for uncompressed, is %d.\n", header[0xa8]);
+    }
+    /* the mhbd size is filled in once it is known */
+    if (!zlib_write_all (fd, header, header_len, error)) {
+	g_free (header);
+	return FALSE;
+    }
+
+    nr_threads = itdb_thread_count ();
+    if ((nr_threads > 1) && (len - header_len >= ZLIB_THREADED_MIN)) {
+	ZlibFdWriter writer;
+
+	writer.fd = fd;
+	writer.written = 0;
+	if (!zlib_deflate_parallel ((guchar*)data + header_len,
+				    len - header_len, level, nr_threads,
+				    zlib_write_to_fd, &writer, error)) {
+	    g_free (header);
+	    return FALSE;
+	}
+	total_out = writer.written;
+	goto update_header;
+    }
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit (&strm, level) != Z_OK) {
+	g_free (header);
+	g_set_error (error,
+		     ITDB_FILE_ERROR,
+		     ITDB_FILE_ERROR_ITDB_CORRUPT,
+		     _("Error compressing iTunesCDB file!\n"));
+	return FALSE;
+    }
+    strm.next_in = (guchar*)data + header_len;
+    strm.avail_in = len - header_len;
+    do {
+	strm.next_out = out;
+	strm.avail_out = CHUNK;
+	status = deflate (&strm, Z_FINISH);
+	if ((status == Z_STREAM_ERROR) ||
+	    !zlib_write_all (fd, out, CHUNK - strm.avail_out, error)) {
+	    break;
+	}
+    } while (status != Z_STREAM_END);
+    deflateEnd (&strm);
+
+    if (status != Z_STREAM_END) {
+	g_free (header);
+	if (error && !*error) {
+	    g_set_error (error,
+			 ITDB_FILE_ERROR,
+			 ITDB_FILE_ERROR_ITDB_CORRUPT,
+			 _("Error compressing iTunesCDB file!\n"));
+	}
+	return FALSE;
+    }
+
+    total_out = strm.total_out;
+
+  update_header:
+    /* update mhbd size */
+    *compressed_len = total_out + header_len;
+    *(guint32*)(header+8) = GUINT32_TO_LE (*compressed_len);
+    if ((lseek (fd, 0, SEEK_SET) == -1) ||
+	!zlib_write_all (fd, header, header_len, error)) {
+	if (error && !*error) {
+	    g_set_error (error,
+			 G_FILE_ERROR,
+			 g_file_error_from_errno (errno),
+			 _("Error writing compressed iTunesCDB (%s)."),
+			 g_strerror (errno));
+	}
+	g_free (header);
+	return FALSE;
+    }
+    g_free (header);
+
+    return TRUE;
+}
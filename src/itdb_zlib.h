@@ -34,6 +34,11 @@ G_BEGIN_DECLS
 
 G_GNUC_INTERNAL gboolean itdb_zlib_check_decompress_fimp (FImport *fimp);
 G_GNUC_INTERNAL gboolean itdb_zlib_check_compress_fexp (FExport *fexp);
+G_GNUC_INTERNAL gboolean itdb_zlib_compress_to_fd (const gchar *data,
+						   gsize len, gint fd,
+						   gint level,
+						   gsize *compressed_len,
+						   GError **error);
 
 G_END_DECLS
 
@@ -1038,6 +1038,7 @@ ithumb_writer_update (iThumbWriter *writer)
 	{
 	    fclose (writer->f);
 	    writer->f = NULL;
+	    itdb_fsync_written_file (writer->filename);
 	}
 	g_free (writer->filename);
 	writer->filename = NULL;
@@ -1102,6 +1103,8 @@ ithumb_writer_free (iThumbWriter *writer)
 	    {   /* Remove empty file */
 		unlink (writer->filename);
 	    }
+	    if (writer->filename)
+		itdb_fsync_written_file (writer->filename);
 	}
 	g_free (writer->filename);
 	g_free (writer->thumbs_dir);
@@ -1376,6 +1379,7 @@ static gboolean ithumb_rearrange_thumbnail_file (gpointer _key,
 
   out:
     if (fd != -1) close (fd);
+    itdb_fsync_written_file (filename);
     g_free (buf);
     g_list_free (thumbs);
     return TRUE;
@@ -0,0 +1,156 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Tests that the changes libgpod makes to a track itself are written
+ * out with change tracking enabled (itdb_set_change_tracking()): a
+ * track is written once, then copied to a fake iPod in a temporary
+ * directory with itdb_cp_track_to_ipod() and written again. The
+ * iTunesDB read back must have the ipod_path, size and filetype of the
+ * copied track, not the ones cached by the first write. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "itdb.h"
+
+#define TRACK_SIZE 12345
+
+static void remove_dir (const gchar *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+
+    if (d)
+    {
+	while ((name = g_dir_read_name (d)))
+	{
+	    gchar *filename = g_build_filename (dir, name, NULL);
+	    if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+		remove_dir (filename);
+	    else
+		g_unlink (filename);
+	    g_free (filename);
+	}
+	g_dir_close (d);
+    }
+    g_rmdir (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+    Itdb_iTunesDB *itdb, *parsed;
+    Itdb_Playlist *mpl;
+    Itdb_Track *track, *tr;
+    GError *error = NULL;
+    gchar *mountpoint, *dir, *source, *contents, *ipod_path = NULL;
+    gboolean ok = FALSE;
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init ();
+#endif
+
+    mountpoint = g_strdup_printf ("%s/test-change-tracking-%d",
+				  g_get_tmp_dir (), (int)getpid ());
+    dir = g_build_filename (mountpoint, "iPod_Control", "iTunes", NULL);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+    dir = g_build_filename (mountpoint, "iPod_Control", "Music", "F00", NULL);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+    source = g_build_filename (mountpoint, "source.mp3", NULL);
+    contents = g_malloc0 (TRACK_SIZE);
+    g_file_set_contents (source, contents, TRACK_SIZE, NULL);
+    g_free (contents);
+
+    itdb = itdb_new ();
+    itdb_set_mountpoint (itdb, mountpoint);
+    mpl = itdb_playlist_new ("iPod", FALSE);
+    itdb_playlist_set_mpl (mpl);
+    itdb_playlist_add (itdb, mpl, -1);
+    track = itdb_track_new ();
+    track->title = g_strdup ("Copied track");
+    track->filetype = g_strdup ("MPEG audio file");
+    itdb_track_add (itdb, track, -1);
+    itdb_playlist_add_track (mpl, track, -1);
+
+    itdb_set_change_tracking (itdb, TRUE);
+    if (!itdb_write (itdb, &error))
+	goto leave;
+    if (!itdb_cp_track_to_ipod (track, source, &error))
+	goto leave;
+    ipod_path = g_strdup (track->ipod_path);
+    if (!itdb_write (itdb, &error))
+	goto leave;
+
+    parsed = itdb_parse (mountpoint, &error);
+    if (!parsed)
+	goto leave;
+    tr = parsed->tracks ? parsed->tracks->data : NULL;
+    if (!tr)
+    {
+	g_print ("The track is missing\n");
+    }
+    else if (!tr->ipod_path || (strcmp (tr->ipod_path, ipod_path) != 0))
+    {
+	g_print ("ipod_path is '%s', expected '%s'\n",
+		 tr->ipod_path ? tr->ipod_path : "(null)", ipod_path);
+    }
+    else if ((tr->size != TRACK_SIZE) || !tr->transferred)
+    {
+	g_print ("size is %u, expected %u\n", tr->size, TRACK_SIZE);
+    }
+    else if (tr->filetype_marker != track->filetype_marker)
+    {
+	g_print ("filetype_marker is 0x%08x, expected 0x%08x\n",
+		 tr->filetype_marker, track->filetype_marker);
+    }
+    else
+    {
+	ok = TRUE;
+    }
+    itdb_free (parsed);
+
+leave:
+    if (error)
+    {
+	g_print ("Error: %s\n", error->message);
+	g_error_free (error);
+    }
+    itdb_free (itdb);
+    remove_dir (mountpoint);
+    g_free (ipod_path);
+    g_free (source);
+    g_free (mountpoint);
+
+    g_print (ok ? "All tests passed\n" : "Test failed\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Known-answer tests for the SHA-1 of the bundled gchecksum.c, which
+ * is compiled into this program (and used by libgpod when built with
+ * --with-internal-gchecksum). The FIPS 180 test vectors are hashed in
+ * one go and split at every offset, so that both the block-wise code
+ * and the buffering of partial blocks are covered. This is done with
+ * the SHA extensions of the processor where available and again with
+ * the portable code. Finally the throughput of each is printed. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gchecksum.h"
+
+struct sha1_vector {
+    const gchar *data;
+    guint repeat;
+    const gchar *digest;
+};
+
+static const struct sha1_vector vectors[] = {
+    { "", 1,
+      "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { "abc", 1,
+      "a9993e364706816aba3e25717850c26c9cd0d89d" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+      "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+      "a49b2446a02c645bf419f995b67091253a04a259" },
+    { "a", 1000000,
+      "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+    { "0123456701234567012345670123456701234567012345670123456701234567",
+      10,
+      "dea356a2cddd90c7a7ecedc5ebb563934f460452" },
+};
+
+/* Hash @vector, splitting its data at @split when it is repeated only
+   once */
+static gboolean check_vector (const struct sha1_vector *vector,
+			      gsize split)
+{
+    GChecksum *checksum;
+    gsize len = strlen (vector->data);
+    gboolean result;
+    guint i;
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    if (vector->repeat == 1)
+    {
+	g_checksum_update (checksum, (const guchar *)vector->data, split);
+	g_checksum_update (checksum,
+			   (const guchar *)vector->data + split, len - split);
+    }
+    else
+    {
+	for (i=0; i<vector->repeat; ++i)
+	    g_checksum_update (checksum, (const guchar *)vector->data, len);
+    }
+    result = (strcmp (g_checksum_get_string (checksum),
+		      vector->digest) == 0);
+    if (!result)
+    {
+	g_print ("SHA-1 of \"%.16s...\" x%u split at %" G_GSIZE_FORMAT
+		 ": got %s, expected %s\n",
+		 vector->data, vector->repeat, split,
+		 g_checksum_get_string (checksum), vector->digest);
+    }
+    g_checksum_free (checksum);
+    return result;
+}
+
+/* Runs the known-answer tests and prints the throughput of the SHA-1
+   code currently selected, called @name. Returns the number of
+   failed tests. */
+static guint check_sha1 (const gchar *name)
+{
+    guchar *buffer;
+    GChecksum *checksum;
+    GTimer *timer;
+    gsize size = 64 * 1024 * 1024;
+    gdouble seconds;
+    guint failed = 0;
+    guint i;
+
+    for (i=0; i<G_N_ELEMENTS (vectors); ++i)
+    {
+	gsize len = strlen (vectors[i].data);
+	gsize split;
+
+	if (vectors[i].repeat != 1)
+	    len = 0;
+	for (split=0; split<=len; ++split)
+	{
+	    if (!check_vector (&vectors[i], split))
+		++failed;
+	}
+    }
+    if (failed)
+    {
+	g_print ("%s SHA-1: %u known-answer tests failed\n", name, failed);
+	return failed;
+    }
+
+    buffer = g_malloc0 (size);
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    timer = g_timer_new ();
+    g_checksum_update (checksum, buffer, size);
+    g_checksum_get_string (checksum);
+    seconds = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+    g_checksum_free (checksum);
+    g_free (buffer);
+
+    g_print ("%s SHA-1: known-answer tests passed, %.0f MB/s\n", name,
+	     (seconds > 0) ? size / seconds / (1024 * 1024) : 0);
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    guint failed = 0;
+
+    if (itdb_gchecksum_sha1_accelerated ())
+	failed += check_sha1 ("SHA extensions");
+    else
+	g_print ("SHA extensions not available, not tested\n");
+
+    itdb_gchecksum_sha1_force_generic (TRUE);
+    failed += check_sha1 ("portable");
+
+    return failed ? 1 : 0;
+}
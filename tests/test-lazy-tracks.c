@@ -0,0 +1,180 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Tests the changes made to tracks parsed with
+ * ITDB_PARSE_FLAGS_LAZY_TRACKS: fields set before the tracks are
+ * materialized must be kept, fields cleared before (by setting them to
+ * an empty string) or after materializing them must stay cleared, and
+ * all other fields must be written unchanged. The iPod is faked in a
+ * temporary directory. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "itdb.h"
+
+static void remove_dir (const gchar *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+
+    if (d)
+    {
+	while ((name = g_dir_read_name (d)))
+	{
+	    gchar *filename = g_build_filename (dir, name, NULL);
+	    if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+		remove_dir (filename);
+	    else
+		g_unlink (filename);
+	    g_free (filename);
+	}
+	g_dir_close (d);
+    }
+    g_rmdir (dir);
+}
+
+static gboolean check_field (const gchar *name, const gchar *value,
+			     const gchar *expected)
+{
+    if ((value == NULL) && (expected == NULL))
+	return TRUE;
+    if (value && expected && (strcmp (value, expected) == 0))
+	return TRUE;
+    g_print ("%s is '%s', expected '%s'\n", name,
+	     value ? value : "(null)", expected ? expected : "(null)");
+    return FALSE;
+}
+
+static Itdb_Track *add_track (Itdb_iTunesDB *itdb, const gchar *title)
+{
+    Itdb_Track *track = itdb_track_new ();
+
+    track->title = g_strdup (title);
+    track->artist = g_strdup ("Artist");
+    track->genre = g_strdup ("Genre");
+    track->comment = g_strdup ("Comment");
+    itdb_track_add (itdb, track, -1);
+    itdb_playlist_add_track (itdb_playlist_mpl (itdb), track, -1);
+    return track;
+}
+
+int
+main (int argc, char *argv[])
+{
+    Itdb_iTunesDB *itdb, *lazy = NULL, *parsed = NULL;
+    Itdb_Playlist *mpl;
+    Itdb_Track *first, *second;
+    GError *error = NULL;
+    gchar *mountpoint, *dir;
+    gboolean ok = FALSE;
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init ();
+#endif
+
+    mountpoint = g_strdup_printf ("%s/test-lazy-tracks-%d",
+				  g_get_tmp_dir (), (int)getpid ());
+    dir = g_build_filename (mountpoint, "iPod_Control", "iTunes", NULL);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    itdb = itdb_new ();
+    itdb_set_mountpoint (itdb, mountpoint);
+    mpl = itdb_playlist_new ("iPod", FALSE);
+    itdb_playlist_set_mpl (mpl);
+    itdb_playlist_add (itdb, mpl, -1);
+    add_track (itdb, "First");
+    add_track (itdb, "Second");
+    if (!itdb_write (itdb, &error))
+	goto leave;
+
+    lazy = itdb_parse_with_flags (mountpoint, ITDB_PARSE_FLAGS_LAZY_TRACKS,
+				  &error);
+    if (!lazy)
+	goto leave;
+    first = g_list_nth_data (lazy->tracks, 0);
+    second = g_list_nth_data (lazy->tracks, 1);
+    if (!first || !second)
+    {
+	g_print ("tracks are missing\n");
+	goto leave;
+    }
+    if (!check_field ("title of the lazy track", first->title, NULL))
+	goto leave;
+
+    /* without materializing the track */
+    first->comment = g_strdup ("");
+    first->genre = g_strdup ("Changed");
+    /* after materializing it */
+    if (!itdb_track_materialize (second, &error))
+	goto leave;
+    g_free (second->comment);
+    second->comment = NULL;
+
+    if (!itdb_write (lazy, &error))
+	goto leave;
+
+    parsed = itdb_parse (mountpoint, &error);
+    if (!parsed)
+	goto leave;
+    first = g_list_nth_data (parsed->tracks, 0);
+    second = g_list_nth_data (parsed->tracks, 1);
+    if (!first || !second)
+    {
+	g_print ("tracks are missing after writing\n");
+	goto leave;
+    }
+    ok = check_field ("first title", first->title, "First") &&
+	check_field ("first artist", first->artist, "Artist") &&
+	check_field ("first genre", first->genre, "Changed") &&
+	check_field ("first comment", first->comment, NULL) &&
+	check_field ("second title", second->title, "Second") &&
+	check_field ("second genre", second->genre, "Genre") &&
+	check_field ("second comment", second->comment, NULL);
+
+leave:
+    if (error)
+    {
+	g_print ("Error: %s\n", error->message);
+	g_error_free (error);
+    }
+    if (parsed)
+	itdb_free (parsed);
+    if (lazy)
+	itdb_free (lazy);
+    itdb_free (itdb);
+    remove_dir (mountpoint);
+    g_free (mountpoint);
+
+    g_print (ok ? "All tests passed\n" : "Test failed\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+|  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Benchmark for loading the items of a synthetic library into the
+ * Library.itdb schema. Compares creating the triggers before the
+ * inserts and finding the album artwork with a scan of all items per
+ * album (how Library.itdb used to be built) with creating the
+ * triggers after the inserts and finding the album artwork through a
+ * temporary table (how mk_Library() builds it now). The program fails
+ * if both ways don't give the same data. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <sqlite3.h>
+
+#include "itdb_sqlite_queries.h"
+
+#define NR_ALBUMS_DIVISOR 12
+
+static const char album_artwork_scan[] =
+    "UPDATE album SET artwork_item_pid = (SELECT item.pid FROM item WHERE item.artwork_cache_id != 0 AND item.album_pid = album.pid LIMIT 1);";
+
+static const char summary_query[] =
+    "SELECT (SELECT TOTAL(is_song + 2*is_audio_book + 4*is_music_video + 8*is_movie + 16*is_tv_show + 32*is_ringtone + 64*is_podcast + 128*is_rental) FROM item),"
+    " (SELECT TOTAL(artwork_item_pid) FROM album);";
+
+static gboolean exec (sqlite3 *db, const char *sql)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec (db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+	g_print ("sqlite error: %s\n", errmsg ? errmsg : sqlite3_errmsg (db));
+	sqlite3_free (errmsg);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+/* Loads @nr_items items into a new in-memory Library.itdb, with the
+   triggers created before the inserts if @deferred is FALSE. Stores a
+   summary of the resulting data in @summary and returns the time
+   taken, or a negative value on error. */
+static gdouble load_library (guint nr_items, gboolean deferred,
+			     gdouble summary[2])
+{
+    static const gint media_kinds[] = { 1, 2, 4, 8, 32, 64, 16384, 32768 };
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt_item = NULL;
+    sqlite3_stmt *stmt_album = NULL;
+    sqlite3_stmt *stmt_summary = NULL;
+    guint nr_albums = MAX (1, nr_items / NR_ALBUMS_DIVISOR);
+    GTimer *timer = NULL;
+    gdouble seconds = -1;
+    guint i;
+
+    if (sqlite3_open (":memory:", &db) != SQLITE_OK)
+	goto leave;
+    if (!exec (db, Library_create))
+	goto leave;
+
+    if (sqlite3_prepare_v2 (db, "INSERT INTO item (pid,media_kind,album_pid,artwork_cache_id) VALUES(?,?,?,?);", -1, &stmt_item, NULL) != SQLITE_OK)
+	goto leave;
+    if (sqlite3_prepare_v2 (db, "INSERT OR IGNORE INTO album (pid,name) VALUES(?,?);", -1, &stmt_album, NULL) != SQLITE_OK)
+	goto leave;
+
+    timer = g_timer_new ();
+    if (!exec (db, "BEGIN;"))
+	goto leave;
+    if (!deferred)
+    {   /* skip the UPDATE that sets the flags, the triggers do that */
+	const char *triggers = strstr (Library_create_triggers,
+				       "CREATE TRIGGER");
+	if (!triggers || !exec (db, triggers))
+	    goto leave;
+    }
+
+    for (i=0; i<nr_items; ++i)
+    {
+	gchar *name;
+	guint album = (i * 7919) % nr_albums + 1;
+
+	sqlite3_reset (stmt_item);
+	sqlite3_bind_int64 (stmt_item, 1, ((sqlite3_int64)i * 104729) ^ 0x5ea7beef);
+	sqlite3_bind_int (stmt_item, 2, media_kinds[i % G_N_ELEMENTS (media_kinds)]);
+	sqlite3_bind_int (stmt_item, 3, album);
+	sqlite3_bind_int (stmt_item, 4, (i % 3) ? 0 : i);
+	if (sqlite3_step (stmt_item) != SQLITE_DONE)
+	    goto leave;
+
+	name = g_strdup_printf ("Album %u", album);
+	sqlite3_reset (stmt_album);
+	sqlite3_bind_int (stmt_album, 1, album);
+	sqlite3_bind_text (stmt_album, 2, name, -1, g_free);
+	if (sqlite3_step (stmt_album) != SQLITE_DONE)
+	    goto leave;
+    }
+
+    if (deferred)
+    {
+	if (!exec (db, Library_album_artwork))
+	    goto leave;
+	if (!exec (db, Library_create_triggers))
+	    goto leave;
+    }
+    else
+    {
+	if (!exec (db, album_artwork_scan))
+	    goto leave;
+    }
+    if (!exec (db, "COMMIT;"))
+	goto leave;
+    seconds = g_timer_elapsed (timer, NULL);
+
+    if ((sqlite3_prepare_v2 (db, summary_query, -1, &stmt_summary, NULL) != SQLITE_OK) ||
+	(sqlite3_step (stmt_summary) != SQLITE_ROW))
+    {
+	seconds = -1;
+	goto leave;
+    }
+    summary[0] = sqlite3_column_double (stmt_summary, 0);
+    summary[1] = sqlite3_column_double (stmt_summary, 1);
+
+leave:
+    if (timer)
+	g_timer_destroy (timer);
+    if (seconds < 0)
+	g_print ("Error loading the library: %s\n", sqlite3_errmsg (db));
+    sqlite3_finalize (stmt_summary);
+    sqlite3_finalize (stmt_album);
+    sqlite3_finalize (stmt_item);
+    sqlite3_close (db);
+    return seconds;
+}
+
+int
+main (int argc, char *argv[])
+{
+    guint nr_items, max_items = 60000;
+
+    if (argc >= 2)
+	max_items = atoi (argv[1]);
+
+    g_print ("%10s %12s %12s %10s\n", "items", "row-wise", "deferred", "speedup");
+    for (nr_items = max_items/8; nr_items <= max_items; nr_items *= 2)
+    {
+	gdouble before[2], after[2];
+	gdouble rowwise, deferred;
+
+	if (nr_items == 0)
+	    break;
+
+	rowwise = load_library (nr_items, FALSE, before);
+	deferred = load_library (nr_items, TRUE, after);
+	if ((rowwise < 0) || (deferred < 0))
+	    return 1;
+
+	g_print ("%10u %11.3fs %11.3fs %9.1fx\n", nr_items, rowwise, deferred,
+		 (deferred > 0) ? rowwise / deferred : 0);
+
+	if ((before[0] != after[0]) || (before[1] != after[1]))
+	{
+	    g_print ("Deferred loading gives different data\n");
+	    return 1;
+	}
+    }
+    return 0;
+}
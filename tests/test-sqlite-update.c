@@ -0,0 +1,470 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+|  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Tests the row-by-row update of the sqlite databases on the iPod
+ * (itdb_sqlite_update_file()). An "iPod" Library.itdb and a "new" one
+ * are built from the same schema, the former is updated from the
+ * latter and must then hold the same rows: in tables with a primary
+ * key, in keyless tables like item_to_container, with duplicate rows
+ * and with the triggers recreated, but not run, by the update. A
+ * database with another schema must be left alone. Finally the
+ * checksums of Locations.itdb are computed over an updated file and
+ * compared with the ones of its blocks. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+
+#include "itdb_private.h"
+#include "itdb_sqlite_queries.h"
+
+#define NR_ITEMS 2000
+
+static gboolean exec (sqlite3 *db, const char *sql)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec (db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
+    {
+	g_print ("sqlite error: %s\n", errmsg ? errmsg : sqlite3_errmsg (db));
+	sqlite3_free (errmsg);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+static sqlite3_int64 query_int (sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt = NULL;
+    sqlite3_int64 value = -1;
+
+    if ((sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) == SQLITE_OK) &&
+	(sqlite3_step (stmt) == SQLITE_ROW))
+	value = sqlite3_column_int64 (stmt, 0);
+    else
+	g_print ("sqlite error: %s\n", sqlite3_errmsg (db));
+    sqlite3_finalize (stmt);
+    return value;
+}
+
+/* Builds @dir/Library.itdb the way mk_Library() does. The "new"
+ * database (@changed TRUE) has items deleted, added and changed, a
+ * playlist reordered and a duplicate playlist entry. If @extra_table
+ * is TRUE, its schema differs as well. */
+static gboolean build_library (const gchar *dir, gboolean changed,
+			       gboolean extra_table)
+{
+    gchar *filename = g_build_filename (dir, "Library.itdb", NULL);
+    sqlite3 *db = NULL;
+    gboolean res = FALSE;
+    guint i;
+
+    g_unlink (filename);
+    if (sqlite3_open (filename, &db) != SQLITE_OK)
+	goto leave;
+    if (!exec (db, Library_create) || !exec (db, "BEGIN;"))
+	goto leave;
+    for (i=0; i<NR_ITEMS; ++i)
+    {
+	gchar *sql;
+	gboolean ok;
+
+	if (changed && (i % 100 == 5))
+	    continue;
+	sql = g_strdup_printf (
+	    "INSERT INTO item (pid,media_kind,album_pid,title) VALUES(%u,%u,%u,'title %u');"
+	    "INSERT INTO avformat_info (item_pid,sub_id,bit_rate) VALUES(%u,0,%u);"
+	    "INSERT INTO item_to_container (item_pid,container_pid,physical_order) VALUES(%u,77,%u);",
+	    1000+i, (i % 2) ? 1 : 2, i % 7,
+	    (changed && (i % 100 == 3)) ? i + 1000000 : i,
+	    1000+i, (changed && (i == 7)) ? 320 : 128,
+	    1000+i, (changed && (i == 9)) ? NR_ITEMS : i);
+	ok = exec (db, sql);
+	g_free (sql);
+	if (!ok)
+	    goto leave;
+    }
+    for (i=0; i<7; ++i)
+    {
+	gchar *sql = g_strdup_printf (
+	    "INSERT INTO album (pid,name) VALUES(%u,'album %u');", i, i);
+	gboolean ok = exec (db, sql);
+	g_free (sql);
+	if (!ok)
+	    goto leave;
+    }
+    if (changed)
+    {
+	if (!exec (db, "INSERT INTO item (pid,media_kind,album_pid,title) VALUES(900000,1,3,'new title');"
+		   "INSERT INTO item_to_container (item_pid,container_pid,physical_order) VALUES(900000,77,1);"
+		   "INSERT INTO item_to_container (item_pid,container_pid,physical_order) VALUES(900000,77,1);"))
+	    goto leave;
+    }
+    if (!exec (db, Library_album_artwork) ||
+	!exec (db, Library_create_triggers))
+	goto leave;
+    /* a value the insert trigger would overwrite if it ran during the
+       update */
+    if (changed && !exec (db, "UPDATE item SET is_song = 0 WHERE pid = 900000;"))
+	goto leave;
+    if (extra_table && !exec (db, "CREATE TABLE extra (value INTEGER);"))
+	goto leave;
+    res = exec (db, "COMMIT;");
+
+leave:
+    if (!res)
+	g_print ("Could not build '%s'\n", filename);
+    sqlite3_close (db);
+    g_free (filename);
+    return res;
+}
+
+/* Builds @dir/Locations.itdb with a location for each item, the
+ * locations of every tenth item being changed if @changed is TRUE */
+static gboolean build_locations (const gchar *dir, gboolean changed)
+{
+    gchar *filename = g_build_filename (dir, "Locations.itdb", NULL);
+    sqlite3 *db = NULL;
+    gboolean res = FALSE;
+    guint i;
+
+    g_unlink (filename);
+    if ((sqlite3_open (filename, &db) != SQLITE_OK) ||
+	!exec (db, Locations_create) || !exec (db, "BEGIN;"))
+	goto leave;
+    for (i=0; i<NR_ITEMS; ++i)
+    {
+	gchar *sql = g_strdup_printf (
+	    "INSERT INTO location (item_pid,sub_id,location,file_size) VALUES(%u,0,'F%02u/%s%u.mp3',%u);",
+	    1000+i, i % 50, (changed && (i % 10 == 0)) ? "moved" : "track", i,
+	    i * 4096);
+	gboolean ok = exec (db, sql);
+	g_free (sql);
+	if (!ok)
+	    goto leave;
+    }
+    res = exec (db, "COMMIT;");
+
+leave:
+    if (!res)
+	g_print ("Could not build '%s'\n", filename);
+    sqlite3_close (db);
+    g_free (filename);
+    return res;
+}
+
+/* Returns TRUE if the databases @ipod/@fname and @new/@fname hold the
+ * same schema and the same rows, counting duplicates */
+static gboolean same_contents (const gchar *ipod, const gchar *new,
+			       const gchar *fname)
+{
+    gchar *ipodname = g_build_filename (ipod, fname, NULL);
+    gchar *newname = g_build_filename (new, fname, NULL);
+    sqlite3 *db = NULL;
+    sqlite3_stmt *stmt = NULL;
+    gboolean res = FALSE;
+    char *sql;
+
+    if (sqlite3_open (ipodname, &db) != SQLITE_OK)
+	goto leave;
+    sql = sqlite3_mprintf ("ATTACH DATABASE '%q' AS new;", newname);
+    res = exec (db, sql);
+    sqlite3_free (sql);
+    if (!res)
+	goto leave;
+
+    if (query_int (db, "SELECT EXISTS (SELECT type, name, tbl_name, sql FROM main.sqlite_master EXCEPT SELECT type, name, tbl_name, sql FROM new.sqlite_master)"
+		   " OR EXISTS (SELECT type, name, tbl_name, sql FROM new.sqlite_master EXCEPT SELECT type, name, tbl_name, sql FROM main.sqlite_master);") != 0)
+    {
+	g_print ("%s: the schemas differ\n", fname);
+	res = FALSE;
+	goto leave;
+    }
+
+    if (sqlite3_prepare_v2 (db, "SELECT name FROM main.sqlite_master WHERE type = 'table';",
+			    -1, &stmt, NULL) != SQLITE_OK)
+    {
+	res = FALSE;
+	goto leave;
+    }
+    while (res && (sqlite3_step (stmt) == SQLITE_ROW))
+    {
+	const char *table = (const char *)sqlite3_column_text (stmt, 0);
+
+	/* same set and number of rows; check_library() looks at the
+	   duplicate row */
+	sql = sqlite3_mprintf ("SELECT EXISTS (SELECT * FROM main.\"%w\" EXCEPT SELECT * FROM new.\"%w\")"
+			       " OR EXISTS (SELECT * FROM new.\"%w\" EXCEPT SELECT * FROM main.\"%w\")"
+			       " OR (SELECT COUNT(*) FROM main.\"%w\") != (SELECT COUNT(*) FROM new.\"%w\");",
+			       table, table, table, table, table, table);
+	if (query_int (db, sql) != 0)
+	{
+	    g_print ("%s: table '%s' differs\n", fname, table);
+	    res = FALSE;
+	}
+	sqlite3_free (sql);
+    }
+
+leave:
+    sqlite3_finalize (stmt);
+    sqlite3_close (db);
+    g_free (ipodname);
+    g_free (newname);
+    return res;
+}
+
+/* Checks what can't be seen by comparing the rows: the trigger must
+ * not have run during the update, but must work afterwards. Both
+ * copies of the duplicate playlist entry must be there. */
+static gboolean check_library (const gchar *ipod)
+{
+    gchar *filename = g_build_filename (ipod, "Library.itdb", NULL);
+    sqlite3 *db = NULL;
+    gboolean res = FALSE;
+
+    if (sqlite3_open (filename, &db) != SQLITE_OK)
+	goto leave;
+    if (query_int (db, "SELECT is_song FROM item WHERE pid = 900000;") != 0)
+    {
+	g_print ("Library.itdb: the insert trigger ran during the update\n");
+	goto leave;
+    }
+    if (query_int (db, "SELECT COUNT(*) FROM item_to_container WHERE item_pid = 900000;") != 2)
+    {
+	g_print ("Library.itdb: the duplicate row was not kept\n");
+	goto leave;
+    }
+    if (!exec (db, "INSERT INTO item (pid,media_kind) VALUES(900001,1);"))
+	goto leave;
+    if (query_int (db, "SELECT is_song FROM item WHERE pid = 900001;") != 1)
+    {
+	g_print ("Library.itdb: the insert trigger was not recreated\n");
+	goto leave;
+    }
+    res = exec (db, "DELETE FROM item WHERE pid = 900001;");
+
+leave:
+    sqlite3_close (db);
+    g_free (filename);
+    return res;
+}
+
+static gboolean files_equal (const gchar *name1, const gchar *name2)
+{
+    gchar *contents1 = NULL, *contents2 = NULL;
+    gsize len1, len2;
+    gboolean res;
+
+    res = g_file_get_contents (name1, &contents1, &len1, NULL) &&
+	g_file_get_contents (name2, &contents2, &len2, NULL) &&
+	(len1 == len2) && (memcmp (contents1, contents2, len1) == 0);
+    g_free (contents1);
+    g_free (contents2);
+    return res;
+}
+
+static gboolean copy_file (const gchar *from, const gchar *to)
+{
+    gchar *contents = NULL;
+    gsize len;
+    gboolean res;
+
+    res = g_file_get_contents (from, &contents, &len, NULL) &&
+	g_file_set_contents (to, contents, len, NULL);
+    g_free (contents);
+    return res;
+}
+
+/* Computes the checksums of a Locations.itdb.cbk for @dir/@fname with
+ * itdb_sqlite_cbk_calc_sha1s() and compares them with the SHA-1 of
+ * each 1024 byte block of the file and the SHA-1 of those */
+static gboolean check_cbk (const gchar *dir, const gchar *fname)
+{
+    const guint header_size = 46;
+    gchar *filename = g_build_filename (dir, fname, NULL);
+    gchar *contents = NULL;
+    gsize len, offset, digest_len;
+    GArray *cbk;
+    GChecksum *all;
+    guchar digest[20];
+    gboolean res = FALSE;
+
+    cbk = g_array_sized_new (FALSE, TRUE, 1, header_size + 20);
+    g_array_set_size (cbk, header_size + 20);
+    if (!itdb_sqlite_cbk_calc_sha1s (filename, cbk, header_size) ||
+	!g_file_get_contents (filename, &contents, &len, NULL))
+    {
+	g_print ("%s: could not compute the checksums\n", fname);
+	goto leave;
+    }
+    if (cbk->len != header_size + 20 + (len / 1024) * 20)
+    {
+	g_print ("%s: %u bytes of checksums for %" G_GSIZE_FORMAT " bytes\n",
+		 fname, cbk->len, len);
+	goto leave;
+    }
+
+    all = g_checksum_new (G_CHECKSUM_SHA1);
+    for (offset=0; offset + 1024 <= len; offset += 1024)
+    {
+	GChecksum *block = g_checksum_new (G_CHECKSUM_SHA1);
+	const guchar *expected = (const guchar *)cbk->data + header_size + 20 +
+	    (offset / 1024) * 20;
+
+	g_checksum_update (block, (const guchar *)contents + offset, 1024);
+	digest_len = sizeof (digest);
+	g_checksum_get_digest (block, digest, &digest_len);
+	g_checksum_free (block);
+	if (memcmp (digest, expected, 20) != 0)
+	{
+	    g_print ("%s: wrong checksum of block %" G_GSIZE_FORMAT "\n",
+		     fname, offset / 1024);
+	    g_checksum_free (all);
+	    goto leave;
+	}
+	g_checksum_update (all, digest, 20);
+    }
+    digest_len = sizeof (digest);
+    g_checksum_get_digest (all, digest, &digest_len);
+    g_checksum_free (all);
+    if (memcmp (digest, cbk->data + header_size, 20) != 0)
+    {
+	g_print ("%s: wrong checksum of the checksums\n", fname);
+	goto leave;
+    }
+    res = TRUE;
+
+leave:
+    g_array_free (cbk, TRUE);
+    g_free (contents);
+    g_free (filename);
+    return res;
+}
+
+static gboolean expect (const gchar *what, int result, int expected)
+{
+    g_print ("%-50s %2d (expected %2d)\n", what, result, expected);
+    return result == expected;
+}
+
+static void remove_dir (const gchar *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+
+    if (d)
+    {
+	while ((name = g_dir_read_name (d)))
+	{
+	    gchar *filename = g_build_filename (dir, name, NULL);
+	    g_unlink (filename);
+	    g_free (filename);
+	}
+	g_dir_close (d);
+    }
+    g_rmdir (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+    gchar *base, *ipod, *new, *ipodname, *newname;
+    gboolean ok = TRUE;
+
+    base = g_strdup_printf ("%s/test-sqlite-update-%d", g_get_tmp_dir (),
+			    (int)getpid ());
+    ipod = g_build_filename (base, "ipod", NULL);
+    new = g_build_filename (base, "new", NULL);
+    g_mkdir (base, 0755);
+    g_mkdir (ipod, 0755);
+    g_mkdir (new, 0755);
+
+    /* Library.itdb */
+    ok = ok && build_library (ipod, FALSE, FALSE) &&
+	build_library (new, FALSE, FALSE) &&
+	expect ("Library.itdb, same rows",
+		itdb_sqlite_update_file (new, ipod, "Library.itdb"), 0);
+    ok = ok && build_library (new, TRUE, FALSE) &&
+	expect ("Library.itdb, changed rows",
+		itdb_sqlite_update_file (new, ipod, "Library.itdb"), 1) &&
+	same_contents (ipod, new, "Library.itdb") &&
+	check_library (ipod) &&
+	expect ("Library.itdb, same rows after an update",
+		itdb_sqlite_update_file (new, ipod, "Library.itdb"), 0);
+    ipodname = g_build_filename (ipod, "Library.itdb", NULL);
+    newname = g_build_filename (base, "Library.itdb.orig", NULL);
+    ok = ok && copy_file (ipodname, newname) &&
+	build_library (new, TRUE, TRUE) &&
+	expect ("Library.itdb, other schema",
+		itdb_sqlite_update_file (new, ipod, "Library.itdb"), -1);
+    if (ok && !files_equal (ipodname, newname))
+    {
+	g_print ("Library.itdb: changed although the schema differs\n");
+	ok = FALSE;
+    }
+    g_unlink (newname);
+    g_free (ipodname);
+    g_free (newname);
+    ok = ok && expect ("Library.itdb, not on the iPod",
+		       itdb_sqlite_update_file (new, base, "Library.itdb"), -1);
+
+    /* Locations.itdb and its checksums, which have to be computed
+       over the file on the iPod whenever it was left in place */
+    ipodname = g_build_filename (ipod, "Locations.itdb", NULL);
+    newname = g_build_filename (new, "Locations.itdb", NULL);
+    ok = ok && build_locations (ipod, FALSE) && build_locations (new, TRUE) &&
+	expect ("Locations.itdb, changed rows",
+		itdb_sqlite_update_file (new, ipod, "Locations.itdb"), 1) &&
+	same_contents (ipod, new, "Locations.itdb") &&
+	check_cbk (ipod, "Locations.itdb");
+    ok = ok && build_locations (new, TRUE) &&
+	expect ("Locations.itdb, same rows after an update",
+		itdb_sqlite_update_file (new, ipod, "Locations.itdb"), 0) &&
+	check_cbk (ipod, "Locations.itdb");
+    if (ok && files_equal (ipodname, newname))
+    {
+	g_print ("Locations.itdb: the updated file is the same as the new one,"
+		 " the checksums were not put to the test\n");
+	ok = FALSE;
+    }
+    g_free (ipodname);
+    g_free (newname);
+
+    remove_dir (ipod);
+    remove_dir (new);
+    remove_dir (base);
+    g_free (ipod);
+    g_free (new);
+    g_free (base);
+
+    g_print (ok ? "All tests passed\n" : "Test failed\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,344 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Tests the checksum computed while the iTunesDB is written against
+ * the one itdb_device_write_checksum() computes over the final file,
+ * for hash58, hash72 and (if libhashab is installed) hashAB iPods.
+ * Every checksum type is tried with iTunesDBs assembled in memory and
+ * streamed to disk, with the mhits serialized by one and by several
+ * threads, and with mhits cached by a previous write.
+ *
+ * The iPods are faked in temporary directories: a SysInfoExtended
+ * file selects the checksum type and a HashInfo file is made up for
+ * hash72. Uses libgpod's internal functions, so it is linked
+ * statically. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <glib-object.h>
+
+#include "itdb.h"
+#include "itdb_device.h"
+#include "itdb_private.h"
+
+/* WRITE_TRACKS_THREADED_MIN in itdb_itunesdb.c */
+#define THREADED_TRACKS 1000
+
+#define FIREWIRE_GUID "000A27001A2B3C4D"
+
+typedef struct {
+    const gchar *name;
+    ItdbChecksumType type;
+    gint db_version;   /* DBVersion in SysInfoExtended */
+} ChecksumScheme;
+
+static const ChecksumScheme hash58 = { "hash58", ITDB_CHECKSUM_HASH58, 3 };
+static const ChecksumScheme hash72 = { "hash72", ITDB_CHECKSUM_HASH72, 4 };
+static const ChecksumScheme hashAB = { "hashAB", ITDB_CHECKSUM_HASHAB, 5 };
+
+typedef struct {
+    const gchar *name;
+    guint nr_tracks;
+    guint string_len;  /* length of the title and comment of each track */
+    guint nr_threads;
+    gboolean cached;   /* write twice with change tracking enabled */
+} WriteMode;
+
+static const WriteMode write_modes[] = {
+    { "in memory",          10,              16,   1, FALSE },
+    { "streaming",          900,             6000, 1, FALSE },
+    { "threaded",           THREADED_TRACKS, 16,   4, FALSE },
+    { "threaded streaming", THREADED_TRACKS, 6000, 4, FALSE },
+    { "cached",             10,              16,   1, TRUE },
+    { "cached threaded",    THREADED_TRACKS, 16,   4, TRUE },
+};
+
+static void remove_dir (const gchar *dir)
+{
+    GDir *d = g_dir_open (dir, 0, NULL);
+    const gchar *name;
+
+    if (d)
+    {
+	while ((name = g_dir_read_name (d)))
+	{
+	    gchar *filename = g_build_filename (dir, name, NULL);
+	    if (g_file_test (filename, G_FILE_TEST_IS_DIR))
+		remove_dir (filename);
+	    else
+		g_unlink (filename);
+	    g_free (filename);
+	}
+	g_dir_close (d);
+    }
+    g_rmdir (dir);
+}
+
+/* Create a fake iPod using the checksums of @scheme at @mountpoint */
+static gboolean make_ipod (const gchar *mountpoint,
+			   const ChecksumScheme *scheme)
+{
+    gchar *dir, *filename, *sysinfo;
+    gboolean result;
+
+    dir = g_build_filename (mountpoint, "iPod_Control", "iTunes", NULL);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+    dir = g_build_filename (mountpoint, "iPod_Control", "Device", NULL);
+    g_mkdir_with_parents (dir, 0755);
+
+    sysinfo = g_strdup_printf (
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+	"\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+	"<plist version=\"1.0\">\n"
+	"<dict>\n"
+	"\t<key>FireWireGUID</key>\n"
+	"\t<string>%s</string>\n"
+	"\t<key>SerialNumber</key>\n"
+	"\t<string>8K0000001ZW</string>\n"
+	"\t<key>DBVersion</key>\n"
+	"\t<integer>%d</integer>\n"
+	"</dict>\n"
+	"</plist>\n", FIREWIRE_GUID, scheme->db_version);
+    filename = g_build_filename (dir, "SysInfoExtended", NULL);
+    result = g_file_set_contents (filename, sysinfo, -1, NULL);
+    g_free (filename);
+    g_free (sysinfo);
+
+    if (result && (scheme->type == ITDB_CHECKSUM_HASH72))
+    {   /* header, the GUID padded to 20 bytes, 12 random bytes and
+	   the 16 bytes of the IV */
+	guchar hash_info[54];
+	guint i;
+
+	memset (hash_info, 0, sizeof (hash_info));
+	memcpy (hash_info, "HASHv0", 6);
+	for (i=0; i<8; ++i)
+	{
+	    sscanf (FIREWIRE_GUID + 2*i, "%2hhx", &hash_info[6+i]);
+	}
+	for (i=26; i<sizeof (hash_info); ++i)
+	{
+	    hash_info[i] = i * 7;
+	}
+	filename = g_build_filename (dir, "HashInfo", NULL);
+	result = g_file_set_contents (filename, (gchar *)hash_info,
+				      sizeof (hash_info), NULL);
+	g_free (filename);
+    }
+    g_free (dir);
+    return result;
+}
+
+/* Check the checksum of the iTunesDB at @mountpoint */
+static gboolean check_checksum (Itdb_iTunesDB *itdb, const gchar *mountpoint)
+{
+    gchar *filename, *contents, *expected;
+    gsize len;
+    GError *error = NULL;
+    gboolean result = FALSE;
+
+    filename = itdb_get_itunesdb_path (mountpoint);
+    if (!filename || !g_file_get_contents (filename, &contents, &len, &error))
+    {
+	g_print ("can't read the iTunesDB: %s\n",
+		 error ? error->message : "not found");
+	g_clear_error (&error);
+	g_free (filename);
+	return FALSE;
+    }
+    expected = g_memdup (contents, len);
+    if (!itdb_device_write_checksum (itdb->device, (guchar *)expected,
+				     len, &error))
+    {
+	g_print ("itdb_device_write_checksum() failed: %s\n",
+		 error ? error->message : "no error set");
+	g_clear_error (&error);
+    }
+    else if (memcmp (contents, expected, len) != 0)
+    {
+	g_print ("the checksum differs from itdb_device_write_checksum()\n");
+    }
+    else
+    {
+	result = TRUE;
+    }
+    g_free (expected);
+    g_free (contents);
+    g_free (filename);
+    return result;
+}
+
+static Itdb_iTunesDB *make_itdb (const gchar *mountpoint,
+				 const WriteMode *mode)
+{
+    Itdb_iTunesDB *itdb;
+    Itdb_Playlist *mpl;
+    gchar *filler;
+    guint i;
+
+    itdb = itdb_new ();
+    itdb_set_mountpoint (itdb, mountpoint);
+    mpl = itdb_playlist_new ("iPod", FALSE);
+    itdb_playlist_set_mpl (mpl);
+    itdb_playlist_add (itdb, mpl, -1);
+
+    filler = g_strnfill (mode->string_len, 'x');
+    for (i=0; i<mode->nr_tracks; ++i)
+    {
+	Itdb_Track *track = itdb_track_new ();
+	track->title = g_strdup_printf ("%u %s", i, filler);
+	track->comment = g_strdup (filler);
+	track->artist = g_strdup_printf ("Artist %u", i % 17);
+	track->album = g_strdup_printf ("Album %u", i % 31);
+	track->tracklen = 1000 * i;
+	track->size = 100000 + i;
+	itdb_track_add (itdb, track, -1);
+	itdb_playlist_add_track (mpl, track, -1);
+    }
+    g_free (filler);
+    return itdb;
+}
+
+static gboolean test_write (const ChecksumScheme *scheme,
+			    const WriteMode *mode)
+{
+    Itdb_iTunesDB *itdb;
+    gchar *mountpoint;
+    GError *error = NULL;
+    gboolean result = FALSE;
+
+    mountpoint = g_strdup_printf ("%s/test-write-checksum-%d",
+				  g_get_tmp_dir (), (int)getpid ());
+    if (!make_ipod (mountpoint, scheme))
+    {
+	g_print ("%s, %s: can't create the iPod\n", scheme->name, mode->name);
+	remove_dir (mountpoint);
+	g_free (mountpoint);
+	return FALSE;
+    }
+
+    itdb_set_thread_count (mode->nr_threads);
+    itdb = make_itdb (mountpoint, mode);
+    if (itdb_device_get_checksum_type (itdb->device) != scheme->type)
+    {
+	g_print ("%s, %s: the iPod uses checksum type %d\n", scheme->name,
+		 mode->name, itdb_device_get_checksum_type (itdb->device));
+	goto leave;
+    }
+    if (mode->cached)
+    {
+	Itdb_Track *track;
+
+	itdb_set_change_tracking (itdb, TRUE);
+	if (!itdb_write (itdb, &error))
+	    goto leave;
+	/* one mhit has to be written again */
+	track = g_list_nth_data (itdb->tracks, mode->nr_tracks / 2);
+	track->rating = 80;
+	itdb_track_changed (track);
+    }
+    if (!itdb_write (itdb, &error))
+	goto leave;
+
+    g_print ("%s, %s: ", scheme->name, mode->name);
+    result = check_checksum (itdb, mountpoint);
+    if (result)
+	g_print ("ok\n");
+
+leave:
+    if (error)
+    {
+	g_print ("%s, %s: error writing the iTunesDB: %s\n",
+		 scheme->name, mode->name, error->message);
+	g_error_free (error);
+    }
+    itdb_set_thread_count (0);
+    itdb_free (itdb);
+    remove_dir (mountpoint);
+    g_free (mountpoint);
+    return result;
+}
+
+static gboolean hashAB_available (void)
+{
+    Itdb_iTunesDB *itdb;
+    gchar *mountpoint;
+    guchar sha1[20], signature[57];
+    gboolean result;
+
+    mountpoint = g_strdup_printf ("%s/test-write-checksum-%d",
+				  g_get_tmp_dir (), (int)getpid ());
+    make_ipod (mountpoint, &hashAB);
+    itdb = itdb_new ();
+    itdb_set_mountpoint (itdb, mountpoint);
+    memset (sha1, 0, sizeof (sha1));
+    result = itdb_hashAB_compute_hash_for_sha1 (itdb->device, sha1,
+						signature, NULL);
+    itdb_free (itdb);
+    remove_dir (mountpoint);
+    g_free (mountpoint);
+    return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+    gboolean ok = TRUE;
+    guint i;
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init ();
+#endif
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init (NULL);
+#endif
+
+    for (i=0; i<G_N_ELEMENTS (write_modes); ++i)
+    {
+	ok &= test_write (&hash58, &write_modes[i]);
+	ok &= test_write (&hash72, &write_modes[i]);
+    }
+    if (hashAB_available ())
+    {
+	for (i=0; i<G_N_ELEMENTS (write_modes); ++i)
+	{
+	    ok &= test_write (&hashAB, &write_modes[i]);
+	}
+    }
+    else
+    {
+	g_print ("libhashab isn't installed, hashAB is not tested\n");
+    }
+
+    g_print (ok ? "All tests passed\n" : "Test failed\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/*
+|  The code contained in this file is free software; you can redistribute
+|  it and/or modify it under the terms of the GNU Lesser General Public
+|  License as published by the Free Software Foundation; either version
+|  2.1 of the License, or (at your option) any later version.
+|
+|  This file is distributed in the hope that it will be useful,
+|  but WITHOUT ANY WARRANTY; without even the implied warranty of
+|  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+|  Lesser General Public License for more details.
+|
+|  You should have received a copy of the GNU Lesser General Public
+|  License along with this code; if not, write to the Free Software
+|  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+|
+|  iTunes and iPod are trademarks of Apple
+|
+|  This product is not supported/written/published by Apple!
+|
+*/
+
+/* Benchmark for the preparation of an iTunesDB for writing. Builds
+ * synthetic libraries of increasing size whose master playlist is in
+ * the reverse order of itdb->tracks (the worst case for reordering
+ * itdb->tracks) and times itdb_predict_size(), which runs the same
+ * preparation as itdb_write() followed by the sizing pass. The time
+ * per track should stay roughly constant; the program fails if it
+ * grows by more than MAX_GROWTH between the smallest and the largest
+ * library. */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "itdb.h"
+
+#include <glib-object.h>
+
+#define MAX_GROWTH 3.0
+
+static Itdb_iTunesDB *build_library (guint nr_tracks)
+{
+    Itdb_iTunesDB *itdb;
+    Itdb_Playlist *mpl;
+    guint i;
+
+    itdb = itdb_new ();
+    mpl = itdb_playlist_new ("iPod", FALSE);
+    itdb_playlist_set_mpl (mpl);
+    itdb_playlist_add (itdb, mpl, -1);
+
+    for (i=0; i<nr_tracks; ++i)
+    {
+	Itdb_Track *track = itdb_track_new ();
+
+	track->title = g_strdup_printf ("Track %u", i);
+	track->artist = g_strdup_printf ("Artist %u", i % 997);
+	track->album = g_strdup_printf ("Album %u", i % 4999);
+	track->genre = g_strdup ("Rock");
+	track->ipod_path = g_strdup_printf (":iPod_Control:Music:F%02u:T%06u.mp3",
+					    i % 50, i);
+	track->track_nr = i % 20 + 1;
+	itdb_track_add (itdb, track, -1);
+	/* prepending puts the MPL in reverse order */
+	itdb_playlist_add_track (mpl, track, 0);
+    }
+    return itdb;
+}
+
+int
+main (int argc, char *argv[])
+{
+    guint nr_tracks, max_tracks = 80000;
+    gdouble first = 0, last = 0;
+    GError *error = NULL;
+
+    if (argc >= 2)
+	max_tracks = atoi (argv[1]);
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init ();
+#endif
+
+    g_print ("%10s %12s %14s\n", "tracks", "seconds", "us per track");
+    for (nr_tracks = max_tracks/8; nr_tracks <= max_tracks; nr_tracks *= 2)
+    {
+	Itdb_iTunesDB *itdb;
+	GTimer *timer;
+	gdouble seconds, per_track;
+
+	if (nr_tracks == 0)
+	    break;
+
+	itdb = build_library (nr_tracks);
+
+	timer = g_timer_new ();
+	if (itdb_predict_size (itdb, &error) == 0)
+	{
+	    g_print ("Error preparing database: %s\n",
+		     error ? error->message : "unknown error");
+	    return 1;
+	}
+	seconds = g_timer_elapsed (timer, NULL);
+	g_timer_destroy (timer);
+
+	per_track = seconds * 1e6 / nr_tracks;
+	g_print ("%10u %12.3f %14.2f\n", nr_tracks, seconds, per_track);
+	if (first == 0)
+	    first = per_track;
+	last = per_track;
+
+	itdb_free (itdb);
+    }
+
+    if ((first > 0) && (last > MAX_GROWTH * first))
+    {
+	g_print ("Time per track grew by a factor of %.1f: preparation is not linear\n",
+		 last / first);
+	return 1;
+    }
+    return 0;
+}